@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <string>
+
+#include "image_complete.h"
+#include "profile.h"
+
+using namespace cv;
+using namespace std;
+
+double checkpoint_interval = 30;
+
+/* File layout, in host byte order: the header, then the 3 bytes of every
+   hole pixel of the working image in scanline order. The rest of the image
+   is the pyramid level, so it is not stored. */
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t level, iteration;
+  uint32_t rows, cols;
+  uint32_t hole_pixels;
+  uint64_t fingerprint;
+  uint64_t rng;
+};
+
+static const char checkpoint_magic[8] = {'P', 'M', 'C', 'K', 'P', 'T', '\r', '\n'};
+static const uint32_t checkpoint_version = 1;
+
+/* FNV-1a */
+static void hash_bytes(uint64_t &h, const void *data, size_t n) {
+  const unsigned char *p = (const unsigned char *) data;
+  for (size_t i = 0; i < n; ++i) {
+    h = (h ^ p[i]) * 0x100000001B3ULL;
+  }
+}
+
+static void hash_mat(uint64_t &h, const Mat &m) {
+  int dims[3] = {m.rows, m.cols, m.type()};
+  hash_bytes(h, dims, sizeof(dims));
+  for (int y = 0; y < m.rows; ++y) {
+    hash_bytes(h, m.ptr(y), m.cols*m.elemSize());
+  }
+}
+
+uint64_t completion_fingerprint(CompletionPyramid &pyramid, int nlevels) {
+  uint64_t h = 0xCBF29CE484222325ULL;
+  hash_mat(h, pyramid.image(0));
+  hash_mat(h, pyramid.mask(0));
+  hash_mat(h, pyramid.constraint(0));
+  const CompletionSchedule &s = completion_schedule;
+  int params[] = {nlevels, patch_w, pm_iters, rs_max, sigma, (int) pm_seed, (int) pm_sweep_mode, pm_jumps,
+                  pm_tile_rows, s.levels, s.max_levels, s.em_coarse, s.em_fine};
+  double ratios[] = {s.hole_radius, s.pm_coarse};
+  hash_bytes(h, params, sizeof(params));
+  hash_bytes(h, ratios, sizeof(ratios));
+  return h;
+}
+
+bool load_checkpoint(const string &path, uint64_t fingerprint, CompletionPyramid &pyramid, CompletionState &state) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  CheckpointHeader h;
+  bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, checkpoint_magic, sizeof(h.magic)) == 0 &&
+            h.version == checkpoint_version;
+  if (ok && h.fingerprint != fingerprint) {
+    printf("checkpoint: '%s' is from another job, starting over\n", path.c_str());
+    ok = false;
+  }
+  if (ok) {
+    ok = (int) h.level < pyramid.levels() && (int) h.rows == pyramid.image(h.level).rows &&
+         (int) h.cols == pyramid.image(h.level).cols && (int) h.hole_pixels == countNonZero(pyramid.mask(h.level));
+  }
+  vector<unsigned char> hole;
+  if (ok) {
+    hole.resize(3*(size_t) h.hole_pixels);
+    ok = hole.empty() || fread(&hole[0], 1, hole.size(), f) == hole.size();
+  }
+  fclose(f);
+  if (!ok) {
+    return false;
+  }
+
+  state.level = h.level;
+  state.iteration = h.iteration;
+  state.rng = h.rng;
+  state.mask = pyramid.mask(h.level);
+  state.image = pyramid.image(h.level).clone();
+  const unsigned char *p = hole.empty() ? NULL : &hole[0];
+  for (int y = 0; y < state.image.rows; ++y) {
+    const uchar *mrow = state.mask.ptr(y);
+    uchar *row = state.image.ptr(y);
+    for (int x = 0; x < state.image.cols; ++x) {
+      if (mrow[x]) {
+        memcpy(&row[3*x], p, 3);
+        p += 3;
+      }
+    }
+  }
+  printf("checkpoint: resuming level %d at EM iteration %d from '%s'\n", state.level, state.iteration, path.c_str());
+  return true;
+}
+
+/* Writes state to path.tmp and renames it over path. */
+static bool write_checkpoint(const string &path, uint64_t fingerprint, const CompletionState &state) {
+  PROFILE_SCOPE_ARG("checkpoint_write", state.level);
+  CheckpointHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, checkpoint_magic, sizeof(h.magic));
+  h.version = checkpoint_version;
+  h.level = state.level;
+  h.iteration = state.iteration;
+  h.rows = state.image.rows;
+  h.cols = state.image.cols;
+  h.hole_pixels = countNonZero(state.mask);
+  h.fingerprint = fingerprint;
+  h.rng = state.rng;
+
+  vector<unsigned char> hole;
+  hole.reserve(3*(size_t) h.hole_pixels);
+  for (int y = 0; y < state.image.rows; ++y) {
+    const uchar *mrow = state.mask.ptr(y);
+    const uchar *row = state.image.ptr(y);
+    for (int x = 0; x < state.image.cols; ++x) {
+      if (mrow[x]) {
+        hole.insert(hole.end(), &row[3*x], &row[3*x] + 3);
+      }
+    }
+  }
+
+  string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "checkpoint: could not open '%s'\n", tmp.c_str());
+    return false;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && (hole.empty() || fwrite(&hole[0], 1, hole.size(), f) == hole.size());
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "checkpoint: could not write '%s'\n", path.c_str());
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+static double now_seconds() {
+  return (double) getTickCount() / getTickFrequency();
+}
+
+CheckpointWriter::CheckpointWriter(const string &path_, uint64_t fingerprint_)
+    : path(path_), fingerprint(fingerprint_), last_post(now_seconds()), has_pending(false), writing(false),
+      stopping(false) {
+  writer = thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+}
+
+bool CheckpointWriter::due() const {
+  return now_seconds() - last_post >= checkpoint_interval;
+}
+
+void CheckpointWriter::post(const CompletionState &state) {
+  CompletionState copy = state;
+  copy.image = state.image.clone();
+  {
+    lock_guard<mutex> lock(m);
+    pending = copy;
+    has_pending = true;
+  }
+  last_post = now_seconds();
+  wake.notify_one();
+}
+
+void CheckpointWriter::remove() {
+  unique_lock<mutex> lock(m);
+  has_pending = false;
+  idle.wait(lock, [this]() { return !writing; });
+  ::remove(path.c_str());
+}
+
+void CheckpointWriter::run() {
+  unique_lock<mutex> lock(m);
+  for (;;) {
+    wake.wait(lock, [this]() { return has_pending || stopping; });
+    if (!has_pending) {
+      return;
+    }
+    CompletionState state = pending;
+    pending = CompletionState();
+    has_pending = false;
+    writing = true;
+    lock.unlock();
+    write_checkpoint(path, fingerprint, state);
+    lock.lock();
+    writing = false;
+    idle.notify_all();
+  }
+}
@@ -25,6 +25,8 @@
 
 #include <iostream>
 
+#include "pm_engine.h"
+
 #ifndef MAX
 #define MAX(a, b) ((a)>(b)?(a):(b))
 #define MIN(a, b) ((a)<(b)?(a):(b))
@@ -146,39 +148,7 @@ bool inBox(int x, int y, int box_xmin, int box_xmax, int box_ymin, int box_ymax)
 /* Measure distance between 2 patches with upper left corners (ax, ay) and (bx, by), terminating early if we exceed a cutoff distance.
    You could implement your own descriptor here. */
 int dist(BITMAP *a, BITMAP *b, int ax, int ay, int bx, int by, BITMAP *mask, int cutoff=INT_MAX) {
-  int ans = 0;
-  for (int dy = 0; dy < patch_w; dy++) {
-    int *arow = &(*a)[ay+dy][ax];
-    int *brow = &(*b)[by+dy][bx];
-    for (int dx = 0; dx < patch_w; dx++) {
-      int ac = arow[dx];
-      int bc = brow[dx];
-      int dr = (ac&255)-(bc&255);
-      int dg = ((ac>>8)&255)-((bc>>8)&255);
-      int db = (ac>>16)-(bc>>16);
-      ans += dr*dr + dg*dg + db*db;
-    }
-    if (ans >= cutoff) { return cutoff; }
-  }
-  if (ans < 0) return INT_MAX;
-  return ans;
-}
-
-void improve_guess(BITMAP *a, BITMAP *b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by, BITMAP *mask, int type) {
-  int d = dist(a, b, ax, ay, bx, by, mask, dbest);
-  if ((d < dbest) && (ax != bx || ay != by) ) {
-#ifdef DEBUG
-      if (type == 0)
-        printf("  Prop x: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-      else if (type == 1)
-        printf("  Prop y: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-      else
-        printf("  Random: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-#endif
-    dbest = d;
-    xbest = bx;
-    ybest = by;
-  }
+  return PackedL2Distance(a->data, a->w, b->data, b->w, patch_w)(ax, ay, bx, by, cutoff);
 }
 
 /* Get the bounding box of hole */
@@ -234,13 +204,25 @@ BITMAP *norm_image(double *accum, int w, int h, BITMAP *ainit=NULL) {
   return ans;
 }
 
+typedef PatchMatchEngine<PackedL2Distance, OutsideBoxSource, WindowSampling<CRand, false> > CompletionEngine;
+
+/* Search for the patches in the hole's bounding box, matching a against its own patches outside the box. */
+CompletionEngine completion_engine(BITMAP *a, BITMAP *mask, BITMAP *ann, BITMAP *annd,
+                                   int box_xmin, int box_xmax, int box_ymin, int box_ymax) {
+  int mew = mask->w - patch_w + 1, meh = mask->h - patch_w + 1;
+  PMField field = {ann->data, annd->data, ann->w};
+  PMRegion region = {box_xmin, box_xmax, box_ymin, box_ymax};
+  return CompletionEngine(PackedL2Distance(a->data, a->w, a->data, a->w, patch_w),
+                          OutsideBoxSource(box_xmin, box_xmax, box_ymin, box_ymax, patch_w),
+                          WindowSampling<CRand, false>(mew, meh, rs_max, a->w, a->h), field, region, mew, meh);
+}
+
 /* Match image a to image b, returning the nearest neighbor field mapping a => b coords, stored in an RGB 24-bit image as (by<<12)|bx. */
 void patchmatch(BITMAP *a, BITMAP *mask, BITMAP *&ans, BITMAP *&ann, BITMAP *&annd) {
   /* Initialize with random nearest neighbor field (NNF). */
   ann = new BITMAP(a->w, a->h);
   annd = new BITMAP(a->w, a->h);
   //int aew = a->w - patch_w+1, aeh = a->h - patch_w + 1;       /* Effective width and height (possible upper left corners of patches). */
-  int mew = mask->w - patch_w+1, meh = mask->h - patch_w + 1;
   memset(ann->data, 0, sizeof(int)*a->w*a->h);
   memset(annd->data, 0, sizeof(int)*a->w*a->h);
 
@@ -251,27 +233,8 @@ void patchmatch(BITMAP *a, BITMAP *mask, BITMAP *&ans, BITMAP *&ann, BITMAP *&an
 
   getBox(mask, box_xmin, box_xmax, box_ymin, box_ymax);
 
-  int bx, by;
   // Initialization
-  for (int ay = box_ymin; ay < box_ymax; ay++) {
-    for (int ax = box_xmin; ax < box_xmax; ax++) {
-      bool valid = false;
-      while (!valid) {
-        bx = rand()%mew;
-        by = rand()%meh;
-        // should find patches outside bounding box
-        if (inBox(bx, by, box_xmin, box_xmax, box_ymin, box_ymax)) {
-        // or outside the hole
-        //if (isHole(mask, bx, by) && isHole(mask, bx+patch_w, by+patch_w)) {
-          valid = false;
-        } else {
-          valid = true;
-        }
-      }
-      (*ann)[ay][ax] = XY_TO_INT(bx, by);
-      (*annd)[ay][ax] = dist(a, a, ax, ay, bx, by, mask);
-    }
-  }
+  completion_engine(a, mask, ann, annd, box_xmin, box_xmax, box_ymin, box_ymax).init();
 
 
 
@@ -283,62 +246,7 @@ void patchmatch(BITMAP *a, BITMAP *mask, BITMAP *&ans, BITMAP *&ann, BITMAP *&an
   int w = 1;
   for (int iter = 0; iter < pm_iters; iter++) {
     printf("iter = %d\n", iter);
-    /* In each iteration, improve the NNF, by looping in scanline or reverse-scanline order. */
-    int ystart = box_ymin, yend = box_ymax, ychange = 1;
-    int xstart = box_xmin, xend = box_xmax, xchange = 1;
-    if (iter % 2 == 1) {
-      xstart = box_xmax-1; xend = box_xmin-1; xchange = -1;
-      ystart = box_ymax-1; yend = box_ymin-1; ychange = -1;
-    }
-    for (int ay = ystart; ay != yend; ay += ychange) {
-      for (int ax = xstart; ax != xend; ax += xchange) { 
-        /* Current (best) guess. */
-        int v = (*ann)[ay][ax];
-        int xbest = INT_TO_X(v), ybest = INT_TO_Y(v);
-        int dbest = (*annd)[ay][ax];
-
-        /* Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). */
-        if ((unsigned) (ax - xchange) < (unsigned) mew) {
-        //if (inBox(ax - xchange, ay, box_xmin, box_xmax, box_ymin, box_ymax)) {
-          int vp = (*ann)[ay][ax-xchange];
-          int xp = INT_TO_X(vp) + xchange, yp = INT_TO_Y(vp);
-          if (((unsigned) xp < (unsigned) mew) && !inBox(xp, yp, box_xmin, box_xmax, box_ymin, box_ymax)) {
-          //if (((unsigned) xp < (unsigned) mew)) {
-            //printf("Propagation x\n");
-            improve_guess(a, a, ax, ay, xbest, ybest, dbest, xp, yp, mask, 0);
-          }
-        }
-
-        if ((unsigned) (ay - ychange) < (unsigned) meh) {
-        //if (inBox(ax, ay - ychange, box_xmin, box_xmax, box_ymin, box_ymax)) {
-          int vp = (*ann)[ay-ychange][ax];
-          int xp = INT_TO_X(vp), yp = INT_TO_Y(vp) + ychange;
-          if (((unsigned) yp < (unsigned) meh) && !inBox(xp, yp, box_xmin, box_xmax, box_ymin, box_ymax)) {
-          //if (((unsigned) yp < (unsigned) meh)) {
-            //printf("Propagation y\n");
-            improve_guess(a, a, ax, ay, xbest, ybest, dbest, xp, yp, mask, 1);
-          }
-        }
-
-        /* Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. */
-        int rs_start = rs_max;
-        if (rs_start > MAX(a->w, a->h)) { rs_start = MAX(a->w, a->h); }
-        for (int mag = rs_start; mag >= 1; mag /= 2) {
-          /* Sampling window */
-          int xmin = MAX(xbest-mag, 0), xmax = MIN(xbest+mag+1, mew);
-          int ymin = MAX(ybest-mag, 0), ymax = MIN(ybest+mag+1, meh);
-          int xp = xmin+rand()%(xmax-xmin);
-          int yp = ymin+rand()%(ymax-ymin);
-          if (!inBox(xp, yp, box_xmin, box_xmax, box_ymin, box_ymax)) {
-            //printf("Random\n");
-            improve_guess(a, a, ax, ay, xbest, ybest, dbest, xp, yp, mask, 2);
-          }
-        }
-
-        (*ann)[ay][ax] = XY_TO_INT(xbest, ybest);
-        (*annd)[ay][ax] = dbest;
-      }
-    }
+    completion_engine(a, mask, ann, annd, box_xmin, box_xmax, box_ymin, box_ymax).sweep(iter);
 
     std::stringstream ss;
     ss << iter;
@@ -460,7 +368,14 @@ void reconstruct(BITMAP *a, BITMAP *b, BITMAP *ann, BITMAP *&r) {
 int main(int argc, char *argv[]) {
   argc--;
   argv++;
-  if (argc != 3) { fprintf(stderr, "im_complete a mask result\n"
+  unsigned int seed = 1; // rand() is seeded explicitly so runs can be repeated
+  if (argc >= 2 && strcmp(argv[0], "--seed") == 0) {
+    seed = (unsigned int) strtoul(argv[1], NULL, 10);
+    argc -= 2;
+    argv += 2;
+  }
+  srand(seed);
+  if (argc != 3) { fprintf(stderr, "im_complete [--seed n] a mask result\n"
                                    "Given input image a and mask outputs result\n"
                                    "These are stored as RGB 24-bit images, with a 24-bit int at every pixel. For the NNF we store (by<<12)|bx."); exit(1); }
   printf("(1) Loading input images\n");
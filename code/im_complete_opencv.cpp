@@ -26,6 +26,8 @@
 
 #include <iostream>
 
+#include "pm_engine.h"
+
 #ifndef MAX
 #define MAX(a, b) ((a)>(b)?(a):(b))
 #define MIN(a, b) ((a)<(b)?(a):(b))
@@ -172,42 +174,11 @@ bool inBox(int x, int y, Box box) {
 /* Measure distance between 2 patches with upper left corners (ax, ay) and (bx, by), terminating early if we exceed a cutoff distance.
    You could implement your own descriptor here. */
 int dist(Mat a, Mat b, int ax, int ay, int bx, int by, int cutoff=INT_MAX) {
-  int ans = 0;
   if (a.type() != CV_8UC3) {
     cout << "Bad things happened in dist " <<endl;
     exit(1);
   }
-  for (int dy = 0; dy < patch_w; dy++) {
-    for (int dx = 0; dx < patch_w; dx++) {
-      Vec3b ac = a.at<Vec3b>(ay + dy, ax + dx);
-      Vec3b bc = b.at<Vec3b>(by + dy, bx + dx);
-
-      int db = ac[0] - bc[0];
-      int dg = ac[1] - bc[1];
-      int dr = ac[2] - bc[2];
-      ans += dr*dr + dg*dg + db*db;
-    }
-    if (ans >= cutoff) { return cutoff; }
-  }
-  if (ans < 0) return INT_MAX;
-  return ans;
-}
-
-void improve_guess(Mat a, Mat b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by, int type) {
-  int d = dist(a, b, ax, ay, bx, by, dbest);
-  if ((d < dbest) && (ax != bx || ay != by) ) {
-#ifdef DEBUG
-      if (type == 0)
-        printf("  Prop x: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-      else if (type == 1)
-        printf("  Prop y: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-      else
-        printf("  Random: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-#endif
-    dbest = d;
-    xbest = bx;
-    ybest = by;
-  }
+  return Bgr8L2Distance(a.ptr(), a.step[0], b.ptr(), b.step[0], patch_w)(ax, ay, bx, by, cutoff);
 }
 
 /* Match image a to image b, returning the nearest neighbor field mapping a => b coords, stored in an RGB 24-bit image as (by<<12)|bx. */
@@ -220,29 +191,20 @@ void patchmatch(Mat a, Mat b, BITMAP *&ann, BITMAP *&annd, Mat dilated_mask) {
   int bew = b.cols - patch_w + 1, beh = b.rows - patch_w + 1;
   memset(ann->data, 0, sizeof(int) * a.cols * a.rows);
   memset(annd->data, 0, sizeof(int) * a.cols * a.rows);
-
-
-  // Initialization
-  int bx, by;
-  for (int ay = 0; ay < aeh; ay++) {
-    for (int ax = 0; ax < aew; ax++) {
-      bool valid = false;
-      while (!valid) {
-        bx = rand() % bew;
-        by = rand() % beh;
-        int mask_pixel = (int) dilated_mask.at<uchar>(by, bx);
-        // should find patches outside the hole
-        if (mask_pixel == 255) {
-          valid = false;
-        } else {
-          valid = true;
-        }
-      }
-      (*ann)[ay][ax] = XY_TO_INT(bx, by);
-      (*annd)[ay][ax] = dist(a, b, ax, ay, bx, by);
-    }
+  if (a.type() != CV_8UC3) {
+    cout << "Bad things happened in dist " <<endl;
+    exit(1);
   }
 
+  PMField field = {ann->data, annd->data, ann->w};
+  PMRegion region = {0, aew, 0, aeh};
+  PatchMatchEngine<Bgr8L2Distance, OutsideMaskSource, WindowSampling<CRand, true> > engine(
+      Bgr8L2Distance(a.ptr(), a.step[0], b.ptr(), b.step[0], patch_w),
+      OutsideMaskSource(dilated_mask.ptr(), dilated_mask.step[0]),
+      WindowSampling<CRand, true>(bew, beh, rs_max, b.cols, b.rows),
+      field, region, bew, beh);
+  engine.init();
+
 #ifdef DEBUG
   for (int ay = 0; ay < aeh; ay++ ) {
     for (int ax = 0; ax < aew; ax++) {
@@ -258,69 +220,7 @@ void patchmatch(Mat a, Mat b, BITMAP *&ann, BITMAP *&annd, Mat dilated_mask) {
 #endif
 
   for (int iter = 0; iter < pm_iters; iter++) {
-    // printf("  pm_iter = %d\n", iter);
-    /* In each iteration, improve the NNF, by looping in scanline or reverse-scanline order. */
-    int ystart = 0, yend = aeh, ychange = 1;
-    int xstart = 0, xend = aew, xchange = 1;
-    if (iter % 2 == 1) {
-      xstart = xend-1; xend = -1; xchange = -1;
-      ystart = yend-1; yend = -1; ychange = -1;
-    }
-    for (int ay = ystart; ay != yend; ay += ychange) {
-      for (int ax = xstart; ax != xend; ax += xchange) {
-        /* Current (best) guess. */
-        int v = (*ann)[ay][ax];
-        int xbest = INT_TO_X(v), ybest = INT_TO_Y(v);
-        int dbest = (*annd)[ay][ax];
-
-        /* Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). */
-        if ((unsigned) (ax - xchange) < (unsigned) aew) {
-          int vp = (*ann)[ay][ax-xchange];
-          int xp = INT_TO_X(vp) + xchange, yp = INT_TO_Y(vp);
-
-          if (((unsigned) xp < (unsigned) aew)) {
-            int mask_pixel = (int) dilated_mask.at<uchar>(yp, xp);
-            if (mask_pixel != 255) {
-              improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 0);
-            }
-          }
-        }
-
-        if ((unsigned) (ay - ychange) < (unsigned) aeh) {
-          int vp = (*ann)[ay-ychange][ax];
-          int xp = INT_TO_X(vp), yp = INT_TO_Y(vp) + ychange;
-
-          if (((unsigned) yp < (unsigned) aeh)) {
-            int mask_pixel = (int) dilated_mask.at<uchar>(yp, xp);
-            if (mask_pixel != 255) {
-              improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 1);
-            }
-          }
-        }
-
-        /* Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. */
-        int rs_start = rs_max;
-        if (rs_start > MAX(b.cols, b.rows)) { rs_start = MAX(b.cols, b.rows); }
-        for (int mag = rs_start; mag >= 1; mag /= 2) {
-          /* Sampling window */
-          int xmin = MAX(xbest-mag, 0), xmax = MIN(xbest+mag+1, bew);
-          int ymin = MAX(ybest-mag, 0), ymax = MIN(ybest+mag+1, beh);
-          bool do_improve = false;
-          do {
-            int xp = xmin + rand() % (xmax-xmin);
-            int yp = ymin + rand() % (ymax-ymin);
-            int mask_pixel = (int) dilated_mask.at<uchar>(yp, xp);
-            if (mask_pixel != 255) {
-              improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 2);
-              do_improve = true;
-            }
-          } while (!do_improve);
-        }
-
-        (*ann)[ay][ax] = XY_TO_INT(xbest, ybest);
-        (*annd)[ay][ax] = dbest;
-      }
-    }
+    engine.sweep(iter);
   }
 }
 
@@ -440,14 +340,14 @@ void image_complete(Mat im_orig, Mat mask) {
       // create new image by letting each patch vote
       Mat R = Mat::zeros(resize_img.rows, resize_img.cols, CV_32FC3);
       Mat Rcount = Mat::zeros(resize_img.rows, resize_img.cols, CV_32FC3);
+      const GaussianWeightTable &weights = gaussian_weight_table(sigma);
       for (int y = mask_box.ymin; y < mask_box.ymax; ++y) {
         for (int x = mask_box.xmin; x < mask_box.xmax; ++x) {
             int v = (*ann)[y][x];
             int xbest  = INT_TO_X(v), ybest = INT_TO_Y(v);
             Rect srcRect(Point(x, y), Size(patch_w, patch_w));
             Rect dstRect(Point(xbest, ybest), Size(patch_w, patch_w));
-            float d = (float) (*annd)[y][x];
-            float sim = exp(-d / (2*pow(sigma, 2) ));
+            float sim = weights((*annd)[y][x]);
             Mat toAssign;
             addWeighted(R(srcRect), 1.0, resize_img(dstRect), sim, 0, toAssign, CV_32FC3);
             toAssign.copyTo(R(srcRect));
@@ -455,7 +355,7 @@ void image_complete(Mat im_orig, Mat mask) {
             toAssign.copyTo(Rcount(srcRect));
 /*
             Mat debugR = Rcount.clone();
-            cout << "Hole (" << x << ", " << y << ") has sim2 " << exp(-d / (2*pow(sigma, 2))) <<endl;
+            cout << "Hole (" << x << ", " << y << ") has sim2 " << sim <<endl;
             cout << sum(Rcount - debugR) <<endl;
 */
         }
@@ -554,7 +454,14 @@ void image_complete(Mat im_orig, Mat mask) {
 int main(int argc, char *argv[]) {
   argc--;
   argv++;
-  if (argc != 3) { fprintf(stderr, "im_complete a mask result\n"
+  unsigned int seed = 1; // rand() is seeded explicitly so runs can be repeated
+  if (argc >= 2 && strcmp(argv[0], "--seed") == 0) {
+    seed = (unsigned int) strtoul(argv[1], NULL, 10);
+    argc -= 2;
+    argv += 2;
+  }
+  srand(seed);
+  if (argc != 3) { fprintf(stderr, "im_complete [--seed n] a mask result\n"
                                    "Given input image a and mask outputs result\n"
                                    "These are stored as RGB 24-bit images, with a 24-bit int at every pixel."); exit(1); }
 
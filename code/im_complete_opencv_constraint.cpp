@@ -26,7 +26,15 @@
 
 #include <iostream>
 #include <vector>
-#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <memory>
+
+#include "image_complete.h"
+#include "profile.h"
+#include "pm_stats.h"
+#include "pm_engine.h"
 
 #ifndef MAX
 #define MAX(a, b) ((a)>(b)?(a):(b))
@@ -38,64 +46,47 @@
 using namespace cv;
 using namespace std;
 
-/* -------------------------------------------------------------------------
-   BITMAP: Minimal image class
-   ------------------------------------------------------------------------- */
-
-class BITMAP { public:
-  int w, h;
-  int *data;
-  BITMAP(int w_, int h_) :w(w_), h(h_) { data = new int[w*h]; }
-  BITMAP(BITMAP* bm) {
-    w = bm->w;
-    h = bm->h;
-    data = new int[w*h];
-    for (int i = 0; i < w*h; ++i) {
-        data[i] = bm->data[i];
+void getConstraintIndex(Mat constraint, Mat dilated_mask, int bew, int beh, ConstraintIndex *index) {
+  index->clear();
+  // count per label, then place every pixel at its label's offset
+  int count[256] = {0};
+  for (int y = 0; y < beh; ++y) {
+    const uchar *cons_row = constraint.ptr<uchar>(y);
+    const uchar *mask_row = dilated_mask.ptr<uchar>(y);
+    for (int x = 0; x < bew; ++x) {
+      if (cons_row[x] != 0 && mask_row[x] != 255) {
+        count[cons_row[x]]++;
+      }
     }
   }
-  ~BITMAP() { delete[] data; }
-  int *operator[](int y) { return &data[y*w]; }
-};
-
-
-// Just a simple struct for Box
-struct Box {
-  int xmin, xmax, ymin, ymax;
-};
-
-// a struct for constraint map
-struct CMap {
-  unordered_map<int, vector<pair<int, int> > > constraint_map;
-  vector<int> constraint_ids;
-};
-
-void getCMap(Mat constraint, CMap* cmap) {
-  unordered_map<int, vector<pair<int, int> > >::iterator got;
-  for (int y = 0; y < constraint.rows; ++y) {
-    for (int x = 0; x < constraint.cols; ++x) {
-      int cons_pixel = (int) constraint.at<uchar>(y, x);
-      if (cons_pixel == 0)
-          continue;
-      got = cmap->constraint_map.find(cons_pixel);
-      if (got == cmap->constraint_map.end()) {
-        vector<pair<int, int> > constraint_vector;
-        constraint_vector.push_back(make_pair(x, y));
-        cmap->constraint_map[cons_pixel] = constraint_vector;
-        cmap->constraint_ids.push_back(cons_pixel);
-      } else {
-        got->second.push_back(make_pair(x, y));
+  for (int l = 0; l < 256; ++l) {
+    index->offset[l+1] = index->offset[l] + count[l];
+    if (l != 0 && count[l] > 0) {
+      index->constraint_ids.push_back(l);
+    }
+  }
+  index->xy.resize(index->offset[256]);
+  int next[256];
+  memcpy(next, index->offset, sizeof(next));
+  for (int y = 0; y < beh; ++y) {
+    const uchar *cons_row = constraint.ptr<uchar>(y);
+    const uchar *mask_row = dilated_mask.ptr<uchar>(y);
+    for (int x = 0; x < bew; ++x) {
+      if (cons_row[x] != 0 && mask_row[x] != 255) {
+        index->xy[next[cons_row[x]]++] = XY_TO_INT(x, y);
       }
     }
   }
 
+#ifdef DEBUG
   cout << "Rows: " << constraint.rows << ", Cols: " << constraint.cols << endl;
   cout << constraint.rows * constraint.cols << endl;
-  cout << "Map has size of " << cmap->constraint_map.size() << endl;
-  for (int i = 0; i < cmap->constraint_ids.size(); ++i) {
-    int id = cmap->constraint_ids[i];
-    cout << "  Map id " << id << " has " << cmap->constraint_map.find(id)->second.size() << " elements " <<endl;
+  cout << "Index has " << index->constraint_ids.size() << " labels" << endl;
+  for (int i = 0; i < index->constraint_ids.size(); ++i) {
+    int id = index->constraint_ids[i];
+    cout << "  Label " << id << " has " << index->count(id) << " elements " <<endl;
   }
+#endif
 
 }
 
@@ -107,10 +98,31 @@ int patch_w  = 8;
 int pm_iters = 5;
 int rs_max   = INT_MAX; // random search
 int sigma = 1 * patch_w * patch_w;
+unsigned int pm_seed = 1;
+int pm_threads = 0;
+PMSweepMode pm_sweep_mode = PM_SWEEP_SCANLINE;
+int pm_jumps = 2;
+int pm_tile_rows = 4;
+
+thread_local unsigned long long pm_rng_state = 0x9E3779B97F4A7C15ULL;
+
+// splitmix64, so nearby seeds give unrelated streams and the state is never 0
+static void pm_seed_state(unsigned long long z) {
+  z += 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  pm_rng_state = z ? z : 0x9E3779B97F4A7C15ULL;
+}
 
-#define XY_TO_INT(x, y) (((y)<<12)|(x))
-#define INT_TO_X(v) ((v)&((1<<12)-1))
-#define INT_TO_Y(v) ((v)>>12)
+void pm_srand(unsigned int seed) {
+  pm_seed_state(seed);
+}
+
+void pm_srand(unsigned int seed, unsigned int stream) {
+  // splitmix64 is a bijection, so distinct pairs never share a state
+  pm_seed_state((unsigned long long) seed << 32 | stream);
+}
 
 /* Get the bounding box of hole */
 Box getBox(Mat mask) {
@@ -144,11 +156,30 @@ Box getBox(Mat mask) {
   xmax = (xmax > mask.cols - patch_w + 1) ? mask.cols - patch_w +1 : xmax;
   ymax = (ymax > mask.rows - patch_w + 1) ? mask.rows - patch_w +1 : ymax;
 
+#ifdef DEBUG
   printf("Hole's bounding box is x (%d, %d), y (%d, %d)\n", xmin, xmax, ymin, ymax);
+#endif
   Box box = {xmin, xmax, ymin, ymax};
   return box;
 }
 
+/* dilate the mask
+
+   if patch_w = 3
+   kernel width = 5 , 0 1 2 is 1
+   pixel is    result should be
+   0 0 0 0     1 1 1 0
+   0 0 0 0     1 1 1 0
+   0 0 1 0     1 1 1 0
+   0 0 0 0     0 0 0 0 */
+Mat dilate_mask(Mat mask) {
+  Mat element = Mat::zeros(2*patch_w - 1, 2*patch_w - 1, CV_8UC1);
+  element(Rect(patch_w - 1, patch_w - 1, patch_w, patch_w)) = 255;
+  Mat dilated_mask;
+  dilate(mask, dilated_mask, element);
+  return dilated_mask;
+}
+
 /* check if a pixel x, y is in the bounding box or not */
 bool inBox(int x, int y, Box box) {
   if (x >= box.xmin && x <= box.xmax && y >= box.ymin && y <= box.ymax) {
@@ -159,113 +190,256 @@ bool inBox(int x, int y, Box box) {
 
 /* Measure distance between 2 patches with upper left corners (ax, ay) and (bx, by), terminating early if we exceed a cutoff distance.
    You could implement your own descriptor here. */
-int dist(Mat a, Mat b, int ax, int ay, int bx, int by, int cutoff=INT_MAX) {
-  int ans = 0;
+int dist(Mat a, Mat b, int ax, int ay, int bx, int by, int cutoff) {
   if (a.type() != CV_8UC3) {
     cout << "Bad things happened in dist " <<endl;
     exit(1);
   }
-  for (int dy = 0; dy < patch_w; dy++) {
-    for (int dx = 0; dx < patch_w; dx++) {
-      Vec3b ac = a.at<Vec3b>(ay + dy, ax + dx);
-      Vec3b bc = b.at<Vec3b>(by + dy, bx + dx);
+  return Bgr8L2Distance(a.ptr(), a.step[0], b.ptr(), b.step[0], patch_w)(ax, ay, bx, by, cutoff);
+}
 
-      int db = ac[0] - bc[0];
-      int dg = ac[1] - bc[1];
-      int dr = ac[2] - bc[2];
-      ans += dr*dr + dg*dg + db*db;
+/* Splits a deadline over the pyramid levels that are left, using the measured
+   cost of one EM iteration. A level has four times the pixels of the one
+   below, so it costs about four times as much per iteration. Every level
+   gets time for the same number of iterations; when not even one iteration
+   fits at every level the finest levels are dropped and the result is
+   upsampled from the last level that was run. A level is only started when
+   its first iteration, which always runs, fits in the time that is left. */
+class AnytimeScheduler {
+public:
+  AnytimeScheduler(const Deadline &deadline_) : deadline(deadline_), iter_cost(-1), level_budget(INFINITY),
+                                                level_start(0), level(0), nlevels(1), last_level(INT_MAX) {}
+
+  /* Plan the time for `level_` of `nlevels_`. Without a cost estimate yet
+     the plan is made after the first iteration has been measured. */
+  void start_level(int level_, int nlevels_) {
+    level = level_;
+    nlevels = nlevels_;
+    level_start = deadline.elapsed();
+    level_budget = INFINITY;
+    if (deadline.limited() && iter_cost > 0) {
+      plan();
     }
-    if (ans >= cutoff) { return cutoff; }
   }
-  if (ans < 0) return INT_MAX;
-  return ans;
-}
 
-void improve_guess(Mat a, Mat b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by, int type) {
-  int d = dist(a, b, ax, ay, bx, by, dbest);
-  if ((d < dbest) && (ax != bx || ay != by) ) {
-#ifdef DEBUG
-      if (type == 0)
-        printf("  Prop x: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-      else if (type == 1)
-        printf("  Prop y: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-      else
-        printf("  Random: improve (%d, %d) old nn (%d, %d) new nn (%d, %d) old dist %d, new dist %d\n", ax, ay, xbest, ybest, bx, by, dbest, d);
-#endif
-    dbest = d;
-    xbest = bx;
-    ybest = by;
+  /* The first iteration of a level always runs, the level was planned for it. */
+  bool allow_iteration(int im_iter) const {
+    if (!deadline.limited() || im_iter == 0) {
+      return true;
+    }
+    return deadline.elapsed() - level_start + iter_cost <= level_budget;
+  }
+
+  void record_iteration(double seconds) {
+    bool planned = (iter_cost > 0);
+    iter_cost = (iter_cost < 0) ? seconds : 0.5 * (iter_cost + seconds);
+    if (deadline.limited() && !planned) {
+      plan();
+    }
   }
+
+  /* Called when moving one level up, before anything was measured there. */
+  void next_level() {
+    if (iter_cost > 0) {
+      iter_cost *= 4;
+    }
+  }
+
+  bool is_last_level() const { return deadline.limited() && level >= last_level; }
+
+  /* Whether one iteration of the next level, about four times the cost of
+     one here, still fits before the deadline. */
+  bool next_level_fits() const {
+    return !deadline.limited() || iter_cost < 0 || deadline.elapsed() + 4 * iter_cost <= deadline.budget;
+  }
+
+private:
+  void plan() {
+    double rem = deadline.budget - level_start;
+    int levels_left = nlevels - level;
+    double weight = 0;
+    for (int k = 0, w = 1; k < levels_left; ++k, w *= 4) {
+      weight += w;
+    }
+    // drop the finest levels until one iteration fits everywhere
+    while (levels_left > 1 && rem < iter_cost * weight) {
+      levels_left--;
+      weight = (weight - 1) / 4;
+    }
+    last_level = level + levels_left - 1;
+    level_budget = rem / weight;
+  }
+
+  const Deadline &deadline;
+  double iter_cost;     // seconds per EM iteration at the current level, -1 if unknown
+  double level_budget;  // seconds planned for the current level
+  double level_start;
+  int level, nlevels, last_level;
+};
+
+/* A w x h BITMAP in the arena if it has room, on the heap otherwise. */
+BITMAP *new_bitmap(int w, int h, ScratchArena *arena) {
+  int *data = arena ? (int *) arena->alloc(sizeof(int) * w * h) : NULL;
+  return data ? new BITMAP(w, h, data) : new BITMAP(w, h);
 }
 
-/* Match image a to image b, returning the nearest neighbor field mapping a => b coords, stored in an RGB 24-bit image as (by<<12)|bx. */
-void patchmatch(Mat a, Mat b, BITMAP *&ann, BITMAP *&annd, Mat dilated_mask, Mat constraint, CMap* cmap) {
-  /* Initialize with random nearest neighbor field (NNF). */
-  ann = new BITMAP(a.cols, a.rows);
-  annd = new BITMAP(a.cols, a.rows);
-   /* Effective width and height (possible upper left corners of patches). */
+/* Same for a Mat. Its contents are undefined either way. */
+Mat scratch_mat(int rows, int cols, int type, ScratchArena *arena) {
+  void *data = arena ? arena->alloc((size_t) rows * cols * CV_ELEM_SIZE(type)) : NULL;
+  return data ? Mat(rows, cols, type, data) : Mat(rows, cols, type);
+}
+
+size_t image_complete_scratch_bytes(int cols, int rows) {
+  // ann and annd, B, R and Rcount at the finest level, plus alignment
+  return (size_t) cols * rows * (2 * sizeof(int) + 3 + 2 * 3 * sizeof(float)) + 5 * 64;
+}
+
+struct PMRand {
+  int operator()() const { return pm_rand(); }
+};
+
+typedef PatchMatchEngine<Bgr8L2Distance, SameLabelSource, LabelSampling<PMRand> > ConstrainedEngine;
+
+/* The search for ann/annd, a => b, restricted to patches outside dilated_mask and to each pixel's label.
+   Only solves the pixels of a with constraint label `label`, and with a box only the patch corners in it. */
+ConstrainedEngine constrained_engine(Mat a, Mat b, BITMAP *ann, BITMAP *annd, Mat dilated_mask, Mat constraint,
+                                     const ConstraintIndex *cindex, int label, const Box *box = NULL) {
+  if (a.type() != CV_8UC3 || b.type() != CV_8UC3) {
+    cout << "Bad things happened in patchmatch " <<endl;
+    exit(1);
+  }
   int aew = a.cols - patch_w + 1, aeh = a.rows - patch_w + 1;
   int bew = b.cols - patch_w + 1, beh = b.rows - patch_w + 1;
-  memset(ann->data, 0, sizeof(int) * a.cols * a.rows);
-  memset(annd->data, 0, sizeof(int) * a.cols * a.rows);
+  PMField field = {ann->data, annd->data, ann->w};
+  PMRegion region = {0, aew, 0, aeh, constraint.ptr(), constraint.step[0], label};
+  if (box) {
+    region.xmin = MAX(0, box->xmin);
+    region.xmax = MIN(aew, box->xmax);
+    region.ymin = MAX(0, box->ymin);
+    region.ymax = MIN(aeh, box->ymax);
+  }
+  return ConstrainedEngine(Bgr8L2Distance(a.ptr(), a.step[0], b.ptr(), b.step[0], patch_w),
+                           SameLabelSource(dilated_mask.ptr(), dilated_mask.step[0], constraint.ptr(), constraint.step[0],
+                                           cindex->offset),
+                           LabelSampling<PMRand>(bew, beh, rs_max, b.cols, b.rows, constraint.ptr(), constraint.step[0],
+                                                 cindex->offset, cindex->xy.data()),
+                           field, region, bew, beh);
+}
 
-  // process constraint
-  //CMap *cmap_ptr, cmap;
-  //cmap_ptr = &cmap;
-  //getCMap(constraint, cmap_ptr);
+/* One subproblem of the completion's PatchMatch: the patch corners of label
+   inside box, whose max is exclusive as in a PMRegion. */
+struct LabelJob {
+  int label;
+  Box box;
+};
 
-  // Initialization
-  int bx, by;
-  unordered_map<int, vector<pair<int, int> > >::iterator got;
-  for (int ay = 0; ay < aeh; ay++) {
-    for (int ax = 0; ax < aew; ax++) {
-      bool valid = false;
-      int const_pixel = (int) constraint.at<uchar>(ay, ax);
-
-      // if not having constraint
-      if (const_pixel == 0) {
-        while (!valid) {
-          bx = rand() % bew;
-          by = rand() % beh;
-          int mask_pixel = (int) dilated_mask.at<uchar>(by, bx);
-          // should find patches outside the hole
-          if (mask_pixel == 255) {
-            valid = false;
-          } else {
-            valid = true;
-          }
-        }
-      } else {
-        got = cmap->constraint_map.find(const_pixel);
-        if (got == cmap->constraint_map.end()) {
-          cout << "Something wrong in constraint map " << endl;
-          exit(1);
-        }
-        //int debug_shit = 0;
-        while (!valid) {
-          //debug_shit++;
-          //cout << "debug index " << debug_shit <<endl;
-          //cout << "got->second.size() " << got->second.size() <<endl;
-          int rand_index = rand() % got->second.size();
-          //cout << "rand index " << rand_index <<endl;
-          bx = got->second[rand_index].first;
-          by = got->second[rand_index].second;
-          int mask_pixel = (int) dilated_mask.at<uchar>(by, bx);
-          if (bx >= bew || by >= beh) {
-              valid = false;
-          } else if (mask_pixel == 255) {
-            valid = false;
-          } else {
-            valid = true;
-          }
-        }
+/* The labels of the patch corners of a with their bounding boxes, ascending
+   (so unconstrained pixels, usually the most, go first). Engines only walk
+   their label's box, not the whole of a. */
+vector<LabelJob> label_jobs(Mat constraint, int aew, int aeh) {
+  Box boxes[256];
+  bool present[256] = {false};
+  for (int y = 0; y < aeh; ++y) {
+    const uchar *row = constraint.ptr<uchar>(y);
+    for (int x = 0; x < aew; ++x) {
+      Box &b = boxes[row[x]];
+      if (!present[row[x]]) {
+        present[row[x]] = true;
+        b.xmin = x; b.xmax = x + 1; b.ymin = y;
       }
-      (*ann)[ay][ax] = XY_TO_INT(bx, by);
-      (*annd)[ay][ax] = dist(a, b, ax, ay, bx, by);
+      b.xmin = MIN(b.xmin, x);
+      b.xmax = MAX(b.xmax, x + 1);
+      b.ymax = y + 1;
     }
   }
+  vector<LabelJob> jobs;
+  for (int l = 0; l < 256; ++l) {
+    if (present[l]) {
+      LabelJob job = {l, boxes[l]};
+      jobs.push_back(job);
+    }
+  }
+  return jobs;
+}
+
+/* Rows per job of label 0 in scanline sweeps, see sweep_jobs(). */
+static const int scanline_band_rows = 64;
+
+/* label_jobs() for scanline sweep iter, with label 0, usually most of the
+   image, cut into bands of scanline_band_rows rows. The bands are swept as
+   jobs of their own next to the constraint labels, so no single job holds
+   most of the work. A band does not propagate into the next one within a
+   sweep; odd iterations shift the bands by half a band, so no boundary
+   stays in place. The cut only depends on iter, not on the threads. */
+vector<LabelJob> sweep_jobs(Mat constraint, int aew, int aeh, int iter) {
+  vector<LabelJob> jobs = label_jobs(constraint, aew, aeh);
+  if (jobs.empty() || jobs[0].label != 0) {
+    return jobs;
+  }
+  Box all = jobs[0].box;
+  vector<LabelJob> banded;
+  for (int y = all.ymin - (iter % 2) * scanline_band_rows / 2; y < all.ymax; y += scanline_band_rows) {
+    LabelJob band = {0, {all.xmin, all.xmax, MAX(y, all.ymin), MIN(y + scanline_band_rows, all.ymax)}};
+    banded.push_back(band);
+  }
+  banded.insert(banded.end(), jobs.begin() + 1, jobs.end());
+  return banded;
+}
+
+/* One seed per job, drawn from the caller's random stream. The jobs reseed
+   the stream of the thread they run on, the caller's included, so it is put
+   back when the seeds go out of scope. */
+class JobSeeds {
+public:
+  explicit JobSeeds(size_t njobs) {
+    for (size_t i = 0; i < njobs; ++i) {
+      seeds.push_back((unsigned int) pm_rand());
+    }
+    caller_rng = pm_rng_state;
+  }
+
+  ~JobSeeds() { pm_rng_state = caller_rng; }
+
+  unsigned int operator[](size_t i) const { return seeds[i]; }
+
+private:
+  vector<unsigned int> seeds;
+  unsigned long long caller_rng;
+};
+
+/* Run job(i) for i = 0 .. njobs-1, on up to pm_threads threads including the
+   caller. Every job gets its own random stream seeded from the caller's,
+   so the result does not depend on the number of threads. */
+void run_jobs(int njobs, const function<void(int)> &job) {
+  JobSeeds seeds(njobs);
+  int nthreads = pm_threads > 0 ? pm_threads : (int) thread::hardware_concurrency();
+  nthreads = MAX(1, MIN(nthreads, njobs));
+
+  atomic<int> next(0);
+  pm_worker_pool().run(nthreads, [&](int t) {
+    for (int i = next++; i < njobs; i = next++) {
+      pm_srand(seeds[i]);
+      job(i);
+    }
+    PM_STAT_FLUSH();
+  });
+}
+
+void patchmatch_init(Mat a, Mat b, BITMAP *&ann, BITMAP *&annd, Mat dilated_mask, Mat constraint,
+                     const ConstraintIndex *cindex, ScratchArena *arena) {
+  /* Initialize with random nearest neighbor field (NNF). */
+  ann = new_bitmap(a.cols, a.rows, arena);
+  annd = new_bitmap(a.cols, a.rows, arena);
+  memset(ann->data, 0, sizeof(int) * a.cols * a.rows);
+  memset(annd->data, 0, sizeof(int) * a.cols * a.rows);
+
+  vector<LabelJob> jobs = sweep_jobs(constraint, a.cols - patch_w + 1, a.rows - patch_w + 1, 0);
+  run_jobs((int) jobs.size(), [&](int i) {
+    constrained_engine(a, b, ann, annd, dilated_mask, constraint, cindex, jobs[i].label, &jobs[i].box).init();
+  });
 
 #ifdef DEBUG
+  int aew = a.cols - patch_w + 1, aeh = a.rows - patch_w + 1;
   for (int ay = 0; ay < aeh; ay++ ) {
     for (int ax = 0; ax < aew; ax++) {
       int vp = (*ann)[ay][ax];
@@ -278,108 +452,180 @@ void patchmatch(Mat a, Mat b, BITMAP *&ann, BITMAP *&annd, Mat dilated_mask, Mat
     }
   }
 #endif
+}
 
-  for (int iter = 0; iter < pm_iters; iter++) {
-    // printf("  pm_iter = %d\n", iter);
-    /* In each iteration, improve the NNF, by looping in scanline or reverse-scanline order. */
-    int ystart = 0, yend = aeh, ychange = 1;
-    int xstart = 0, xend = aew, xchange = 1;
-    if (iter % 2 == 1) {
-      xstart = xend-1; xend = -1; xchange = -1;
-      ystart = yend-1; yend = -1; ychange = -1;
-    }
-    for (int ay = ystart; ay != yend; ay += ychange) {
-      for (int ax = xstart; ax != xend; ax += xchange) {
-
-        int const_pixel = (int) constraint.at<uchar>(ay, ax);
-
-        /* Current (best) guess. */
-        int v = (*ann)[ay][ax];
-        int xbest = INT_TO_X(v), ybest = INT_TO_Y(v);
-        int dbest = (*annd)[ay][ax];
-
-        /* Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). */
-        if ((unsigned) (ax - xchange) < (unsigned) aew) {
-          int vp = (*ann)[ay][ax-xchange];
-          int xp = INT_TO_X(vp) + xchange, yp = INT_TO_Y(vp);
-
-          if (((unsigned) xp < (unsigned) aew)) {
-            int mask_pixel = (int) dilated_mask.at<uchar>(yp, xp);
-            if (mask_pixel != 255) {
-              int new_const_pixel = (int) constraint.at<uchar>(yp, xp);
-              if (const_pixel == 0) {
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 0);
-              } else if (const_pixel == new_const_pixel) {
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 0);
-              }
-            }
-          }
-        }
+/* Threads for sweeping one label: pm_threads, at most one per row. */
+int sweep_threads(int rows) {
+  int nthreads = pm_threads > 0 ? pm_threads : (int) thread::hardware_concurrency();
+  return MAX(1, MIN(nthreads, rows));
+}
 
-        if ((unsigned) (ay - ychange) < (unsigned) aeh) {
-          int vp = (*ann)[ay-ychange][ax];
-          int xp = INT_TO_X(vp), yp = INT_TO_Y(vp) + ychange;
-
-          if (((unsigned) yp < (unsigned) aeh)) {
-            int mask_pixel = (int) dilated_mask.at<uchar>(yp, xp);
-            if (mask_pixel != 255) {
-              int new_const_pixel = (int) constraint.at<uchar>(yp, xp);
-              if (const_pixel == 0) {
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 1);
-              } else if (const_pixel == new_const_pixel) {
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 1);
-              }
-            }
-          }
-        }
+/* One sweep with PM_SWEEP_CHECKERBOARD, the labels one after the other. Every
+   row of every phase gets its own random stream, derived from one seed per
+   label drawn from the caller's stream. */
+void patchmatch_checkerboard(Mat a, Mat b, BITMAP *ann, BITMAP *annd, Mat dilated_mask, Mat constraint,
+                             const ConstraintIndex *cindex, int iter) {
+  int aeh = a.rows - patch_w + 1;
+  int nthreads = sweep_threads(aeh);
+  vector<LabelJob> labels = label_jobs(constraint, a.cols - patch_w + 1, aeh);
+  JobSeeds seeds(labels.size());
+  for (size_t i = 0; i < labels.size(); ++i) {
+    unsigned int seed = seeds[i];
+    constrained_engine(a, b, ann, annd, dilated_mask, constraint, cindex, labels[i].label, &labels[i].box).sweep_checkerboard(
+        iter, MAX(0, pm_jumps), nthreads, MAX(1, pm_tile_rows),
+        [seed, aeh](int phase, int row) { pm_srand(seed, (unsigned int) (phase * aeh + row)); });
+  }
+}
 
-        /* Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. */
-        if (const_pixel == 0) {
-          int rs_start = rs_max;
-          if (rs_start > MAX(b.cols, b.rows)) { rs_start = MAX(b.cols, b.rows); }
-          for (int mag = rs_start; mag >= 1; mag /= 2) {
-            /* Sampling window */
-            int xmin = MAX(xbest-mag, 0), xmax = MIN(xbest+mag+1, bew);
-            int ymin = MAX(ybest-mag, 0), ymax = MIN(ybest+mag+1, beh);
-            bool do_improve = false;
-            do {
-              int xp = xmin + rand() % (xmax-xmin);
-              int yp = ymin + rand() % (ymax-ymin);
-              int mask_pixel = (int) dilated_mask.at<uchar>(yp, xp);
-              if (mask_pixel != 255) {
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 2);
-                do_improve = true;
-              }
-            } while (!do_improve);
-          }
-        } else {
-          got = cmap->constraint_map.find(const_pixel);
-          // we choose the improve times to be sqrt of the size
-          int improve_times = (int) ceil(sqrt(got->second.size()));
-          for (int i_t = 0; i_t < improve_times; ++i_t) {
-            bool do_improve = false;
-            do {
-              int rand_index = rand() % got->second.size();
-              int xp = got->second[rand_index].first;
-              int yp = got->second[rand_index].second;
-              int mask_pixel = (int) dilated_mask.at<uchar>(yp, xp);
-              if (xp >= bew || yp >= beh) {
-                do_improve = false;
-              } else if (mask_pixel != 255) {
-                improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp, 2);
-                do_improve = true;
-              }
-            } while (!do_improve);
-          }
-        }
+void patchmatch_sweep(Mat a, Mat b, BITMAP *ann, BITMAP *annd, Mat dilated_mask, Mat constraint,
+                      const ConstraintIndex *cindex, int iter) {
+  if (pm_sweep_mode == PM_SWEEP_CHECKERBOARD) {
+    patchmatch_checkerboard(a, b, ann, annd, dilated_mask, constraint, cindex, iter);
+  } else {
+    vector<LabelJob> jobs = sweep_jobs(constraint, a.cols - patch_w + 1, a.rows - patch_w + 1, iter);
+    run_jobs((int) jobs.size(), [&](int i) {
+      constrained_engine(a, b, ann, annd, dilated_mask, constraint, cindex, jobs[i].label, &jobs[i].box).sweep(iter);
+    });
+  }
+
+#ifdef PM_STATS
+  int aew = a.cols - patch_w + 1, aeh = a.rows - patch_w + 1;
+  double dsum = 0;
+  for (int ay = 0; ay < aeh; ay++) {
+    for (int ax = 0; ax < aew; ax++) {
+      dsum += (*annd)[ay][ax];
+    }
+  }
+  PM_STAT_SWEEP(iter, dsum / ((double) aew * aeh));
+#endif
+}
 
-        (*ann)[ay][ax] = XY_TO_INT(xbest, ybest);
-        (*annd)[ay][ax] = dbest;
+/* iters sweeps with PM_SWEEP_HOGWILD: the labels one after the other, each swept
+   by up to pm_threads threads at once, see PatchMatchEngine::sweep_concurrent().
+   With PM_STATS the mean distance after sweep i adds up every label after its
+   sweep i, or its last one if it stopped before. */
+void patchmatch_hogwild(Mat a, Mat b, BITMAP *ann, BITMAP *annd, Mat dilated_mask, Mat constraint,
+                        const ConstraintIndex *cindex, int iters, const Deadline *deadline) {
+  int aeh = a.rows - patch_w + 1;
+  int nthreads = sweep_threads(aeh);
+  vector<LabelJob> labels = label_jobs(constraint, a.cols - patch_w + 1, aeh);
+  JobSeeds seeds(labels.size());
+  vector<double> dsum(iters, 0.0);
+  int swept = 0;
+  for (size_t i = 0; i < labels.size(); ++i) {
+    unsigned int seed = seeds[i];
+    vector<double> label_dsum(iters, 0.0);
+    int label_swept = 0;
+    constrained_engine(a, b, ann, annd, dilated_mask, constraint, cindex, labels[i].label, &labels[i].box).sweep_concurrent(
+        iters, nthreads, MAX(1, pm_tile_rows),
+        [seed, aeh](int iter, int band) { pm_srand(seed, (unsigned int) (iter * aeh + band)); },
+        [&](int iter, double sum) { label_dsum[iter] = sum; label_swept = iter + 1; },
+        [deadline]() { return deadline && deadline->expired(); });
+    for (int iter = 0; iter < iters; iter++) {
+      dsum[iter] += label_dsum[MIN(iter, label_swept - 1)];
+    }
+    swept = MAX(swept, label_swept);
+  }
+#ifdef PM_STATS
+  int aew = a.cols - patch_w + 1;
+  for (int iter = 0; iter < swept; iter++) {
+    PM_STAT_SWEEP(iter, dsum[iter] / ((double) aew * aeh));
+  }
+#endif
+}
+
+/* Refine the field already in ann/annd, e.g. the one of the previous video
+   frame, over the patch corners in box: every match is rescored on the new
+   images (invalid ones are drawn again), then iters serial sweeps. */
+void patchmatch_refine(Mat a, Mat b, BITMAP *ann, BITMAP *annd, Mat dilated_mask, Mat constraint,
+                       const ConstraintIndex *cindex, Box box, int iters) {
+  PROFILE_SCOPE("patchmatch_refine");
+  PM_STAT_INC(pm_calls);
+  vector<LabelJob> jobs = label_jobs(constraint, a.cols - patch_w + 1, a.rows - patch_w + 1);
+  run_jobs((int) jobs.size(), [&](int i) {
+    const Box &own = jobs[i].box;
+    Box both = {MAX(own.xmin, box.xmin), MIN(own.xmax, box.xmax), MAX(own.ymin, box.ymin), MIN(own.ymax, box.ymax)};
+    ConstrainedEngine engine = constrained_engine(a, b, ann, annd, dilated_mask, constraint, cindex, jobs[i].label,
+                                                  &both);
+    engine.init_from_field();
+    for (int iter = 0; iter < iters; iter++) {
+      engine.sweep(iter);
+    }
+  });
+  PM_STAT_FLUSH();
+}
+
+/* Match image a to image b, returning the nearest neighbor field mapping a => b coords, stored in an RGB 24-bit image as (by<<12)|bx.
+   With a deadline, sweeps after the first are skipped once it has passed; the field is valid after every sweep.
+   iters sweeps are run, pm_iters if it is 0. */
+void patchmatch(Mat a, Mat b, BITMAP *&ann, BITMAP *&annd, Mat dilated_mask, Mat constraint,
+                const ConstraintIndex *cindex, const Deadline *deadline, ScratchArena *arena, int iters) {
+  PROFILE_SCOPE("patchmatch");
+  PM_STAT_INC(pm_calls);
+  patchmatch_init(a, b, ann, annd, dilated_mask, constraint, cindex, arena);
+  if (iters <= 0) {
+    iters = pm_iters;
+  }
+  if (pm_sweep_mode == PM_SWEEP_HOGWILD) {
+    patchmatch_hogwild(a, b, ann, annd, dilated_mask, constraint, cindex, iters, deadline);
+    PM_STAT_FLUSH();
+    return;
+  }
+  for (int iter = 0; iter < iters; iter++) {
+    if (iter > 0 && deadline && deadline->expired()) {
+      break;
+    }
+    patchmatch_sweep(a, b, ann, annd, dilated_mask, constraint, cindex, iter);
+  }
+  PM_STAT_FLUSH();
+}
+
+
+void vote(Mat img, BITMAP *ann, BITMAP *annd, Box box, Mat R, Mat Rcount) {
+  PROFILE_SCOPE("voting");
+  PMField field = {ann->data, annd->data, ann->w};
+  PMRegion region = {box.xmin, box.xmax, box.ymin, box.ymax};
+  auto splat = [&](int x, int y, int xbest, int ybest, float sim) {
+    for (int dy = 0; dy < patch_w; ++dy) {
+      const uchar *src = img.ptr<uchar>(ybest + dy) + 3 * xbest;
+      float *r = R.ptr<float>(y + dy) + 3 * x;
+      float *rc = Rcount.ptr<float>(y + dy) + 3 * x;
+      for (int k = 0; k < 3 * patch_w; ++k) {
+        r[k] += sim * src[k];
+        rc[k] += sim;
+      }
+    }
+  };
+  pm_vote_tiled(gaussian_weight_table(sigma), field, region, patch_w, pm_tile_rows,
+                sweep_threads(box.ymax - box.ymin), splat);
+}
+
+// COULD BE optimize TODO
+void normalize_votes(Mat R, Mat Rcount) {
+  PROFILE_SCOPE("normalize");
+  for (int h = 0; h < R.rows; h++) {
+    for (int w = 0; w < R.cols; w++) {
+      Vec3f rcount_pixel = Rcount.at<Vec3f>(h, w);
+      if (rcount_pixel[0] > 0) {
+        Vec3f& r_pixel = R.at<Vec3f>(h, w);
+        r_pixel[0] = (r_pixel[0] / rcount_pixel[0]);
+        r_pixel[1] = (r_pixel[1] / rcount_pixel[1]);
+        r_pixel[2] = (r_pixel[2] / rcount_pixel[2]);
       }
     }
   }
 }
 
+/* Upsample the working image of the current scale to full resolution and put
+   the known pixels of the original back, so previews look like a result. */
+Mat compose_preview(Mat im_orig, Mat mask, Mat resize_img) {
+  Mat preview;
+  resize(resize_img, preview, im_orig.size(), 0, 0, INTER_LINEAR);
+  Mat known;
+  threshold(mask, known, 127, 255, 1);
+  im_orig.copyTo(preview, known);
+  return preview;
+}
 
 /**
  * Image inpainting algorithm
@@ -388,38 +634,78 @@ void patchmatch(Mat a, Mat b, BITMAP *&ann, BITMAP *&annd, Mat dilated_mask, Mat
  * @param im_orig: original image (with pixels in hole presented or not)
  * @param mask:    mask specify missing region
  * @param constraint: constraint image generate by user
+ * @param on_level: optional preview callback, see PreviewCallback
+ * @param cancel:  optional flag, completion stops early once it is set
+ * @param budget:  wall clock budget in seconds, 0 for none. Iterations are
+ *                 spread over the levels by AnytimeScheduler and the best
+ *                 image so far is returned when time runs out.
+ * @param arena:   optional scratch memory for the per-iteration buffers, see
+ *                 image_complete_scratch_bytes()
+ * @param checkpoint: optional file to save the state to every
+ *                 checkpoint_interval seconds and to resume from. It is
+ *                 removed once the result is ready and kept on cancel, so
+ *                 a restarted seeded run (without budget) gives the same
+ *                 result as one that was never stopped.
  *
- * @return the completed/inpainting image
+ * @return the completed/inpainting image, empty if cancelled
  */
-void image_complete(Mat im_orig, Mat mask, Mat constraint) {
+Mat image_complete(Mat im_orig, Mat mask, Mat constraint, PreviewCallback on_level,
+                   const atomic<bool> *cancel, double budget, ScratchArena *arena, const char *checkpoint) {
+  CompletionPyramid pyramid(im_orig, completion_schedule.max_depth());
+  pyramid.set_mask(mask, constraint);
+  return image_complete(pyramid, on_level, cancel, budget, arena, checkpoint);
+}
 
-  // some parameters for scaling
-  int rows = im_orig.rows;
-  int cols = im_orig.cols;
-  //int startscale = (int) -1*ceil(log2(MIN(rows, cols))) + 5;
-  int startscale = -3;
-  double scale = pow(2, startscale);
+/* image_complete() from the coarsest level of pyramid up, taking image, mask,
+   constraint, dilated mask, hole box and constraint index of every level from
+   the pyramid. Depth and iterations come from completion_schedule. */
+Mat image_complete(CompletionPyramid &pyramid, PreviewCallback on_level,
+                   const atomic<bool> *cancel, double budget, ScratchArena *arena, const char *checkpoint) {
+  PROFILE_SCOPE("image_complete");
 
-  cout << "Scaling image by " << scale << endl;
+  Deadline deadline(budget);
+  AnytimeScheduler scheduler(deadline);
+  pm_srand(pm_seed);
 
-  double t1 = (double)getTickCount();
+  Mat im_orig = pyramid.image(0), mask = pyramid.mask(0);
 
-  // Resize image to starting scale
-  Mat resize_img, resize_mask, resize_constraint;
-  resize(im_orig, resize_img, Size(), scale, scale, INTER_AREA);
-  resize(mask, resize_mask, Size(), scale, scale, INTER_AREA);
-  threshold(resize_mask, resize_mask, 127, 255, 0);
-  resize(constraint, resize_constraint, Size(), scale, scale, INTER_NEAREST);
+  // some parameters for scaling
+  int rows, cols;
+  int nlevels = completion_schedule.depth(pyramid);
+  int startscale = 1 - nlevels;
+  double scale = pow(2, startscale);
 
+  cout << "Scaling image by " << scale << " (hole radius " << pyramid.hole_radius() << ", schedule "
+       << completion_schedule.name << ")" << endl;
+  PROFILE_COUNT("pyramid_levels", nlevels);
+
+  PROFILE_SCOPE_VAR(init_scope, "init");
+
+  // Start at the coarsest level, or where the checkpoint left off
+  int level = nlevels - 1;
+  int first_iter = 0;
+  CompletionState resumed;
+  unique_ptr<CheckpointWriter> checkpointer;
+  if (checkpoint) {
+    uint64_t fingerprint = completion_fingerprint(pyramid, nlevels);
+    if (load_checkpoint(checkpoint, fingerprint, pyramid, resumed)) {
+      level = resumed.level;
+      first_iter = resumed.iteration;
+      pm_rng_state = resumed.rng;
+    }
+    checkpointer.reset(new CheckpointWriter(checkpoint, fingerprint));
+  }
+  Mat resize_img = resumed.image.empty() ? pyramid.image(level).clone() : resumed.image;
+  Mat resize_mask = pyramid.mask(level), resize_constraint = pyramid.constraint(level);
 
-  CMap cm, *cm_ptr;
-  cm_ptr = &cm;
-  getCMap(resize_constraint, cm_ptr);
+  // hole and constraint index of the current scale, from the pyramid's cache
+  Mat dilated_mask = pyramid.dilated_mask(level);
+  const ConstraintIndex *cindex = &pyramid.constraint_index(level);
 
   // Random starting guess for inpainted image
   rows = resize_img.rows;
   cols = resize_img.cols;
-  for (int y = 0; y < rows; ++y) {
+  for (int y = 0; y < rows && resumed.image.empty(); ++y) {
     for (int x = 0; x < cols; ++x) {
       int mask_pixel = (int) resize_mask.at<uchar>(y, x);
       if (mask_pixel != 0 && mask_pixel != 255) {
@@ -430,16 +716,14 @@ void image_complete(Mat im_orig, Mat mask, Mat constraint) {
       // means hole, thus random init colors in hole
       if (mask_pixel != 0) {
         int const_pixel = (int) resize_constraint.at<uchar>(y, x);
-        if (const_pixel == 0) {
-          resize_img.at<Vec3b>(y, x)[0] = rand() % 256;
-          resize_img.at<Vec3b>(y, x)[1] = rand() % 256;
-          resize_img.at<Vec3b>(y, x)[2] = rand() % 256;
+        if (const_pixel == 0 || cindex->count(const_pixel) == 0) {
+          resize_img.at<Vec3b>(y, x)[0] = pm_rand() % 256;
+          resize_img.at<Vec3b>(y, x)[1] = pm_rand() % 256;
+          resize_img.at<Vec3b>(y, x)[2] = pm_rand() % 256;
         } else {
-          unordered_map<int, vector<pair<int, int> > >::iterator got;
-          got = cm_ptr->constraint_map.find(const_pixel);
-          int rand_index = rand() % got->second.size();
-          int nx = got->second[rand_index].first;
-          int ny = got->second[rand_index].second;
+          int v = cindex->xy[cindex->offset[const_pixel] + pm_rand() % cindex->count(const_pixel)];
+          int nx = INT_TO_X(v);
+          int ny = INT_TO_Y(v);
           Vec3b new_pixel = resize_img.at<Vec3b>(ny, nx);
           resize_img.at<Vec3b>(y, x)[0] = new_pixel[0];
           resize_img.at<Vec3b>(y, x)[1] = new_pixel[1];
@@ -449,34 +733,22 @@ void image_complete(Mat im_orig, Mat mask, Mat constraint) {
     }
   }
 
-  double p1 = ((double)getTickCount() - t1) / getTickFrequency();
-  cout << "time for init = " << p1 << endl;
+  PROFILE_STOP(init_scope);
 
   // just for DEBUG
-  int index = 0;
+  int index = nlevels - 1 - level;
 
   // go through all scale
-  for (int logscale = startscale; logscale <= 0; logscale++) {
+  for (int logscale = -level; logscale <= 0; logscale++) {
     index++;
+    PROFILE_SCOPE_ARG("scale", index);
 
     scale = pow(2, logscale);
+    scheduler.start_level(index - 1, nlevels);
 
     cout << "Scaling is " << scale << endl;
 
-    Box mask_box = getBox(resize_mask);
-    // dilate the mask
-    //
-    // if patch_w = 3
-    // kernel width = 5 , 0 1 2 is 1
-    // pixel is    result should be
-    // 0 0 0 0     1 1 1 0
-    // 0 0 0 0     1 1 1 0
-    // 0 0 1 0     1 1 1 0
-    // 0 0 0 0     0 0 0 0
-    Mat element = Mat::zeros(2*patch_w - 1, 2*patch_w - 1, CV_8UC1);
-    element(Rect(patch_w - 1, patch_w - 1, patch_w, patch_w)) = 255;
-    Mat dilated_mask;
-    dilate(resize_mask, dilated_mask, element);
+    Box mask_box = pyramid.box(level);
 
     /*
     imwrite("dilated_mask.png", dilated_mask);
@@ -488,10 +760,6 @@ void image_complete(Mat im_orig, Mat mask, Mat constraint) {
     imwrite("mask_diff.png", mask_diff);
     */
 
-    CMap cmap;
-    CMap* cmap_ptr = &cmap;
-    getCMap(resize_constraint, cmap_ptr);
-
     /*
     for (int y = 0; y < resize_mask.rows; ++y) {
       for (int x = 0; x < resize_mask.cols; ++x) {
@@ -505,17 +773,13 @@ void image_complete(Mat im_orig, Mat mask, Mat constraint) {
       }
     }
 
-    unordered_map<int, vector<pair<int, int> > >::iterator it;
-    for (it = cmap_ptr->constraint_map.begin(); it != cmap_ptr->constraint_map.end(); ++it) {
-      for (int i = 0; i < it->second.size(); ++i) {
-        int nx = it->second[i].first;
-        int ny = it->second[i].second;
-        Vec3b& img_pixel = resize_img.at<Vec3b>(ny, nx);
-        img_pixel[0] = 255;
-        img_pixel[1] = 0;
-        img_pixel[2] = 0;
-
-      }
+    for (int i = 0; i < cindex->xy.size(); ++i) {
+      int nx = INT_TO_X(cindex->xy[i]);
+      int ny = INT_TO_Y(cindex->xy[i]);
+      Vec3b& img_pixel = resize_img.at<Vec3b>(ny, nx);
+      img_pixel[0] = 255;
+      img_pixel[1] = 0;
+      img_pixel[2] = 0;
     }
 
     stringstream ss;
@@ -524,20 +788,40 @@ void image_complete(Mat im_orig, Mat mask, Mat constraint) {
     imwrite(debug_file, resize_img);
     */
 
-    // iterations of image completion
-    int im_iterations = 60;
-    for (int im_iter = 0; im_iter < im_iterations; ++im_iter) {
+    // iterations of image completion, fewer toward the fine levels
+    int im_iterations = completion_schedule.em_iterations(index - 1, nlevels);
+    int pm_iterations = completion_schedule.pm_iterations(index - 1, nlevels);
+    // state for a checkpoint after iteration im_iter, next being the one to run next
+    auto save_state = [&](int next) {
+      if (checkpointer && checkpointer->due()) {
+        CompletionState state = {level, next, pm_rng_state, resize_img, resize_mask};
+        checkpointer->post(state);
+      }
+    };
+    for (int im_iter = first_iter; im_iter < im_iterations; ++im_iter) {
+      if (cancel && *cancel) {
+        return Mat();
+      }
+      if (!scheduler.allow_iteration(im_iter)) {
+        break;
+      }
+      PROFILE_SCOPE_ARG("em_iteration", im_iter);
+#ifdef DEBUG
       printf("im_iter = %d\n", im_iter);
+#endif
 
       BITMAP *ann = NULL, *annd = NULL;
+      ArenaScope iteration_scratch(arena);
 
       double t2 = (double)getTickCount();
 
-      Mat B = resize_img.clone();
+      Mat B = scratch_mat(resize_img.rows, resize_img.cols, CV_8UC3, arena);
+      resize_img.copyTo(B);
       bitwise_and(resize_img, 0, B, resize_mask);
 
       // use patchmatch to find NN
-      patchmatch(resize_img, B, ann, annd, dilated_mask, resize_constraint, cmap_ptr);
+      patchmatch(resize_img, B, ann, annd, dilated_mask, resize_constraint, cindex, &deadline, arena,
+                 pm_iterations);
 
       //stringstream ss;
       //ss << im_iter;
@@ -545,55 +829,21 @@ void image_complete(Mat im_orig, Mat mask, Mat constraint) {
       //const char* annd_ptr = annd_file.c_str();
       //save_bitmap(ann, annd_ptr);
 
-      double p2 = ((double)getTickCount() - t2) / getTickFrequency();
-      cout << "time for PM = " << p2 << endl;
-
-      double t3 =  (double)getTickCount();
       // create new image by letting each patch vote
-      Mat R = Mat::zeros(resize_img.rows, resize_img.cols, CV_32FC3);
-      Mat Rcount = Mat::zeros(resize_img.rows, resize_img.cols, CV_32FC3);
-      for (int y = mask_box.ymin; y < mask_box.ymax; ++y) {
-        for (int x = mask_box.xmin; x < mask_box.xmax; ++x) {
-            int v = (*ann)[y][x];
-            int xbest  = INT_TO_X(v), ybest = INT_TO_Y(v);
-            Rect srcRect(Point(x, y), Size(patch_w, patch_w));
-            Rect dstRect(Point(xbest, ybest), Size(patch_w, patch_w));
-            float d = (float) (*annd)[y][x];
-            float sim = exp(-d / (2*pow(sigma, 2) ));
-            Mat toAssign;
-            addWeighted(R(srcRect), 1.0, resize_img(dstRect), sim, 0, toAssign, CV_32FC3);
-            toAssign.copyTo(R(srcRect));
-            add(Rcount(srcRect), sim, toAssign, noArray(), CV_32FC3);
-            toAssign.copyTo(Rcount(srcRect));
-/*
-            Mat debugR = Rcount.clone();
-            cout << "Hole (" << x << ", " << y << ") has sim2 " << exp(-d / (2*pow(sigma, 2))) <<endl;
-            cout << sum(Rcount - debugR) <<endl;
-*/
-        }
-      }
-      double p3 = ((double)getTickCount() - t3) / getTickFrequency();
-      cout << "time for voting = " << p3 << endl;
+      Mat R = scratch_mat(resize_img.rows, resize_img.cols, CV_32FC3, arena);
+      Mat Rcount = scratch_mat(resize_img.rows, resize_img.cols, CV_32FC3, arena);
+      R = Scalar(0, 0, 0);
+      Rcount = Scalar(0, 0, 0);
+      vote(resize_img, ann, annd, mask_box, R, Rcount);
 
       // normalize new image
-      // COULD BE optimize TODO
-      for (int h = 0; h < R.rows; h++) {
-        for (int w = 0; w < R.cols; w++) {
-          Vec3f rcount_pixel = Rcount.at<Vec3f>(h, w);
-          if (rcount_pixel[0] > 0) {
-            Vec3f& r_pixel = R.at<Vec3f>(h, w);
-            r_pixel[0] = (r_pixel[0] / rcount_pixel[0]);
-            r_pixel[1] = (r_pixel[1] / rcount_pixel[1]);
-            r_pixel[2] = (r_pixel[2] / rcount_pixel[2]);
-          }
-        }
-      }
-
+      normalize_votes(R, Rcount);
       R.convertTo(R, CV_8UC3);
 
       // keep pixel outside mask
       Mat old_img = resize_img.clone();
       R.copyTo(resize_img, resize_mask);
+      scheduler.record_iteration(((double)getTickCount() - t2) / getTickFrequency());
 
       // measure how much image has changed, if not much then stop  TODO
       if (im_iter > 0) {
@@ -625,71 +875,113 @@ void image_complete(Mat im_orig, Mat mask, Mat constraint) {
         cout << "mask count is " << mask_count_white << endl;
         cout << "norm diff is " << diff/mask_count_white << endl;
 #endif
+        PROFILE_COUNT("em_change", diff/mask_count_white);
         if (diff/mask_count_white < 0.02) {
+          delete ann;
+          delete annd;
+          save_state(im_iterations);
           break;
         }
       }
 
+#ifdef DEBUG
       string outfile = "r_scale" + to_string(index) + "_imiter" + to_string(im_iter) + ".png";
       imwrite(outfile, R);
+#endif
 
       delete ann;
       delete annd;
+      save_state(im_iter + 1);
+    }
+    first_iter = 0;
+
+    if (cancel && *cancel) {
+      return Mat();
+    }
+
+    // out of time for the finer levels, upsample what we have
+    if (logscale < 0 && (scheduler.is_last_level() || !scheduler.next_level_fits())) {
+      Mat result = compose_preview(im_orig, mask, resize_img);
+      printf("deadline: stopping at scale %g after %g s\n", scale, deadline.elapsed());
+      if (on_level) {
+        on_level(result, nlevels - 1, nlevels);
+      }
+      if (checkpointer) {
+        checkpointer->remove();
+      }
+      return result;
     }
 
+    if (on_level) {
+      if (logscale < 0) {
+        on_level(compose_preview(im_orig, mask, resize_img), index - 1, nlevels);
+      } else {
+        on_level(resize_img, index - 1, nlevels);
+      }
+    }
 
     // Upsample A for the next scale
     if (logscale < 0) {
-      double t4 = (double)getTickCount();
+      PROFILE_SCOPE("upsample");
       cout << "Upscaling" << endl;
-      // orig down scale to new scale
-      Mat upscale_img;
-      resize(im_orig, upscale_img, Size(), 2*scale, 2*scale, INTER_AREA);
+      scheduler.next_level();
+      // orig at the new scale
+      --level;
+      Mat upscale_img = pyramid.image(level);
 
       // data upscale to new scale
       int new_cols = upscale_img.cols, new_rows = upscale_img.rows;
       resize(resize_img, resize_img, Size(new_cols, new_rows), 0, 0, INTER_CUBIC);
-      resize(mask, resize_mask, Size(new_cols, new_rows), 0, 0, INTER_AREA);
-      resize(constraint, resize_constraint, Size(new_cols, new_rows), 0, 0, INTER_NEAREST);
-
-      threshold(resize_mask, resize_mask, 127, 255, 0);
+      resize_mask = pyramid.mask(level);
+      resize_constraint = pyramid.constraint(level);
+      dilated_mask = pyramid.dilated_mask(level);
+      cindex = &pyramid.constraint_index(level);
 
       Mat inverted_mask;
       bitwise_not(resize_mask, inverted_mask);
       upscale_img.copyTo(resize_img, inverted_mask);
-
-      double p4 = ((double)getTickCount() - t4) / getTickFrequency();
-      cout << "time for resize = " << p4 << endl;
     }
   }
 
-  imwrite("final_out.png", resize_img);
+  if (checkpointer) {
+    checkpointer->remove();
+  }
+  return resize_img;
 }
 
-int main(int argc, char *argv[]) {
-  argc--;
-  argv++;
-  if (argc != 3 && argc != 4) { fprintf(stderr, "im_complete a mask result\n"
-                                   "Given input image a and mask outputs result\n"
-                                   "These are stored as RGB 24-bit images, with a 24-bit int at every pixel."); exit(1); }
-
-  Mat image = imread(argv[0]);
-
-  Mat a_matrix = image.clone();
-  Mat mask_cv = imread(argv[1], CV_LOAD_IMAGE_GRAYSCALE);
-  Mat const_cv = imread(argv[2], CV_LOAD_IMAGE_GRAYSCALE);
-
-  printf("mask_cv type %d\n", mask_cv.type());
-  for (int y = 0; y < mask_cv.rows; ++y) {
-    for (int x = 0; x < mask_cv.cols; ++x) {
-      int mask_pixel =(int) mask_cv.at<uchar>(y, x);
-      if (mask_pixel != 0) {
-        a_matrix.at<Vec3b>(y, x) = Vec3b(0, 0, 0);
-      }
-    }
+void CompletionWorker::submit(Mat im_orig, Mat mask, Mat constraint, PreviewCallback on_level,
+                              function<void(const Mat &)> on_done, double budget) {
+  cancel();
+  cancel_flag = false;
+  // the previous request has finished, so its pyramid is free to reuse
+  if (!pyramid || !pyramid->same_image(im_orig)) {
+    pyramid = make_shared<CompletionPyramid>(im_orig, completion_schedule.max_depth());
   }
+  shared_ptr<CompletionPyramid> levels = pyramid;
+  worker = thread([this, levels, mask, constraint, on_level, on_done, budget]() {
+    PreviewCallback guarded;
+    if (on_level) {
+      guarded = [this, on_level](const Mat &preview, int level, int nlevels) {
+        if (!cancel_flag) {
+          on_level(preview, level, nlevels);
+        }
+      };
+    }
+    levels->set_mask(mask, constraint);
+    Mat result = image_complete(*levels, guarded, &cancel_flag, budget);
+    if (!result.empty() && !cancel_flag && on_done) {
+      on_done(result);
+    }
+  });
+}
 
-  image_complete(image, mask_cv, const_cv);
+void CompletionWorker::cancel() {
+  cancel_flag = true;
+  wait();
+}
 
-  return 0;
+void CompletionWorker::wait() {
+  if (worker.joinable()) {
+    worker.join();
+  }
 }
@@ -0,0 +1,483 @@
+/* -------------------------------------------------------------------------
+  Image completion with PatchMatch: EM over an image pyramid, Wexler et al.
+  style, with optional user constraints. Implemented in
+  im_complete_opencv_constraint.cpp; main.cpp is the command line front end
+  and pm_bench.cpp times the kernels declared here. Embedders use the
+  buffer API of patchmatch.h instead of this header.
+  -------------------------------------------------------------------------- */
+
+#ifndef IMAGE_COMPLETE_H
+#define IMAGE_COMPLETE_H
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+
+/* -------------------------------------------------------------------------
+   BITMAP: Minimal image class
+   ------------------------------------------------------------------------- */
+
+class BITMAP { public:
+  int w, h;
+  int *data;
+  bool owned;
+  BITMAP(int w_, int h_) :w(w_), h(h_), owned(true) { data = new int[w*h]; }
+  // wraps w*h ints owned by someone else, e.g. a ScratchArena
+  BITMAP(int w_, int h_, int *data_) :w(w_), h(h_), data(data_), owned(false) {}
+  BITMAP(BITMAP* bm) {
+    w = bm->w;
+    h = bm->h;
+    owned = true;
+    data = new int[w*h];
+    for (int i = 0; i < w*h; ++i) {
+        data[i] = bm->data[i];
+    }
+  }
+  ~BITMAP() { if (owned) delete[] data; }
+  int *operator[](int y) { return &data[y*w]; }
+};
+
+/* Bump allocator over one block of memory, for the buffers image_complete()
+   and patchmatch() would otherwise allocate on every EM iteration. The block
+   is the caller's or allocated once here. alloc() returns NULL when the block
+   is full, callers then fall back to the heap. */
+class ScratchArena {
+public:
+  ScratchArena(void *mem, size_t bytes) : base((char *) mem), size(bytes), used(0), owned(false) {}
+  explicit ScratchArena(size_t bytes) : base(new char[bytes]), size(bytes), used(0), owned(true) {}
+  ~ScratchArena() { if (owned) delete[] base; }
+
+  /* 64 byte aligned, so rows of the buffers start on a cache line. */
+  void *alloc(size_t bytes) {
+    size_t start = (size_t) ((((uintptr_t) base + used + 63) & ~(uintptr_t) 63) - (uintptr_t) base);
+    if (start + bytes > size) {
+      return NULL;
+    }
+    used = start + bytes;
+    return base + start;
+  }
+  size_t mark() const { return used; }
+  void release(size_t mark_) { used = mark_; }
+
+private:
+  ScratchArena(const ScratchArena &);
+  ScratchArena &operator=(const ScratchArena &);
+  char *base;
+  size_t size, used;
+  bool owned;
+};
+
+/* Gives back everything allocated from the arena (if any) in this scope. */
+struct ArenaScope {
+  ScratchArena *arena;
+  size_t saved;
+  ArenaScope(ScratchArena *arena_) : arena(arena_), saved(arena_ ? arena_->mark() : 0) {}
+  ~ArenaScope() { if (arena) arena->release(saved); }
+};
+
+
+// Just a simple struct for Box
+struct Box {
+  int xmin, xmax, ymin, ymax;
+};
+
+/* Constraint pixels by label, in compressed rows: the pixels of label l are
+   xy[offset[l]] .. xy[offset[l+1]-1], packed with XY_TO_INT. Only pixels that
+   are usable source patch corners are kept, see getConstraintIndex(). */
+struct ConstraintIndex {
+  int offset[257];
+  std::vector<int> xy;
+  std::vector<int> constraint_ids;   // labels with at least one pixel, ascending
+
+  ConstraintIndex() { clear(); }
+  void clear() {
+    for (int l = 0; l < 257; ++l) {
+      offset[l] = 0;
+    }
+    xy.clear();
+    constraint_ids.clear();
+  }
+  int count(int label) const { return offset[label+1] - offset[label]; }
+};
+
+/* Wall clock deadline for anytime completion, budget in seconds (<= 0 means no limit). */
+struct Deadline {
+  double start, budget;
+  Deadline(double budget_ = 0) : start((double)cv::getTickCount()), budget(budget_) {}
+  bool limited() const { return budget > 0; }
+  double elapsed() const { return ((double)cv::getTickCount() - start) / cv::getTickFrequency(); }
+  double remaining() const { return limited() ? budget - elapsed() : INFINITY; }
+  bool expired() const { return limited() && remaining() <= 0; }
+};
+
+/* -------------------------------------------------------------------------
+   PatchMatch, using L2 distance between upright patches that translate only
+   ------------------------------------------------------------------------- */
+
+extern int patch_w;
+extern int pm_iters;
+extern int rs_max;
+extern int sigma;
+extern unsigned int pm_seed;
+/* Threads for the per-label PatchMatch subproblems, the parallel sweep modes
+   and voting, 0 for one per core. */
+extern int pm_threads;
+/* How patchmatch() runs its sweeps:
+   PM_SWEEP_SCANLINE      serial scanline passes over concurrent jobs: every
+                          constraint label in its bounding box, the unconstrained
+                          pixels (label 0) in bands of 64 rows that move by half a
+                          band every other sweep; reproducible for any thread count
+   PM_SWEEP_HOGWILD       each label swept by pm_threads threads at once on a
+                          lock-free field, in bands of pm_tile_rows rows that
+                          pm_run_tiles() hands out in sweep order, idle threads
+                          stealing the far end of another's share; not reproducible
+   PM_SWEEP_CHECKERBOARD  jump flooding from step 2^pm_jumps down to 1 in
+                          checkerboard phases, each phase split over pm_threads
+                          threads; reproducible for any thread count */
+enum PMSweepMode { PM_SWEEP_SCANLINE, PM_SWEEP_HOGWILD, PM_SWEEP_CHECKERBOARD };
+extern PMSweepMode pm_sweep_mode;
+extern int pm_jumps;
+/* Rows per tile of the parallel sweeps and voting, which threads balance by
+   work stealing; voting uses at least patch_w. */
+extern int pm_tile_rows;
+
+/* Random numbers for NNF initialization, random search, constraint sampling
+   and the initial hole colors. Each thread has its own xorshift64* state, so
+   a run is reproducible for a given seed and thread count. image_complete()
+   reseeds from pm_seed on entry; direct callers of patchmatch() call
+   pm_srand() themselves. A --budget run still depends on timing. */
+extern thread_local unsigned long long pm_rng_state;
+void pm_srand(unsigned int seed);
+/* Seeds stream number stream of seed, for the rows and bands that parallel
+   sweeps hand out. Every (seed, stream) pair starts from its own state. */
+void pm_srand(unsigned int seed, unsigned int stream);
+
+inline int pm_rand() {
+  pm_rng_state ^= pm_rng_state >> 12;
+  pm_rng_state ^= pm_rng_state << 25;
+  pm_rng_state ^= pm_rng_state >> 27;
+  return (int) ((pm_rng_state * 2685821657736338717ULL) >> 33);
+}
+
+#define XY_TO_INT(x, y) (((y)<<12)|(x))
+#define INT_TO_X(v) ((v)&((1<<12)-1))
+#define INT_TO_Y(v) ((v)>>12)
+
+/* Index the labelled pixels of constraint that are valid source patch corners:
+   inside bew x beh and outside dilated_mask. Replaces the contents of index. */
+void getConstraintIndex(cv::Mat constraint, cv::Mat dilated_mask, int bew, int beh, ConstraintIndex *index);
+Box getBox(cv::Mat mask);
+bool inBox(int x, int y, Box box);
+/* Grow the hole so that every patch with its corner outside it is fully known. */
+cv::Mat dilate_mask(cv::Mat mask);
+int dist(cv::Mat a, cv::Mat b, int ax, int ay, int bx, int by, int cutoff=INT_MAX);
+
+/* Random NNF for every patch of a, only pointing at patches of b outside dilated_mask
+   (and, for constrained pixels, at the cindex pixels of the same constraint label).
+   Labels are read at a and at b coordinates, so constraint has to cover both.
+   The pixels of each label of a, those of label 0 in bands, are solved as separate
+   subproblems, concurrently, see pm_threads. */
+void patchmatch_init(cv::Mat a, cv::Mat b, BITMAP *&ann, BITMAP *&annd, cv::Mat dilated_mask,
+                     cv::Mat constraint, const ConstraintIndex *cindex, ScratchArena *arena = NULL);
+/* One propagation + random search pass; odd iterations run in reverse scanline order.
+   With PM_SWEEP_CHECKERBOARD a checkerboard sweep instead. */
+void patchmatch_sweep(cv::Mat a, cv::Mat b, BITMAP *ann, BITMAP *annd, cv::Mat dilated_mask,
+                      cv::Mat constraint, const ConstraintIndex *cindex, int iter);
+void patchmatch(cv::Mat a, cv::Mat b, BITMAP *&ann, BITMAP *&annd, cv::Mat dilated_mask, cv::Mat constraint,
+                const ConstraintIndex *cindex, const Deadline *deadline = NULL, ScratchArena *arena = NULL,
+                int iters = 0);
+/* Start from the field already in ann/annd instead (rescored on a and b), only
+   for the patch corners in box, with iters serial sweeps. */
+void patchmatch_refine(cv::Mat a, cv::Mat b, BITMAP *ann, BITMAP *annd, cv::Mat dilated_mask, cv::Mat constraint,
+                       const ConstraintIndex *cindex, Box box, int iters);
+
+/* Let every patch with its corner in box vote for its pixels with the colors of its
+   nearest neighbor in img. R and Rcount are CV_32FC3 accumulators. Runs on
+   pm_threads threads, see pm_vote_tiled(). */
+void vote(cv::Mat img, BITMAP *ann, BITMAP *annd, Box box, cv::Mat R, cv::Mat Rcount);
+/* Divide the votes by their weights, in place. */
+void normalize_votes(cv::Mat R, cv::Mat Rcount);
+
+/* -------------------------------------------------------------------------
+   Pyramid of the input, level 0 being full resolution and level k a 2^-k
+   downscale (sizes as resize() with fx = fy = 2^-k gives them)
+   ------------------------------------------------------------------------- */
+
+/* The image levels are built once, each from the one above. set_mask()
+   replaces mask and constraint levels and keeps the image ones, so repeated
+   requests on one image with different masks only pay for the masks. The
+   dilated mask, hole box and constraint index of a level are computed on
+   first use and cached for the current patch_w. */
+class CompletionPyramid {
+public:
+  CompletionPyramid(cv::Mat image, int nlevels);
+  void set_mask(cv::Mat mask, cv::Mat constraint);
+
+  /* Can be less than asked for if the image gets too small. */
+  int levels() const { return (int) images.size(); }
+  bool same_image(cv::Mat image) const;
+
+  const cv::Mat &image(int level) const { return images[level]; }
+  const cv::Mat &mask(int level) const { return masks[level]; }          // 0 or 255
+  const cv::Mat &constraint(int level) const { return constraints[level]; }
+  const cv::Mat &dilated_mask(int level);
+  const Box &box(int level);
+  const ConstraintIndex &constraint_index(int level);
+  /* Largest inscribed radius of the hole at level 0, in pixels. */
+  double hole_radius();
+
+private:
+  struct Derived {
+    cv::Mat dilated;
+    Box box;
+    ConstraintIndex cindex;
+    bool has_box, has_index;
+    Derived() : has_box(false), has_index(false) {}
+  };
+  void check_patch_w();
+
+  std::vector<cv::Mat> images, masks, constraints;
+  std::vector<Derived> derived;
+  int derived_patch_w;
+  double radius;        // -1 until computed
+};
+
+/* How deep image_complete() goes and how many iterations each level gets.
+   Levels are counted as for PreviewCallback, 0 being the coarsest. */
+struct CompletionSchedule {
+  const char *name;
+  int levels;           // fixed pyramid depth, fewer on small images; 0 to derive it from the hole
+  int max_levels;       // bound on the derived depth
+  double hole_radius;   // derived depth: the hole's inscribed radius at the coarsest level, in patch widths
+  int em_coarse, em_fine;  // EM iterations at the coarsest and the finest level, geometric in between
+  double pm_coarse;     // PatchMatch sweeps at the coarsest level as a multiple of pm_iters, down to 1x
+
+  int max_depth() const { return levels > 0 ? levels : max_levels; }
+  int depth(CompletionPyramid &pyramid) const;
+  int em_iterations(int level, int nlevels) const;
+  int pm_iterations(int level, int nlevels) const;
+};
+
+extern CompletionSchedule completion_schedule;
+/* The named profile, NULL if unknown: "fast", "default", "quality", or
+   "legacy" for the fixed 4 levels of 60 EM iterations the completion used
+   to run. completion_schedule starts as "default". */
+const CompletionSchedule *schedule_profile(const char *name);
+
+/* 2x2 average for an exact 2x downscale of 8-bit images, resize() with
+   INTER_AREA otherwise. */
+void downsample_area(const cv::Mat &src, cv::Mat &dst, cv::Size size);
+
+/* Called after every pyramid level with the current result upsampled to the
+   input resolution. level goes from 0 (coarsest) to nlevels-1 (final). */
+typedef std::function<void(const cv::Mat &preview, int level, int nlevels)> PreviewCallback;
+
+cv::Mat compose_preview(cv::Mat im_orig, cv::Mat mask, cv::Mat resize_img);
+/* With a checkpoint file, the state is saved there every checkpoint_interval
+   seconds and a run finding a checkpoint of the same job resumes from it,
+   see CheckpointWriter. */
+cv::Mat image_complete(cv::Mat im_orig, cv::Mat mask, cv::Mat constraint,
+                       PreviewCallback on_level = PreviewCallback(),
+                       const std::atomic<bool> *cancel = NULL, double budget = 0,
+                       ScratchArena *arena = NULL, const char *checkpoint = NULL);
+/* As above on a pyramid that already has its mask set. */
+cv::Mat image_complete(CompletionPyramid &pyramid, PreviewCallback on_level = PreviewCallback(),
+                       const std::atomic<bool> *cancel = NULL, double budget = 0,
+                       ScratchArena *arena = NULL, const char *checkpoint = NULL);
+/* Arena size that keeps image_complete() from allocating per EM iteration. */
+size_t image_complete_scratch_bytes(int cols, int rows);
+
+/* -------------------------------------------------------------------------
+   Checkpoints of image_complete(), implemented in checkpoint.cpp
+   ------------------------------------------------------------------------- */
+
+/* Everything image_complete() carries from one EM iteration to the next:
+   the NNF is rebuilt from scratch every iteration, so the working image and
+   the random state are enough to go on exactly where a run stopped. */
+struct CompletionState {
+  int level;            // pyramid level being refined
+  int iteration;        // next EM iteration of that level, past the last one once it is done
+  unsigned long long rng;   // pm_rng_state before that iteration
+  cv::Mat image;        // working image of the level
+  cv::Mat mask;         // hole of the level; outside it image is the pyramid's
+};
+
+/* Seconds between checkpoints, 0 for after every EM iteration. */
+extern double checkpoint_interval;
+
+/* Identifies a job: the inputs at full resolution, the depth and every
+   parameter the result depends on. A checkpoint only resumes its own job. */
+uint64_t completion_fingerprint(CompletionPyramid &pyramid, int nlevels);
+
+/* Reads the checkpoint in path into state if it belongs to fingerprint, with
+   the image of state.level taken from pyramid outside the hole. */
+bool load_checkpoint(const std::string &path, uint64_t fingerprint, CompletionPyramid &pyramid,
+                     CompletionState &state);
+
+/* Writes checkpoints on its own thread. post() only copies the image, the
+   file is written (to path.tmp, then renamed over path, so a crash leaves the
+   previous checkpoint intact) while the completion goes on. A state posted
+   while the last one is still being written replaces any older one waiting. */
+class CheckpointWriter {
+public:
+  CheckpointWriter(const std::string &path, uint64_t fingerprint);
+  /* Writes what is still waiting. */
+  ~CheckpointWriter();
+
+  /* checkpoint_interval has passed since the last post(). */
+  bool due() const;
+  void post(const CompletionState &state);
+  /* Waits for the writes and deletes the checkpoint, once the job is done. */
+  void remove();
+
+private:
+  void run();
+
+  std::string path;
+  uint64_t fingerprint;
+  double last_post;
+  std::mutex m;
+  std::condition_variable wake, idle;
+  CompletionState pending;
+  bool has_pending, writing, stopping;
+  std::thread writer;
+};
+
+/* -------------------------------------------------------------------------
+   Video, implemented in video.cpp
+   ------------------------------------------------------------------------- */
+
+/* EM iterations and PatchMatch sweeps per warm-started frame, and the color
+   difference (largest over the channels) at which a pixel counts as changed
+   since the previous frame. */
+extern int video_em_iters;
+extern int video_pm_iters;
+extern int video_change_threshold;
+
+/* Completes the frames of a video one after the other. The first frame (and
+   any frame whose size changes) is completed from scratch by image_complete().
+   The following ones start from the previous result and its full-resolution
+   nearest neighbor field and only run video_em_iters EM iterations at full
+   resolution, on the hole pixels within a patch of a pixel whose mask or
+   color changed. The other hole pixels keep their previous colors, so still
+   parts of the fill do not flicker, and a frame where nothing changed near
+   the hole costs no PatchMatch at all. */
+class VideoCompletion {
+public:
+  VideoCompletion();
+
+  cv::Mat next(cv::Mat frame, cv::Mat mask, cv::Mat constraint);
+  /* Frames, frames per second and how much of the holes was recomputed. */
+  void print(FILE *f) const;
+
+private:
+  cv::Mat cold(cv::Mat frame, cv::Mat mask, cv::Mat constraint);
+  cv::Mat warm(cv::Mat frame, cv::Mat mask, cv::Mat constraint);
+  void prepare(cv::Mat mask, cv::Mat constraint);
+
+  cv::Mat prev_frame, prev_mask, prev_constraint, prev_result;
+  // dilated mask and constraint index of prev_mask and prev_constraint
+  cv::Mat dilated;
+  ConstraintIndex cindex;
+  // full-resolution field of prev_result
+  std::unique_ptr<BITMAP> ann, annd;
+
+  int frames, cold_frames, warm_frames, still_frames;
+  double seconds;
+  long long hole_pixels, recomputed_pixels;
+};
+
+/* Frames in the window, frames per 3D patch and EM iterations per frame of
+   SpaceTimeCompletion. */
+extern int spacetime_window;
+extern int spacetime_patch_t;
+extern int spacetime_em_iters;
+
+class FrameRing;
+
+/* Space-time completion with the 3D patches of pm_spacetime.h over the last
+   spacetime_window frames, held in a FrameRing. Every new frame starts its
+   hole from the frame before (the first one from image_complete()), then
+   spacetime_em_iters EM iterations run over the whole window, so a frame is
+   refined until it drops out of the window and is returned. Constraints are
+   not used. */
+class SpaceTimeCompletion {
+public:
+  SpaceTimeCompletion();
+  ~SpaceTimeCompletion();
+
+  /* The completed frames leaving the window, oldest first: none while it
+     fills up, then one per frame, and all of it when the frame size changes
+     (the window starts over at the new size). */
+  std::vector<cv::Mat> push(cv::Mat frame, cv::Mat mask);
+  /* The frames still in the window, oldest first; starts over after. */
+  std::vector<cv::Mat> flush();
+  void print(FILE *f) const;
+
+private:
+  std::unique_ptr<FrameRing> ring;
+  std::vector<std::vector<float> > accum;   // vote sums per window position
+  int frames;
+  double seconds;
+  const char *kernel;   // distance kernel of the last EM iterations
+};
+
+/* -------------------------------------------------------------------------
+   Retargeting, implemented in retarget.cpp
+   ------------------------------------------------------------------------- */
+
+/* Smallest side of the coarsest level retarget() starts from; the size
+   change per gradual resizing step there, as a fraction of the current size;
+   EM iterations per step and per finer level; PatchMatch sweeps per EM
+   iteration once the fields are carried over, and their random search
+   radius on the finer levels. */
+extern int retarget_min_size;
+extern double retarget_step;
+extern int retarget_step_iters;
+extern int retarget_em_iters;
+extern int retarget_pm_iters;
+extern int retarget_rs_reuse;
+
+/* Resizes image to size by bidirectional similarity (Simakov et al.,
+   "Summarizing Visual Data Using Bidirectional Similarity"): the result
+   holds every patch of the image (completeness) and nothing that is not in
+   it (coherence). The size changes gradually at the coarsest level, then
+   the result is refined level by level. Every step starts from the fields
+   of the one before, rescaled, in both directions, and solves them
+   concurrently. The sides of size have to be at least patch_w. */
+cv::Mat retarget(cv::Mat image, cv::Size size);
+
+/* Runs completions on a background thread so callers get previews while the
+   finer levels are still being refined. Submitting a new request cancels the
+   one in flight; a cancelled request delivers no further previews. A request
+   on the same image as the last one reuses its pyramid. */
+class CompletionWorker {
+public:
+  CompletionWorker() : cancel_flag(false) {}
+  ~CompletionWorker() { cancel(); }
+
+  void submit(cv::Mat im_orig, cv::Mat mask, cv::Mat constraint, PreviewCallback on_level,
+              std::function<void(const cv::Mat &)> on_done, double budget = 0);
+
+  /* Stop the running request (if any) at its next EM iteration. */
+  void cancel();
+  void wait();
+
+private:
+  std::thread worker;
+  std::atomic<bool> cancel_flag;
+  // image levels of the last request, reused while the image stays the same
+  std::shared_ptr<CompletionPyramid> pyramid;
+};
+
+#endif
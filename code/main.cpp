@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "image_complete.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "pm_stats.h"
+
+using namespace cv;
+using namespace std;
+
+/* Write to a temporary file first so a reader polling `filename` never sees a
+   half-written image. */
+void publish_image(const string &filename, const Mat &img) {
+  PROFILE_SCOPE("imwrite");
+  size_t dot = filename.find_last_of('.');
+  string tmpname = (dot == string::npos) ? filename + ".tmp"
+                                         : filename.substr(0, dot) + ".tmp" + filename.substr(dot);
+  imwrite(tmpname, img);
+  if (rename(tmpname.c_str(), filename.c_str()) != 0) {
+    fprintf(stderr, "Error writing image '%s'\n", filename.c_str());
+  }
+}
+
+bool load_inputs(const char *im_file, const char *mask_file, const char *const_file,
+                 Mat &image, Mat &mask_cv, Mat &const_cv) {
+  PROFILE_SCOPE("imread");
+  image = imread(im_file);
+  mask_cv = imread(mask_file, CV_LOAD_IMAGE_GRAYSCALE);
+  const_cv = imread(const_file, CV_LOAD_IMAGE_GRAYSCALE);
+  if (image.empty() || mask_cv.empty() || const_cv.empty()) {
+    fprintf(stderr, "Error reading inputs '%s', '%s', '%s'\n", im_file, mask_file, const_file);
+    return false;
+  }
+  return true;
+}
+
+/* Server mode for interactive front ends: every line on stdin is a request
+   "image mask constraint result [budget_ms]". The result file is rewritten
+   after each pyramid level; a new line cancels the request still in progress. */
+void serve(double default_budget) {
+  CompletionWorker worker;
+  string line;
+  while (getline(cin, line)) {
+    istringstream req(line);
+    string im_file, mask_file, const_file, out_file;
+    if (!(req >> im_file >> mask_file >> const_file >> out_file)) {
+      fprintf(stderr, "expected: image mask constraint result [budget_ms]\n");
+      continue;
+    }
+    double budget_ms;
+    double budget = (req >> budget_ms) ? budget_ms / 1000 : default_budget;
+    Mat image, mask_cv, const_cv;
+    if (!load_inputs(im_file.c_str(), mask_file.c_str(), const_file.c_str(), image, mask_cv, const_cv)) {
+      continue;
+    }
+    worker.submit(image, mask_cv, const_cv,
+                  [out_file](const Mat &preview, int level, int nlevels) {
+                    publish_image(out_file, preview);
+                    printf("preview %s %d/%d\n", out_file.c_str(), level + 1, nlevels);
+                    fflush(stdout);
+                  },
+                  [out_file](const Mat &result) {
+                    publish_image(out_file, result);
+                    printf("done %s\n", out_file.c_str());
+                    fflush(stdout);
+                  }, budget);
+  }
+  worker.wait();
+}
+
+/* One line of a batch list on its way through the pipeline. */
+struct BatchJob {
+  string im_file, mask_file, const_file, out_file;
+  Mat image, mask, constraint, result;
+};
+
+/* Batch mode: every line of list_file is "image mask constraint result".
+   Decoding, completion and encoding run as a pipeline of worker threads
+   connected by queues of queue_depth jobs, so the next inputs are read and
+   finished results written while completions run; full queues block the
+   stage before them, which bounds the images held in memory. Prints the
+   throughput of every stage and the depth of both queues at the end. */
+void batch(const char *list_file, int workers, int queue_depth, double budget) {
+  const int decoders = 2, encoders = 2;
+  ifstream list(list_file);
+  if (!list) {
+    fprintf(stderr, "Error reading batch list '%s'\n", list_file);
+    exit(1);
+  }
+  vector<BatchJob> requests;
+  string line;
+  while (getline(list, line)) {
+    istringstream req(line);
+    BatchJob job;
+    if (req >> job.im_file >> job.mask_file >> job.const_file >> job.out_file) {
+      requests.push_back(job);
+    } else if (line.find_first_not_of(" \t\r") != string::npos) {
+      fprintf(stderr, "expected: image mask constraint result, skipping '%s'\n", line.c_str());
+    }
+  }
+
+  BoundedQueue<BatchJob> decoded(queue_depth), completed(queue_depth);
+  StageStats decode_stats, complete_stats, encode_stats;
+  atomic<size_t> next(0);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  vector<thread> decode_pool, complete_pool, encode_pool;
+  for (int t = 0; t < decoders; ++t) {
+    decode_pool.push_back(thread([&]() {
+      for (size_t i = next++; i < requests.size(); i = next++) {
+        BatchJob job = requests[i];
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        bool ok = load_inputs(job.im_file.c_str(), job.mask_file.c_str(), job.const_file.c_str(), job.image,
+                              job.mask, job.constraint);
+        decode_stats.add(pipeline_seconds(t0), ok);
+        if (ok) {
+          decoded.push(move(job));
+        }
+      }
+    }));
+  }
+  for (int t = 0; t < workers; ++t) {
+    complete_pool.push_back(thread([&]() {
+      BatchJob job;
+      while (decoded.pop(job)) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        job.result = image_complete(job.image, job.mask, job.constraint, PreviewCallback(), NULL, budget);
+        job.image = job.mask = job.constraint = Mat();
+        complete_stats.add(pipeline_seconds(t0));
+        completed.push(move(job));
+      }
+    }));
+  }
+  for (int t = 0; t < encoders; ++t) {
+    encode_pool.push_back(thread([&]() {
+      BatchJob job;
+      while (completed.pop(job)) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        publish_image(job.out_file, job.result);
+        encode_stats.add(pipeline_seconds(t0));
+        printf("done %s\n", job.out_file.c_str());
+        fflush(stdout);
+      }
+    }));
+  }
+  for (size_t t = 0; t < decode_pool.size(); ++t) {
+    decode_pool[t].join();
+  }
+  decoded.close();
+  for (size_t t = 0; t < complete_pool.size(); ++t) {
+    complete_pool[t].join();
+  }
+  completed.close();
+  for (size_t t = 0; t < encode_pool.size(); ++t) {
+    encode_pool[t].join();
+  }
+
+  double wall = pipeline_seconds(start);
+  printf("batch: %d jobs in %.3f s (%.2f jobs/s)\n", (int) requests.size(), wall,
+         wall > 0 ? requests.size() / wall : 0.0);
+  printf("%-10s %8s %6s %6s %10s %10s %11s\n", "stage", "workers", "jobs", "failed", "busy s", "jobs/s",
+         "utilization");
+  decode_stats.print(stdout, "decode", decoders, wall);
+  complete_stats.print(stdout, "complete", workers, wall);
+  encode_stats.print(stdout, "encode", encoders, wall);
+  printf("%-10s %8s %10s %10s %12s %12s\n", "queue", "capacity", "max depth", "mean depth", "full wait s",
+         "empty wait s");
+  decoded.print(stdout, "decoded");
+  completed.print(stdout, "completed");
+}
+
+/* Frame i of a printf pattern ("in/%04d.png"), or the one image of a name
+   without a %. */
+Mat read_frame(const char *pattern, int i, int flags) {
+  if (!strchr(pattern, '%')) {
+    return imread(pattern, flags);
+  }
+  char name[1024];
+  snprintf(name, sizeof(name), pattern, i);
+  return imread(name, flags);
+}
+
+/* Video mode: frames is a video file or a pattern of numbered images
+   (starting at 0 or 1), mask and constraint a pattern numbered the same way
+   or one image for every frame, out_pattern a pattern the results are
+   written to. Frames are completed in order by a VideoCompletion, each
+   starting from the previous one, or with spacetime by a
+   SpaceTimeCompletion, which hands them back a window later. */
+void video(const char *frames, const char *mask_file, const char *const_file, const char *out_pattern,
+           bool spacetime) {
+  if (!strchr(out_pattern, '%')) {
+    fprintf(stderr, "--video: '%s' needs a %% for the frame number\n", out_pattern);
+    exit(1);
+  }
+  VideoCapture capture;
+  bool numbered = strchr(frames, '%') != NULL;
+  int first = 0;
+  if (numbered) {
+    first = read_frame(frames, 0, CV_LOAD_IMAGE_COLOR).empty() ? 1 : 0;
+  } else if (!capture.open(frames)) {
+    fprintf(stderr, "Error opening video '%s'\n", frames);
+    exit(1);
+  }
+
+  VideoCompletion completion;
+  SpaceTimeCompletion spacetime_completion;
+  int written = first;
+  char name[1024];
+  for (int i = first;; ++i) {
+    Mat frame;
+    if (numbered) {
+      frame = read_frame(frames, i, CV_LOAD_IMAGE_COLOR);
+    } else {
+      capture.read(frame);
+    }
+    if (frame.empty()) {
+      break;
+    }
+    Mat mask = read_frame(mask_file, i, CV_LOAD_IMAGE_GRAYSCALE);
+    Mat constraint = read_frame(const_file, i, CV_LOAD_IMAGE_GRAYSCALE);
+    if (mask.empty() || constraint.empty()) {
+      fprintf(stderr, "Error reading mask or constraint of frame %d\n", i);
+      exit(1);
+    }
+    if (spacetime) {
+      vector<Mat> results = spacetime_completion.push(frame, mask);
+      for (size_t k = 0; k < results.size(); ++k) {
+        snprintf(name, sizeof(name), out_pattern, written++);
+        imwrite(name, results[k]);
+      }
+      continue;
+    }
+    Mat result = completion.next(frame, mask, constraint);
+    snprintf(name, sizeof(name), out_pattern, i);
+    imwrite(name, result);
+  }
+  if (spacetime) {
+    vector<Mat> rest = spacetime_completion.flush();
+    for (size_t k = 0; k < rest.size(); ++k) {
+      snprintf(name, sizeof(name), out_pattern, written++);
+      imwrite(name, rest[k]);
+    }
+    spacetime_completion.print(stdout);
+    return;
+  }
+  completion.print(stdout);
+}
+
+/* Retargeting mode: a resized to size by retarget(). */
+void retarget_image(const char *im_file, const char *out_file, Size size) {
+  Mat image = imread(im_file);
+  if (image.empty()) {
+    fprintf(stderr, "Error reading image '%s'\n", im_file);
+    exit(1);
+  }
+  if (size.width < patch_w || size.height < patch_w || size.width > 4096 || size.height > 4096 ||
+      image.cols > 4096 || image.rows > 4096) {
+    fprintf(stderr, "--retarget: sizes have to be between %d and 4096 pixels\n", patch_w);
+    exit(1);
+  }
+  publish_image(out_file, retarget(image, size));
+}
+
+/* Write the Chrome trace and print the per-phase summary, see profile.h. */
+void finish_profile(const char *trace_file) {
+  if (!trace_file) {
+    return;
+  }
+#ifdef PM_PROFILE
+  profile_enable(false);
+  profile_write_trace(trace_file);
+  profile_print_summary(stdout);
+#else
+  fprintf(stderr, "--trace: built without PM_PROFILE, no trace written\n");
+#endif
+}
+
+void print_stats(bool stats) {
+  if (!stats) {
+    return;
+  }
+#ifdef PM_STATS
+  pm_stats_total().print(stdout);
+#else
+  fprintf(stderr, "--stats: built without PM_STATS, no counters collected\n");
+#endif
+}
+
+int main(int argc, char *argv[]) {
+  argc--;
+  argv++;
+  bool preview = false, serve_mode = false, video_mode = false, spacetime = false;
+  Size retarget_size;
+  const char *batch_list = NULL;
+  int batch_workers = 1, batch_queue = 2;
+  double budget = 0;
+  const char *trace_file = NULL;
+  const char *checkpoint_file = NULL;
+  bool stats = false;
+  vector<char *> args;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--serve") == 0) {
+      serve_mode = true;
+    } else if (strcmp(argv[i], "--video") == 0) {
+      video_mode = true;
+    } else if (strcmp(argv[i], "--spacetime") == 0) {
+      video_mode = spacetime = true;
+    } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+      spacetime_window = max(1, min(127, atoi(argv[++i])));
+    } else if (strcmp(argv[i], "--patch-t") == 0 && i + 1 < argc) {
+      spacetime_patch_t = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--video-iters") == 0 && i + 1 < argc) {
+      video_em_iters = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--video-threshold") == 0 && i + 1 < argc) {
+      video_change_threshold = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--retarget") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &retarget_size.width, &retarget_size.height) != 2) {
+        fprintf(stderr, "--retarget: expected WxH, got '%s'\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--retarget-step") == 0 && i + 1 < argc) {
+      retarget_step = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_list = argv[++i];
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      batch_workers = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+      batch_queue = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--preview") == 0) {
+      preview = true;
+    } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+      budget = atof(argv[++i]) / 1000;
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      checkpoint_file = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+      checkpoint_interval = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      pm_seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      pm_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--hogwild") == 0) {
+      pm_sweep_mode = PM_SWEEP_HOGWILD;
+    } else if (strcmp(argv[i], "--checkerboard") == 0) {
+      pm_sweep_mode = PM_SWEEP_CHECKERBOARD;
+    } else if (strcmp(argv[i], "--jumps") == 0 && i + 1 < argc) {
+      pm_jumps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc) {
+      const CompletionSchedule *profile = schedule_profile(argv[++i]);
+      if (!profile) {
+        fprintf(stderr, "Unknown schedule '%s', use fast, default, quality or legacy\n", argv[i]);
+        exit(1);
+      }
+      completion_schedule = *profile;
+    } else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+      completion_schedule.levels = atoi(argv[++i]);
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  if (trace_file) {
+    profile_enable(true);
+  }
+  if (serve_mode) {
+    serve(budget);
+    finish_profile(trace_file);
+    print_stats(stats);
+    return 0;
+  }
+  if (batch_list) {
+    batch(batch_list, batch_workers, batch_queue, budget);
+    finish_profile(trace_file);
+    print_stats(stats);
+    return 0;
+  }
+  if (video_mode && args.size() == 4) {
+    video(args[0], args[1], args[2], args[3], spacetime);
+    finish_profile(trace_file);
+    print_stats(stats);
+    return 0;
+  }
+  if (retarget_size.width > 0 && (args.size() == 1 || args.size() == 2)) {
+    retarget_image(args[0], args.size() == 2 ? args[1] : "final_out.png", retarget_size);
+    finish_profile(trace_file);
+    print_stats(stats);
+    return 0;
+  }
+  if (video_mode || retarget_size.width > 0 || (args.size() != 3 && args.size() != 4)) { fprintf(stderr, "im_complete [--preview] [--budget ms] [--trace file.json] [--stats] [--seed n] [--threads n]\n"
+                                   "            [--hogwild | --checkerboard [--jumps n]] [--schedule name] [--levels n]\n"
+                                   "            [--checkpoint file [--checkpoint-every s]] a mask constraint [result]\n"
+                                   "im_complete [--budget ms] [--trace file.json] [--stats] [--seed n] [--threads n]\n"
+                                   "            [--hogwild | --checkerboard [--jumps n]] [--schedule name] [--levels n] --serve\n"
+                                   "im_complete [options as above] --batch list [--workers n] [--queue n]\n"
+                                   "im_complete [options as above] --video [--video-iters n] [--video-threshold t]\n"
+                                   "            frames mask constraint out_%%04d.png\n"
+                                   "im_complete [options as above] --spacetime [--window n] [--patch-t n] frames mask\n"
+                                   "            constraint out_%%04d.png\n"
+                                   "im_complete [options as above] --retarget WxH [--retarget-step f] a [result]\n"
+                                   "Given input image a, mask and constraint image outputs result (default final_out.png)\n"
+                                   "--preview rewrites result after every pyramid level; --budget returns the best result\n"
+                                   "within the given wall clock time; --serve reads 'a mask constraint result [budget_ms]'\n"
+                                   "requests from stdin, a new request cancels the running one. --trace writes a Chrome\n"
+                                   "trace of all phases and prints a timing summary, --stats prints PatchMatch counters.\n"
+                                   "--seed (default 1) makes runs without --budget reproducible. --threads (default one\n"
+                                   "per core) bounds the constraint labels solved at once; results do not depend on it.\n"
+                                   "--hogwild sweeps every label with --threads threads at once instead (not reproducible).\n"
+                                   "--checkerboard propagates in independent checkerboard phases with jump flooding\n"
+                                   "from step 2^jumps (default 2), each phase on --threads threads.\n"
+                                   "--schedule picks pyramid depth and iterations per level: fast, default (depth from\n"
+                                   "the hole size, fewer iterations on finer levels), quality, or legacy (4 levels of 60\n"
+                                   "iterations). --levels n fixes the depth (fewer if the coarsest level would be\n"
+                                   "under 4 patch widths), 0 derives it from the hole.\n"
+                                   "--checkpoint saves the progress to file every --checkpoint-every seconds (default 30,\n"
+                                   "0 after every EM iteration) without stopping the completion. Running the same command\n"
+                                   "again resumes from it with the same result; it is deleted once the result is written.\n"
+                                   "--batch completes every 'a mask constraint result' line of list, decoding and encoding\n"
+                                   "on their own threads while --workers (default 1) completions run; --queue (default 2)\n"
+                                   "bounds the jobs waiting between stages. Prints throughput and queue depth per stage.\n"
+                                   "--video completes a video file or numbered images (frames/%%04d.png) in order, with\n"
+                                   "the same or numbered masks and constraints. Frames after the first start from the\n"
+                                   "previous result and its field and only redo the hole near pixels that changed by\n"
+                                   "more than --video-threshold (default 12), with --video-iters (default 5) EM\n"
+                                   "iterations at full resolution. Prints frames per second.\n"
+                                   "--spacetime matches 3D patches of --patch-t frames (default 3) over a sliding window\n"
+                                   "of --window frames (default 8) instead; each frame is written once it leaves the\n"
+                                   "window. Constraints are ignored.\n"
+                                   "--retarget resizes a to W x H pixels by bidirectional similarity, changing the size by\n"
+                                   "at most --retarget-step (default 0.05) of it per step at the coarsest level.\n"); exit(1); }
+  string out_file = (args.size() == 4) ? args[3] : "final_out.png";
+
+  Mat image, mask_cv, const_cv;
+  if (!load_inputs(args[0], args[1], args[2], image, mask_cv, const_cv)) {
+    exit(1);
+  }
+  printf("mask_cv type %d\n", mask_cv.type());
+
+  PreviewCallback on_level;
+  if (preview) {
+    on_level = [out_file](const Mat &img, int level, int nlevels) {
+      publish_image(out_file, img);
+    };
+  }
+  Mat result = image_complete(image, mask_cv, const_cv, on_level, NULL, budget, NULL, checkpoint_file);
+  publish_image(out_file, result);
+  finish_profile(trace_file);
+  print_stats(stats);
+
+  return 0;
+}
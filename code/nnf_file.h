@@ -0,0 +1,263 @@
+/* -------------------------------------------------------------------------
+  Binary nearest neighbor field files (.nnf), so a field can be kept between
+  runs and handed back to the engine as its starting point.
+
+  Layout, all little-endian:
+
+    0    NNFFileHeader, 64 bytes
+    64   k match planes, then k distance planes
+
+  A plane is height rows of stride int32s; stride is width rounded up to a
+  multiple of 16, so every row starts on a 64-byte boundary. Matches are
+  packed (by<<12)|bx and distances are squared L2, exactly as in a PMField,
+  so the planes of a mapped file are used in place: nnf_map() maps the file
+  copy-on-write and field(i) points the engine at layer i (0 is the best
+  match, k > 1 for k nearest neighbor fields). Writes to it do not reach the
+  file. On hosts that cannot map or are big-endian the file is read and
+  converted instead.
+
+  Only depends on the standard library and POSIX mmap.
+  -------------------------------------------------------------------------- */
+
+#ifndef NNF_FILE_H
+#define NNF_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "pm_engine.h"
+
+#define NNF_FILE_MAGIC "PMNNF\r\n\x1a"
+#define NNF_FILE_VERSION 1
+#define NNF_FILE_ALIGN 64
+
+struct NNFFileHeader {
+  char magic[8];            // NNF_FILE_MAGIC, catches text-mode transfers like the PNG signature
+  uint32_t version;         // NNF_FILE_VERSION
+  uint32_t header_bytes;    // offset of the first plane
+  uint32_t width, height;   // field size, the patch corners of a are [0, width-patch_w] x [0, height-patch_w]
+  uint32_t b_width, b_height;   // size of the image the matches point into
+  uint32_t patch_w;
+  uint32_t knn;             // layers, 1 for a plain NNF
+  uint32_t stride;          // int32s per row
+  uint32_t flags;           // 0, reserved
+  uint64_t nn_offset;       // offset of match plane 0; plane i is i plane_bytes() further
+  uint64_t d_offset;        // offset of distance plane 0
+
+  uint64_t plane_bytes() const { return (uint64_t) stride * height * sizeof(int32_t); }
+};
+
+inline bool nnf_little_endian() {
+  const uint16_t one = 1;
+  return *(const unsigned char *) &one == 1;
+}
+
+inline uint32_t nnf_swap32(uint32_t v) {
+  return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+inline uint64_t nnf_swap64(uint64_t v) {
+  return ((uint64_t) nnf_swap32((uint32_t) v) << 32) | nnf_swap32((uint32_t) (v >> 32));
+}
+
+/* Between host order and little-endian, both ways. */
+inline void nnf_header_order(NNFFileHeader &h) {
+  if (nnf_little_endian()) {
+    return;
+  }
+  uint32_t *fields[] = {&h.version, &h.header_bytes, &h.width, &h.height, &h.b_width, &h.b_height,
+                        &h.patch_w, &h.knn, &h.stride, &h.flags};
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+    *fields[i] = nnf_swap32(*fields[i]);
+  }
+  h.nn_offset = nnf_swap64(h.nn_offset);
+  h.d_offset = nnf_swap64(h.d_offset);
+}
+
+inline NNFFileHeader nnf_make_header(int width, int height, int b_width, int b_height, int patch_w, int knn) {
+  NNFFileHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, NNF_FILE_MAGIC, sizeof(h.magic));
+  h.version = NNF_FILE_VERSION;
+  h.header_bytes = sizeof(NNFFileHeader);
+  h.width = width;
+  h.height = height;
+  h.b_width = b_width;
+  h.b_height = b_height;
+  h.patch_w = patch_w;
+  h.knn = knn;
+  h.stride = (width + NNF_FILE_ALIGN / 4 - 1) / (NNF_FILE_ALIGN / 4) * (NNF_FILE_ALIGN / 4);
+  h.nn_offset = h.header_bytes;
+  h.d_offset = h.nn_offset + knn * h.plane_bytes();
+  return h;
+}
+
+/* Writes the knn layers of fields (each width x height, any row length) to
+   filename. Returns NULL, or what went wrong. */
+inline const char *nnf_save(const char *filename, const PMField *fields, int knn, int width, int height,
+                            int b_width, int b_height, int patch_w) {
+  if (knn < 1 || width < 1 || height < 1 || b_width > 4096) {
+    return "bad field size";
+  }
+  NNFFileHeader h = nnf_make_header(width, height, b_width, b_height, patch_w, knn);
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    return "could not open file for writing";
+  }
+  NNFFileHeader file_h = h;
+  nnf_header_order(file_h);
+  bool ok = fwrite(&file_h, sizeof(file_h), 1, f) == 1;
+  std::vector<int32_t> row(h.stride, 0);
+  for (int plane = 0; plane < 2*knn && ok; ++plane) {
+    const PMField &field = fields[plane % knn];
+    const int *src = plane < knn ? field.nn : field.d;
+    for (int y = 0; y < height && ok; ++y) {
+      for (int x = 0; x < width; ++x) {
+        uint32_t v = (uint32_t) src[y*field.w + x];
+        row[x] = (int32_t) (nnf_little_endian() ? v : nnf_swap32(v));
+      }
+      ok = fwrite(&row[0], sizeof(int32_t), h.stride, f) == h.stride;
+    }
+  }
+  if (fclose(f) != 0 || !ok) {
+    return "write failed";
+  }
+  return NULL;
+}
+
+/* A loaded .nnf file: mapped when possible, else read into memory. */
+class NNFMap {
+public:
+  NNFFileHeader header;
+
+  NNFMap() : base(NULL), bytes(0), mapped(false) { memset(&header, 0, sizeof(header)); }
+  ~NNFMap() { close(); }
+
+  /* Returns NULL, or what went wrong. */
+  const char *open(const char *filename) {
+    close();
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+      return "could not open file";
+    }
+    NNFFileHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    if (!ok) {
+      fclose(f);
+      return "file too short for a header";
+    }
+    nnf_header_order(h);
+    const char *error = check(h, size);
+    if (error) {
+      fclose(f);
+      return error;
+    }
+    header = h;
+    bytes = (size_t) size;
+
+#ifndef _WIN32
+    if (nnf_little_endian()) {
+      void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+      if (p != MAP_FAILED) {
+        fclose(f);
+        base = (unsigned char *) p;
+        mapped = true;
+        return NULL;
+      }
+    }
+#endif
+    copy.resize((bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    base = (unsigned char *) &copy[0];
+    fseek(f, 0, SEEK_SET);
+    ok = fread(base, 1, bytes, f) == bytes;
+    fclose(f);
+    if (!ok) {
+      close();
+      return "read failed";
+    }
+    if (!nnf_little_endian()) {
+      // the header places the match and the distance planes, which need
+      // not follow each other
+      for (uint32_t layer = 0; layer < header.knn; ++layer) {
+        swap_plane((uint32_t *) nn(layer));
+        swap_plane((uint32_t *) d(layer));
+      }
+    }
+    return NULL;
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (mapped) {
+      munmap(base, bytes);
+    }
+#endif
+    std::vector<uint64_t>().swap(copy);
+    base = NULL;
+    bytes = 0;
+    mapped = false;
+  }
+
+  bool is_open() const { return base != NULL; }
+  bool is_mapped() const { return mapped; }
+
+  int *nn(int layer) { return (int *) (base + header.nn_offset + layer*header.plane_bytes()); }
+  int *d(int layer) { return (int *) (base + header.d_offset + layer*header.plane_bytes()); }
+
+  /* Layer of the file as an engine field, refined in place. */
+  PMField field(int layer = 0) {
+    PMField f = {nn(layer), d(layer), (int) header.stride};
+    return f;
+  }
+
+private:
+  void swap_plane(uint32_t *plane) {
+    for (uint64_t i = 0; i < header.plane_bytes() / sizeof(uint32_t); ++i) {
+      plane[i] = nnf_swap32(plane[i]);
+    }
+  }
+
+  static const char *check(const NNFFileHeader &h, long size) {
+    if (memcmp(h.magic, NNF_FILE_MAGIC, sizeof(h.magic)) != 0) {
+      return "not an .nnf file";
+    }
+    if (h.version != NNF_FILE_VERSION) {
+      return "unsupported .nnf version";
+    }
+    if (h.width < 1 || h.height < 1 || h.knn < 1 || h.stride < h.width || h.b_width > 4096 ||
+        h.header_bytes < sizeof(NNFFileHeader)) {
+      return "bad .nnf header";
+    }
+    if (h.nn_offset % NNF_FILE_ALIGN != 0 || h.d_offset % NNF_FILE_ALIGN != 0 || h.stride % (NNF_FILE_ALIGN / 4) != 0) {
+      return "misaligned .nnf planes";
+    }
+    if (h.nn_offset + h.knn*h.plane_bytes() > (uint64_t) size || h.d_offset + h.knn*h.plane_bytes() > (uint64_t) size) {
+      return ".nnf file is truncated";
+    }
+    if (h.nn_offset < h.d_offset + h.knn*h.plane_bytes() && h.d_offset < h.nn_offset + h.knn*h.plane_bytes()) {
+      return "overlapping .nnf planes";
+    }
+    return NULL;
+  }
+
+  NNFMap(const NNFMap &);
+  NNFMap &operator=(const NNFMap &);
+
+  unsigned char *base;
+  size_t bytes;
+  bool mapped;
+  std::vector<uint64_t> copy;   // file contents when not mapped, 8-byte aligned
+};
+
+#endif
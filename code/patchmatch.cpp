@@ -0,0 +1,194 @@
+#include "patchmatch.h"
+#include "image_complete.h"
+
+#include <string.h>
+
+#include <mutex>
+
+using namespace cv;
+using namespace std;
+
+namespace {
+
+mutex engine_mutex;
+
+/* Sets the engine globals for one call and restores them afterwards. */
+class EngineParams {
+public:
+  EngineParams(const PMParams &p) : lock(engine_mutex), saved_patch_w(patch_w), saved_pm_iters(pm_iters),
+                                    saved_rs_max(rs_max), saved_sigma(sigma), saved_seed(pm_seed),
+                                    saved_threads(pm_threads), saved_schedule(completion_schedule) {
+    patch_w = p.patch_w;
+    pm_iters = p.iterations;
+    rs_max = p.rs_max;
+    sigma = patch_w * patch_w;
+    pm_seed = p.seed;
+    pm_threads = p.threads;
+    completion_schedule = *schedule_profile(p.schedule);
+  }
+  ~EngineParams() {
+    patch_w = saved_patch_w;
+    pm_iters = saved_pm_iters;
+    rs_max = saved_rs_max;
+    sigma = saved_sigma;
+    pm_seed = saved_seed;
+    pm_threads = saved_threads;
+    completion_schedule = saved_schedule;
+  }
+
+private:
+  lock_guard<mutex> lock;
+  int saved_patch_w, saved_pm_iters, saved_rs_max, saved_sigma;
+  unsigned int saved_seed;
+  int saved_threads;
+  CompletionSchedule saved_schedule;
+};
+
+size_t row_bytes(const PMBuffer &buf) {
+  return buf.stride ? buf.stride : (size_t) buf.width * buf.channels;
+}
+
+bool valid_buffer(const PMBuffer &buf, int channels, int min_size) {
+  return buf.data && buf.channels == channels && buf.width >= min_size && buf.height >= min_size &&
+         buf.width <= (1 << 12) && row_bytes(buf) >= (size_t) buf.width * buf.channels;
+}
+
+bool same_size(const PMBuffer &a, const PMBuffer &b) {
+  return a.width == b.width && a.height == b.height;
+}
+
+bool valid_params(const PMParams &p) {
+  return p.patch_w >= 1 && p.iterations >= 1 && p.rs_max >= 1 && p.budget_ms >= 0 && p.threads >= 0 &&
+         p.schedule && schedule_profile(p.schedule);
+}
+
+/* A Mat header over the caller's pixels, no copy. */
+Mat wrap(const PMBuffer &buf) {
+  return Mat(buf.height, buf.width, buf.channels == 3 ? CV_8UC3 : CV_8UC1, buf.data, row_bytes(buf));
+}
+
+/* Whether the dilated hole leaves at least two patch corners to copy from.
+   A patch never takes itself as its source, so with fewer some patch has
+   none and PatchMatchEngine::init() would draw forever. */
+bool has_sources(const Mat &dilated_mask) {
+  int bew = dilated_mask.cols - patch_w + 1, beh = dilated_mask.rows - patch_w + 1;
+  return bew > 0 && beh > 0 && bew * beh - countNonZero(dilated_mask(Rect(0, 0, bew, beh))) >= 2;
+}
+
+PMStatus complete(const PMBuffer &image, const PMBuffer &mask, const PMBuffer *constraint, const PMBuffer &out,
+                  const PMParams &params, void *scratch, size_t scratch_bytes) {
+  if (!valid_params(params) || !valid_buffer(image, 3, params.patch_w) || !valid_buffer(mask, 1, 1) ||
+      !valid_buffer(out, 3, 1) || !same_size(image, mask) || !same_size(image, out) ||
+      (constraint && (!valid_buffer(*constraint, 1, 1) || !same_size(image, *constraint)))) {
+    return PM_BAD_ARGUMENT;
+  }
+  if (scratch && scratch_bytes < pm_complete_scratch_bytes(image.width, image.height)) {
+    return PM_SCRATCH_TOO_SMALL;
+  }
+  EngineParams engine(params);
+
+  // the engine expects a strictly binary mask
+  Mat hole;
+  threshold(wrap(mask), hole, 0, 255, 0);
+  Mat labels = constraint ? wrap(*constraint) : Mat::zeros(image.height, image.width, CV_8UC1);
+  CompletionPyramid pyramid(wrap(image), completion_schedule.max_depth());
+  pyramid.set_mask(hole, labels);
+  // every level the schedule runs needs patches to copy from, not just the finest
+  int nlevels = completion_schedule.depth(pyramid);
+  for (int level = 0; level < nlevels; ++level) {
+    if (!has_sources(pyramid.dilated_mask(level))) {
+      return PM_BAD_ARGUMENT;
+    }
+  }
+
+  ScratchArena arena(scratch, scratch_bytes);
+  Mat result = image_complete(pyramid, PreviewCallback(), params.cancel, params.budget_ms / 1000,
+                              scratch ? &arena : NULL);
+  if (result.empty()) {
+    return PM_CANCELLED;
+  }
+  Mat dst = wrap(out);
+  result.copyTo(dst);
+  return PM_OK;
+}
+
+}
+
+PMParams pm_default_params() {
+  PMParams p;
+  p.patch_w = 8;
+  p.iterations = 5;
+  p.rs_max = INT_MAX;
+  p.seed = 1;
+  p.budget_ms = 0;
+  p.threads = 0;
+  p.schedule = "default";
+  p.cancel = NULL;
+  return p;
+}
+
+const char *pm_status_string(PMStatus status) {
+  switch (status) {
+  case PM_OK: return "ok";
+  case PM_BAD_ARGUMENT: return "bad argument";
+  case PM_SCRATCH_TOO_SMALL: return "scratch buffer too small";
+  case PM_CANCELLED: return "cancelled";
+  }
+  return "unknown status";
+}
+
+size_t pm_nnf_scratch_bytes(int a_width, int a_height) {
+  return (size_t) a_width * a_height * 2 * sizeof(int) + 2 * 64;
+}
+
+PMStatus pm_nnf(const PMBuffer &a, const PMBuffer &b, const PMBuffer *b_mask, int *nnf, int *nnf_dist,
+                const PMParams &params, void *scratch, size_t scratch_bytes) {
+  if (!valid_params(params) || !valid_buffer(a, 3, params.patch_w) || !valid_buffer(b, 3, params.patch_w) ||
+      (b_mask && (!valid_buffer(*b_mask, 1, 1) || !same_size(b, *b_mask))) || !nnf || !nnf_dist) {
+    return PM_BAD_ARGUMENT;
+  }
+  if (scratch && scratch_bytes < pm_nnf_scratch_bytes(a.width, a.height)) {
+    return PM_SCRATCH_TOO_SMALL;
+  }
+  EngineParams engine(params);
+  pm_srand(params.seed);
+
+  Mat dilated_mask;
+  if (b_mask) {
+    Mat hole;
+    threshold(wrap(*b_mask), hole, 0, 255, 0);
+    dilated_mask = dilate_mask(hole);
+    if (!has_sources(dilated_mask)) {
+      return PM_BAD_ARGUMENT;
+    }
+  } else {
+    dilated_mask = Mat::zeros(b.height, b.width, CV_8UC1);
+  }
+  // no labels; the engine looks them up at a and at b coordinates alike
+  Mat constraint = Mat::zeros(std::max(a.height, b.height), std::max(a.width, b.width), CV_8UC1);
+  ConstraintIndex cindex;
+
+  ScratchArena arena(scratch, scratch_bytes);
+  BITMAP *ann = NULL, *annd = NULL;
+  patchmatch(wrap(a), wrap(b), ann, annd, dilated_mask, constraint, &cindex, NULL, scratch ? &arena : NULL);
+  memcpy(nnf, ann->data, sizeof(int) * a.width * a.height);
+  memcpy(nnf_dist, annd->data, sizeof(int) * a.width * a.height);
+  delete ann;
+  delete annd;
+  return PM_OK;
+}
+
+size_t pm_complete_scratch_bytes(int width, int height) {
+  return image_complete_scratch_bytes(width, height);
+}
+
+PMStatus pm_complete(const PMBuffer &image, const PMBuffer &mask, const PMBuffer &out,
+                     const PMParams &params, void *scratch, size_t scratch_bytes) {
+  return complete(image, mask, NULL, out, params, scratch, scratch_bytes);
+}
+
+PMStatus pm_complete_constrained(const PMBuffer &image, const PMBuffer &mask, const PMBuffer &constraint,
+                                 const PMBuffer &out, const PMParams &params, void *scratch,
+                                 size_t scratch_bytes) {
+  return complete(image, mask, &constraint, out, params, scratch, scratch_bytes);
+}
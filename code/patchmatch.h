@@ -0,0 +1,78 @@
+/* -------------------------------------------------------------------------
+  Library interface of the patchmatch target: nearest neighbor fields,
+  masked completion and constrained completion on in-memory buffers, for
+  embedding without going through argv and image files.
+
+  Buffers are 8-bit interleaved with rows `stride` bytes apart, so OpenCV
+  Mats, decoded frames and sub-rectangles can be passed without copying.
+  Color images are BGR (3 channels); masks and constraint maps have one
+  channel. A mask marks the hole with nonzero pixels. A constraint map
+  labels pixels 1..255; hole pixels only take patches from source pixels
+  with the same label.
+
+  Every call takes an optional caller-owned scratch block of at least the
+  size returned by the matching *_scratch_bytes() function. With it, the
+  per-iteration buffers come from that block instead of the heap. NULL
+  means the library allocates as it goes.
+
+  Calls return a PMStatus and never exit the process. The engine keeps its
+  parameters in globals, so concurrent calls are serialized.
+  -------------------------------------------------------------------------- */
+
+#ifndef PATCHMATCH_H
+#define PATCHMATCH_H
+
+#include <stddef.h>
+
+#include <atomic>
+
+enum PMStatus {
+  PM_OK = 0,
+  PM_BAD_ARGUMENT,          // NULL data, wrong channel count, mismatched or unsupported sizes
+  PM_SCRATCH_TOO_SMALL,     // scratch given but smaller than *_scratch_bytes()
+  PM_CANCELLED              // *cancel was set during the call
+};
+
+struct PMBuffer {
+  unsigned char *data;
+  int width, height, channels;
+  size_t stride;            // bytes between rows, 0 for width * channels
+};
+
+struct PMParams {
+  int patch_w;              // patch width, default 8
+  int iterations;           // PatchMatch sweeps per NNF, default 5
+  int rs_max;               // largest random search radius, default unlimited
+  unsigned int seed;        // same seed, same result (without a budget), default 1
+  double budget_ms;         // completion wall clock budget, 0 for none
+  int threads;              // threads for the per-label subproblems, 0 (default) for one per core
+  const char *schedule;     // completion depth/iterations profile: "fast", "default" (default), "quality", "legacy"
+  const std::atomic<bool> *cancel;  // completion stops early when set, may be NULL
+};
+
+PMParams pm_default_params();
+const char *pm_status_string(PMStatus status);
+
+/* Nearest neighbor field from every patch of a to patches of b, in caller
+   arrays of a.width * a.height ints: nnf holds (by<<12)|bx, nnf_dist the
+   squared L2 distance. Patches of b overlapping the nonzero pixels of
+   b_mask (may be NULL) are not used; with fewer than two patches left it is
+   PM_BAD_ARGUMENT. Images up to 4096 pixels wide. */
+size_t pm_nnf_scratch_bytes(int a_width, int a_height);
+PMStatus pm_nnf(const PMBuffer &a, const PMBuffer &b, const PMBuffer *b_mask, int *nnf, int *nnf_dist,
+                const PMParams &params, void *scratch, size_t scratch_bytes);
+
+/* Fill the hole of image marked by mask and write the result to out (same
+   size as image, may be image itself). A hole that leaves no patch to copy
+   from, at full size or at one of the coarser scales the completion runs,
+   is PM_BAD_ARGUMENT. */
+size_t pm_complete_scratch_bytes(int width, int height);
+PMStatus pm_complete(const PMBuffer &image, const PMBuffer &mask, const PMBuffer &out,
+                     const PMParams &params, void *scratch, size_t scratch_bytes);
+
+/* As pm_complete, with a constraint map of the same size. */
+PMStatus pm_complete_constrained(const PMBuffer &image, const PMBuffer &mask, const PMBuffer &constraint,
+                                 const PMBuffer &out, const PMParams &params, void *scratch,
+                                 size_t scratch_bytes);
+
+#endif
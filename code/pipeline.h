@@ -0,0 +1,116 @@
+/* -------------------------------------------------------------------------
+  Bounded queues and per-stage counters for the batch pipeline of main.cpp,
+  where decode, completion and encode workers hand jobs on through
+  BoundedQueues. Only depends on the standard library.
+  -------------------------------------------------------------------------- */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+inline double pipeline_seconds(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+/* FIFO of at most capacity items. push() blocks while the queue is full,
+   which holds the stage before it back (back-pressure), so a pipeline of
+   these never holds more than the capacities plus one job per worker.
+   pop() blocks while it is empty and returns false once the queue is closed
+   and drained. The depth is sampled at every push and pop. */
+template <class T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity_)
+      : capacity(capacity_ > 0 ? capacity_ : 1), closed(false), max_depth(0), depth_sum(0), depth_samples(0),
+        full_wait(0), empty_wait(0) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(m);
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    not_full.wait(lock, [&]() { return items.size() < capacity; });
+    full_wait += pipeline_seconds(t0);
+    items.push_back(std::move(item));
+    sample();
+    not_empty.notify_one();
+  }
+
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(m);
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    not_empty.wait(lock, [&]() { return !items.empty() || closed; });
+    empty_wait += pipeline_seconds(t0);
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    sample();
+    not_full.notify_one();
+    return true;
+  }
+
+  /* No more pushes; consumers drain what is left and then stop. */
+  void close() {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+  void print(FILE *f, const char *name) {
+    std::lock_guard<std::mutex> lock(m);
+    fprintf(f, "%-10s %8d %10d %10.2f %12.3f %12.3f\n", name, (int) capacity, (int) max_depth,
+            depth_samples ? (double) depth_sum / depth_samples : 0.0, full_wait, empty_wait);
+  }
+
+private:
+  void sample() {
+    max_depth = items.size() > max_depth ? items.size() : max_depth;
+    depth_sum += items.size();
+    depth_samples++;
+  }
+
+  std::mutex m;
+  std::condition_variable not_full, not_empty;
+  std::deque<T> items;
+  size_t capacity;
+  bool closed;
+  size_t max_depth;
+  long long depth_sum, depth_samples;
+  double full_wait;     // seconds producers were blocked on a full queue
+  double empty_wait;    // seconds consumers waited on an empty one
+};
+
+/* Jobs and busy time of the workers of one stage. */
+class StageStats {
+public:
+  StageStats() : jobs(0), failed(0), busy(0) {}
+
+  void add(double seconds, bool ok = true) {
+    std::lock_guard<std::mutex> lock(m);
+    jobs++;
+    failed += ok ? 0 : 1;
+    busy += seconds;
+  }
+
+  /* Throughput over the wall time of the whole run, and how much of the
+     workers' time went into jobs. */
+  void print(FILE *f, const char *name, int workers, double wall) {
+    std::lock_guard<std::mutex> lock(m);
+    fprintf(f, "%-10s %8d %6d %6d %10.3f %10.2f %10.1f%%\n", name, workers, jobs, failed, busy,
+            wall > 0 ? jobs / wall : 0.0, wall > 0 ? 100.0 * busy / (workers * wall) : 0.0);
+  }
+
+private:
+  std::mutex m;
+  int jobs, failed;
+  double busy;
+};
+
+#endif
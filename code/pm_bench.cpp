@@ -0,0 +1,534 @@
+/* -------------------------------------------------------------------------
+  Microbenchmarks for the PatchMatch kernels declared in image_complete.h:
+  dist() per patch size, the space-time 3D patch distance of pm_spacetime.h
+  with a compile-time patch shape against the generic one, building the
+  source index of pm_source.h, built and written to the cache of
+  source_cache.h (cold) against mapped from it (warm), its row distance
+  against the packed one of pm_minimal, one propagation + random search sweep, voting,
+  normalization, pyramid resizes and getConstraintIndex(), on synthetic images and on
+  test-images/Image_Completion. Also whole patchmatch() runs, serial against
+  Hogwild and checkerboard sweeps on 1 to 64 threads, with the NNF quality
+  of each on stderr.
+
+  Each benchmark is calibrated so one sample runs for at least --min-ms,
+  then --samples samples are taken. Reported per item (call or pixel): the
+  median, median absolute deviation, min, mean and standard deviation in
+  nanoseconds, as CSV (default) or one JSON object per line. For the
+  per-pixel kernels ns/px is the same number as ms per megapixel.
+
+  The instruction set is fixed at compile time and printed in the isa
+  column; pm_bench_native is the same program built with -march=native.
+  -------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "image_complete.h"
+#include "pm_engine.h"
+#include "pm_source.h"
+#include "pm_spacetime.h"
+#include "source_cache.h"
+
+using namespace cv;
+using namespace std;
+
+int bench_samples = 15;
+double bench_min_ms = 50;
+bool bench_json = false;
+const char *bench_filter = NULL;
+
+const char *isa_name() {
+#if defined(__AVX512F__)
+  return "avx512";
+#elif defined(__AVX2__)
+  return "avx2";
+#elif defined(__AVX__)
+  return "avx";
+#elif defined(__SSE4_2__)
+  return "sse4.2";
+#elif defined(__SSE2__)
+  return "sse2";
+#elif defined(__ARM_NEON)
+  return "neon";
+#else
+  return "generic";
+#endif
+}
+
+double now_ns() {
+  return (double)getTickCount() * 1e9 / getTickFrequency();
+}
+
+double median_of(vector<double> v) {
+  sort(v.begin(), v.end());
+  size_t n = v.size();
+  return (n % 2) ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+void report(const string &name, const string &param, double items, const char *unit, const vector<double> &per_item) {
+  double med = median_of(per_item);
+  vector<double> dev(per_item.size());
+  double mean = 0, var = 0;
+  for (size_t i = 0; i < per_item.size(); ++i) {
+    dev[i] = fabs(per_item[i] - med);
+    mean += per_item[i];
+  }
+  mean /= per_item.size();
+  for (size_t i = 0; i < per_item.size(); ++i) {
+    var += (per_item[i] - mean) * (per_item[i] - mean);
+  }
+  double stddev = per_item.size() > 1 ? sqrt(var / (per_item.size() - 1)) : 0;
+  double mad = median_of(dev);
+  double mn = *min_element(per_item.begin(), per_item.end());
+  if (bench_json) {
+    printf("{\"benchmark\":\"%s\",\"param\":\"%s\",\"isa\":\"%s\",\"items\":%.0f,\"unit\":\"%s\","
+           "\"median\":%.4f,\"mad\":%.4f,\"min\":%.4f,\"mean\":%.4f,\"stddev\":%.4f,\"samples\":%d}\n",
+           name.c_str(), param.c_str(), isa_name(), items, unit, med, mad, mn, mean, stddev, (int) per_item.size());
+  } else {
+    printf("%s,%s,%s,%.0f,%s,%.4f,%.4f,%.4f,%.4f,%.4f,%d\n", name.c_str(), param.c_str(), isa_name(), items, unit,
+           med, mad, mn, mean, stddev, (int) per_item.size());
+  }
+  fflush(stdout);
+}
+
+/* Time body() (but not setup()) and report ns per item. setup() runs before
+   every repetition so kernels that modify their input start from the same state. */
+void bench(const string &name, const string &param, double items, const char *unit,
+           function<void()> setup, function<void()> body) {
+  if (bench_filter && name.find(bench_filter) == string::npos) {
+    return;
+  }
+  // warm up and calibrate the repetitions per sample
+  pm_srand(1);
+  setup();
+  double t0 = now_ns();
+  body();
+  double once = max(now_ns() - t0, 1.0);
+  int reps = max(1, (int) ceil(bench_min_ms * 1e6 / once));
+
+  vector<double> per_item;
+  for (int s = 0; s < bench_samples; ++s) {
+    pm_srand(1);
+    double total = 0;
+    for (int r = 0; r < reps; ++r) {
+      setup();
+      double t = now_ns();
+      body();
+      total += now_ns() - t;
+    }
+    per_item.push_back(total / reps / items);
+  }
+  report(name, param, items, unit, per_item);
+}
+
+/* Noise on top of gradients, so patches differ and dist() does not exit on the first row. */
+Mat synthetic_image(int w, int h) {
+  Mat img(h, w, CV_8UC3);
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      Vec3b &p = img.at<Vec3b>(y, x);
+      p[0] = (uchar) ((x * 3 + pm_rand() % 64) & 255);
+      p[1] = (uchar) ((y * 5 + pm_rand() % 64) & 255);
+      p[2] = (uchar) (((x + y) * 2 + pm_rand() % 64) & 255);
+    }
+  }
+  return img;
+}
+
+/* Rectangular hole covering the middle fifth of the image in both directions. */
+Mat synthetic_mask(int w, int h) {
+  Mat mask = Mat::zeros(h, w, CV_8UC1);
+  mask(Rect(2 * w / 5, 2 * h / 5, w / 5, h / 5)) = 255;
+  return mask;
+}
+
+/* A few constraint strokes with distinct labels, some inside the hole. */
+Mat synthetic_constraint(int w, int h, int labels) {
+  Mat constraint = Mat::zeros(h, w, CV_8UC1);
+  for (int l = 1; l <= labels; ++l) {
+    int y = l * h / (labels + 1);
+    constraint(Rect(w / 8, y, 3 * w / 4, max(2, h / 64))) = l * 20;
+  }
+  return constraint;
+}
+
+void bench_dist(Mat a, Mat b) {
+  int sizes[] = {5, 7, 8, 10, 16};
+  int saved = patch_w;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    patch_w = sizes[i];
+    const int npairs = 4096;
+    vector<int> pairs(4 * npairs);
+    for (int p = 0; p < npairs; ++p) {
+      pairs[4*p+0] = pm_rand() % (a.cols - patch_w + 1);
+      pairs[4*p+1] = pm_rand() % (a.rows - patch_w + 1);
+      pairs[4*p+2] = pm_rand() % (b.cols - patch_w + 1);
+      pairs[4*p+3] = pm_rand() % (b.rows - patch_w + 1);
+    }
+    volatile long long sink = 0;
+    bench("dist", "patch_w=" + to_string(patch_w), npairs, "ns/call", [](){}, [&]() {
+      long long s = 0;
+      for (int p = 0; p < npairs; ++p) {
+        s += dist(a, b, pairs[4*p], pairs[4*p+1], pairs[4*p+2], pairs[4*p+3]);
+      }
+      sink = sink + s;
+    });
+  }
+  patch_w = saved;
+}
+
+/* 3D patch distances over a window of 8 synthetic frames, the kernel for the
+   shape PW x PW x PT against the generic one (param "generic"). */
+template <int PW, int PT>
+void bench_dist3d(bool generic) {
+  FrameRing ring(256, 256, 8);
+  for (int f = 0; f < 8; ++f) {
+    int s = ring.push();
+    Mat frame = synthetic_image(256, 256);
+    memcpy(ring.image(s), frame.ptr(), ring.step() * 256);
+  }
+  const int npairs = 4096, range = 256 - PW + 1, slots = 8 - PT + 1;
+  vector<int> pairs(6 * npairs);
+  for (int p = 0; p < npairs; ++p) {
+    for (int k = 0; k < 6; ++k) {
+      pairs[6*p+k] = pm_rand() % (k % 3 == 2 ? slots : range);
+    }
+  }
+  SpaceTimeL2Distance<PW, PT> fixed(ring, PW, PT);
+  SpaceTimeL2Distance<> any(ring, PW, PT);
+  string shape = to_string(PW) + "x" + to_string(PW) + "x" + to_string(PT);
+  volatile long long sink = 0;
+  bench("dist3d", "patch=" + shape + (generic ? " generic" : ""), npairs, "ns/call", [](){}, [&]() {
+    long long s = 0;
+    for (int p = 0; p < npairs; ++p) {
+      const int *q = &pairs[6*p];
+      s += generic ? any(q[0], q[1], q[2], q[3], q[4], q[5], INT_MAX) : fixed(q[0], q[1], q[2], q[3], q[4], q[5], INT_MAX);
+    }
+    sink = sink + s;
+  });
+}
+
+/* Pixels of a CV_8UC3 image packed as the ImageMagick BITMAPs hold them. */
+vector<int> packed_pixels(Mat img) {
+  vector<int> px((size_t) img.cols * img.rows);
+  for (int y = 0; y < img.rows; ++y) {
+    for (int x = 0; x < img.cols; ++x) {
+      Vec3b p = img.at<Vec3b>(y, x);
+      px[(size_t) y * img.cols + x] = p[0] | (p[1] << 8) | (p[2] << 16) | (255 << 24);
+    }
+  }
+  return px;
+}
+
+/* SourceIndex of b (per pixel), through an empty cache directory and a
+   warm one, then IndexedL2Distance against PackedL2Distance on the same
+   random 7x7 patch pairs. */
+void bench_source_index(Mat a, Mat b) {
+  const int pw = 7;
+  vector<int> pa = packed_pixels(a), pb = packed_pixels(b);
+  bench("source_index", "patch_w=7", (double) b.cols * b.rows, "ns/px", [](){}, [&]() {
+    SourceIndex index(&pb[0], b.cols, b.rows, pw);
+  });
+  char dir[] = "/tmp/pm_bench_cacheXXXXXX";
+  if (mkdtemp(dir)) {
+    string file;
+    for (int warm = 0; warm < 2; ++warm) {
+      bench("source_cache", warm ? "patch_w=7 warm" : "patch_w=7 cold", (double) b.cols * b.rows, "ns/px",
+            [&]() {
+              if (!warm && !file.empty()) {
+                unlink(file.c_str());
+              }
+            },
+            [&]() {
+              CachedSourceIndex cached;
+              cached.open(dir, ~0ULL, &pb[0], b.cols, b.rows, pw);
+              file = cached.path;
+            });
+    }
+    unlink(file.c_str());
+    rmdir(dir);
+  }
+
+  SourceIndex index(&pb[0], b.cols, b.rows, pw);
+  PatchPlanes planes(&pa[0], a.cols, a.rows, pw);
+  IndexedL2Distance indexed(planes, index.planes);
+  PackedL2Distance packed(&pa[0], a.cols, &pb[0], b.cols, pw);
+  const int npairs = 4096;
+  vector<int> pairs(4 * npairs);
+  for (int p = 0; p < npairs; ++p) {
+    pairs[4*p+0] = pm_rand() % (a.cols - pw + 1);
+    pairs[4*p+1] = pm_rand() % (a.rows - pw + 1);
+    pairs[4*p+2] = pm_rand() % (b.cols - pw + 1);
+    pairs[4*p+3] = pm_rand() % (b.rows - pw + 1);
+  }
+  volatile long long sink = 0;
+  for (int use_index = 0; use_index < 2; ++use_index) {
+    bench("dist_source", use_index ? "patch_w=7 indexed" : "patch_w=7 packed", npairs, "ns/call", [](){}, [&]() {
+      long long s = 0;
+      for (int p = 0; p < npairs; ++p) {
+        const int *q = &pairs[4*p];
+        s += use_index ? indexed(q[0], q[1], q[2], q[3], INT_MAX) : packed(q[0], q[1], q[2], q[3], INT_MAX);
+      }
+      sink = sink + s;
+    });
+  }
+}
+
+/* Sweep, voting and normalization on one image/mask/constraint triple. */
+void bench_kernels(const string &input, Mat img, Mat mask, Mat constraint) {
+  threshold(mask, mask, 127, 255, 0);
+  Mat dilated_mask = dilate_mask(mask);
+  Box box = getBox(mask);
+  ConstraintIndex cindex;
+  getConstraintIndex(constraint, dilated_mask, img.cols - patch_w + 1, img.rows - patch_w + 1, &cindex);
+  Mat B = img.clone();
+  bitwise_and(img, 0, B, mask);
+
+  BITMAP *ann = NULL, *annd = NULL;
+  pm_srand(1);
+  patchmatch_init(img, B, ann, annd, dilated_mask, constraint, &cindex);
+  BITMAP init_ann(ann), init_annd(annd);
+  double pixels = (double) (img.cols - patch_w + 1) * (img.rows - patch_w + 1);
+
+  bench("pm_sweep", input, pixels, "ns/px", [&]() {
+    memcpy(ann->data, init_ann.data, sizeof(int) * ann->w * ann->h);
+    memcpy(annd->data, init_annd.data, sizeof(int) * annd->w * annd->h);
+  }, [&]() {
+    patchmatch_sweep(img, B, ann, annd, dilated_mask, constraint, &cindex, 0);
+  });
+
+  // vote with a converged field, as in the EM loop
+  for (int iter = 0; iter < pm_iters; ++iter) {
+    patchmatch_sweep(img, B, ann, annd, dilated_mask, constraint, &cindex, iter);
+  }
+  Mat R(img.rows, img.cols, CV_32FC3), Rcount(img.rows, img.cols, CV_32FC3);
+  double box_pixels = max(1.0, (double) (box.xmax - box.xmin) * (box.ymax - box.ymin));
+  bench("voting", input, box_pixels, "ns/px", [&]() {
+    R = Scalar(0, 0, 0);
+    Rcount = Scalar(0, 0, 0);
+  }, [&]() {
+    vote(img, ann, annd, box, R, Rcount);
+  });
+
+  Mat votes = R.clone(), counts = Rcount.clone();
+  bench("normalize", input, (double) img.cols * img.rows, "ns/px", [&]() {
+    votes.copyTo(R);
+  }, [&]() {
+    normalize_votes(R, counts);
+  });
+
+  delete ann;
+  delete annd;
+}
+
+/* The parallel sweep modes (pm_sweep_mode) against serial scanline sweeps at
+   the same number of sweeps: time per pixel of a whole patchmatch() for 1 ..
+   64 threads, and the mean NNF distance it reaches, averaged over a few
+   seeds, to stderr. */
+void bench_parallel_sweeps(const string &input, Mat img, Mat mask) {
+  if (bench_filter && string("patchmatch").find(bench_filter) == string::npos) {
+    return;
+  }
+  threshold(mask, mask, 127, 255, 0);
+  Mat dilated_mask = dilate_mask(mask);
+  Mat constraint = Mat::zeros(img.rows, img.cols, CV_8UC1);
+  ConstraintIndex cindex;
+  getConstraintIndex(constraint, dilated_mask, img.cols - patch_w + 1, img.rows - patch_w + 1, &cindex);
+  Mat B = img.clone();
+  bitwise_and(img, 0, B, mask);
+  int aew = img.cols - patch_w + 1, aeh = img.rows - patch_w + 1;
+  double pixels = (double) aew * aeh;
+
+  auto run = [&]() {
+    BITMAP *ann = NULL, *annd = NULL;
+    patchmatch(img, B, ann, annd, dilated_mask, constraint, &cindex);
+    double dsum = 0;
+    for (int y = 0; y < aeh; ++y) {
+      for (int x = 0; x < aew; ++x) {
+        dsum += (*annd)[y][x];
+      }
+    }
+    delete ann;
+    delete annd;
+    return dsum / pixels;
+  };
+  auto mean_over_seeds = [&]() {
+    const int seeds = 3;
+    double d = 0;
+    for (int s = 1; s <= seeds; ++s) {
+      pm_srand(s);
+      d += run();
+    }
+    return d / seeds;
+  };
+
+  PMSweepMode saved_mode = pm_sweep_mode;
+  int saved_threads = pm_threads;
+  pm_sweep_mode = PM_SWEEP_SCANLINE;
+  double serial = mean_over_seeds();
+  bench("patchmatch", input + "/serial", pixels, "ns/px", [](){}, [&]() { run(); });
+  PMSweepMode modes[] = {PM_SWEEP_HOGWILD, PM_SWEEP_CHECKERBOARD};
+  const char *names[] = {"hogwild", "checkerboard"};
+  for (int m = 0; m < 2; ++m) {
+    pm_sweep_mode = modes[m];
+    for (int t = 1; t <= 64; t *= 2) {
+      pm_threads = t;
+      double d = mean_over_seeds();
+      fprintf(stderr, "%s: %s %2d threads, mean distance %.0f against %.0f serial (%+.2f%%), %d sweeps\n",
+              names[m], input.c_str(), t, d, serial, 100 * (d - serial) / serial, pm_iters);
+      bench("patchmatch", input + "/" + names[m] + "_threads=" + to_string(t), pixels, "ns/px", [](){},
+            [&]() { run(); });
+    }
+  }
+  pm_sweep_mode = saved_mode;
+  pm_threads = saved_threads;
+}
+
+/* Voting weights: exact exp() against the table voting uses, on the distances of typical matches. */
+void bench_vote_weight() {
+  const int n = 4096;
+  vector<int> d(n);
+  for (int i = 0; i < n; ++i) {
+    d[i] = pm_rand() % (8 * sigma * sigma);
+  }
+  volatile float sink = 0;
+  GaussianWeight exact(sigma);
+  bench("vote_weight", "exp", n, "ns/call", [](){}, [&]() {
+    float s = 0;
+    for (int i = 0; i < n; ++i) {
+      s += exact(d[i]);
+    }
+    sink = sink + s;
+  });
+  const GaussianWeightTable &table = gaussian_weight_table(sigma);
+  bench("vote_weight", "table", n, "ns/call", [](){}, [&]() {
+    float s = 0;
+    for (int i = 0; i < n; ++i) {
+      s += table(d[i]);
+    }
+    sink = sink + s;
+  });
+  fprintf(stderr, "vote_weight: table max relative error %.3g against exp() (sigma %d, %d entries)\n",
+          table.max_rel_error, sigma, (int) table.w.size());
+
+  // past the table, up to where exp() underflows, weights must match exactly;
+  // also for the sqrt(0.5) of im_complete_another
+  const double sigmas[] = {(double) sigma, sqrt(0.5)};
+  for (double s : sigmas) {
+    const GaussianWeightTable &t = gaussian_weight_table(s);
+    GaussianWeight e(s);
+    int mismatches = 0, d = t.limit;
+    for (; e(d) > 0; d += max(1, t.limit / 4096)) {
+      mismatches += t(d) != e(d);
+    }
+    fprintf(stderr, "vote_weight: sigma %.3g, %d mismatches between the table's end %d and exp() underflow at %d\n", s,
+            mismatches, t.limit, d);
+  }
+}
+
+void bench_resize(const string &input, Mat img) {
+  Mat half, up;
+  resize(img, half, Size(), 0.5, 0.5, INTER_AREA);
+  bench("resize_down", input, (double) half.cols * half.rows, "ns/px", [](){}, [&]() {
+    resize(img, half, Size(), 0.5, 0.5, INTER_AREA);
+  });
+  bench("resize_up", input, (double) img.cols * img.rows, "ns/px", [](){}, [&]() {
+    resize(half, up, Size(img.cols, img.rows), 0, 0, INTER_CUBIC);
+  });
+  bench("downsample_area", input, (double) half.cols * half.rows, "ns/px", [](){}, [&]() {
+    downsample_area(img, half, half.size());
+  });
+}
+
+/* Image levels once per image, mask levels and their caches once per request. */
+void bench_pyramid(const string &input, Mat img, Mat mask) {
+  Mat constraint = Mat::zeros(img.rows, img.cols, CV_8UC1);
+  bench("pyramid_image", input, (double) img.cols * img.rows, "ns/px", [](){}, [&]() {
+    CompletionPyramid pyramid(img, completion_schedule.max_depth());
+  });
+  CompletionPyramid pyramid(img, completion_schedule.max_depth());
+  bench("pyramid_mask", input, (double) img.cols * img.rows, "ns/px", [](){}, [&]() {
+    pyramid.set_mask(mask, constraint);
+    for (int k = 0; k < pyramid.levels(); ++k) {
+      pyramid.box(k);
+      pyramid.constraint_index(k);
+    }
+  });
+}
+
+void bench_constraint_index(const string &input, Mat constraint) {
+  Mat dilated_mask = Mat::zeros(constraint.rows, constraint.cols, CV_8UC1);
+  int bew = constraint.cols - patch_w + 1, beh = constraint.rows - patch_w + 1;
+  ConstraintIndex cindex;
+  bench("getConstraintIndex", input, (double) constraint.cols * constraint.rows, "ns/px", [](){}, [&]() {
+    getConstraintIndex(constraint, dilated_mask, bew, beh, &cindex);
+  });
+}
+
+int main(int argc, char *argv[]) {
+  argc--;
+  argv++;
+  string images = "../test-images/Image_Completion/png";
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+      bench_samples = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--min-ms") == 0 && i + 1 < argc) {
+      bench_min_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      bench_json = true;
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      bench_filter = argv[++i];
+    } else if (strcmp(argv[i], "--images") == 0 && i + 1 < argc) {
+      images = argv[++i];
+    } else {
+      fprintf(stderr, "pm_bench [--samples n] [--min-ms ms] [--json] [--filter name] [--images dir]\n"
+                      "Times the PatchMatch kernels on synthetic inputs and on test1 from the images directory\n"
+                      "(default %s). Output is CSV, or JSON lines with --json.\n", images.c_str());
+      exit(1);
+    }
+  }
+
+  if (!bench_json) {
+    printf("benchmark,param,isa,items,unit,median,mad,min,mean,stddev,samples\n");
+  }
+
+  pm_srand(1);
+  Mat a = synthetic_image(512, 512), b = synthetic_image(512, 512);
+  bench_dist(a, b);
+  for (int generic = 0; generic < 2; ++generic) {
+    bench_dist3d<5, 3>(generic);
+    bench_dist3d<7, 3>(generic);
+    bench_dist3d<7, 5>(generic);
+  }
+  bench_source_index(a, b);
+  bench_vote_weight();
+
+  // one megapixel of synthetic input, with and without constraint strokes
+  Mat img = synthetic_image(1024, 1024);
+  Mat mask = synthetic_mask(1024, 1024);
+  Mat none = Mat::zeros(1024, 1024, CV_8UC1);
+  Mat strokes = synthetic_constraint(1024, 1024, 8);
+  bench_kernels("synthetic_1mp", img, mask, none);
+  bench_kernels("synthetic_1mp_constrained", img, mask, strokes);
+  bench_resize("synthetic_1mp", img);
+  bench_constraint_index("synthetic_1mp_8_labels", strokes);
+  bench_parallel_sweeps("synthetic_1mp", img, mask);
+
+  Mat test = imread(images + "/test1.png");
+  Mat test_mask = imread(images + "/test1m.png", CV_LOAD_IMAGE_GRAYSCALE);
+  if (test.empty() || test_mask.empty()) {
+    fprintf(stderr, "pm_bench: no test1.png/test1m.png in '%s', skipping test image benchmarks\n", images.c_str());
+  } else {
+    bench_kernels("test1", test, test_mask, Mat::zeros(test.rows, test.cols, CV_8UC1));
+    bench_resize("test1", test);
+    bench_pyramid("test1", test, test_mask);
+  }
+
+  return 0;
+}
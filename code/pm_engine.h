@@ -0,0 +1,1009 @@
+/* -------------------------------------------------------------------------
+  PatchMatch core shared by all the programs in this directory.
+
+  PatchMatchEngine runs random initialization, propagation and random
+  search. Everything that differs between the variants comes in as a
+  compile-time policy, so each variant is a combination of policies and
+  the compiler inlines all of it (no virtual calls in the sweep loop):
+
+    Distance  int operator()(ax, ay, bx, by, cutoff) const
+              patch distance, may stop early once it reaches cutoff
+    Validity  bool target(ax, ay) const: is the patch at a solved at all
+              bool operator()(ax, ay, bx, by) const: may a use b's patch
+    Sampling  bool init(ax, ay, bx, by): initial candidate (false = redraw)
+              void search(ax, ay, xbest, ybest, offer): random search,
+              offer(bx, by) tries a candidate and returns false when it
+              was not valid
+    Weight    float operator()(d) const: vote weight of a match, see pm_vote()
+
+  sweep() is the serial scanline pass; sweep_concurrent() runs the same
+  passes from several threads at once on a field of packed atomic entries;
+  sweep_checkerboard() propagates in phases of independent pixels instead.
+  Both parallel sweeps and pm_vote_tiled() balance bands of rows over the
+  threads by work stealing, see pm_run_tiles(), on threads that are kept
+  between runs, see PMWorkerPool.
+
+  Coordinates are patch corners. The NNF packs (by<<12)|bx like everywhere
+  else, so images can be up to 4096 pixels wide. Only depends on the
+  standard library (and SSE2 intrinsics where the compiler targets them);
+  random numbers come from an Rng policy so the standalone programs keep
+  using rand().
+  -------------------------------------------------------------------------- */
+
+#ifndef PM_ENGINE_H
+#define PM_ENGINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <chrono>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "profile.h"
+#include "pm_stats.h"
+
+inline int pm_pack_xy(int x, int y) { return (y << 12) | x; }
+inline int pm_unpack_x(int v) { return v & ((1 << 12) - 1); }
+inline int pm_unpack_y(int v) { return v >> 12; }
+
+/* Nearest neighbor and distance for every patch corner of a, row major with row length w. */
+struct PMField {
+  int *nn, *d;
+  int w;
+};
+
+/* A field shared by concurrent sweeps: one 64-bit word per patch corner with
+   the distance in the high half and the packed match in the low half, so a
+   smaller word is always a better match and keeping the best is a compare
+   and swap on one word. */
+inline uint64_t pm_pack_entry(int v, int d) { return ((uint64_t) (uint32_t) d << 32) | (uint32_t) v; }
+inline int pm_entry_nn(uint64_t e) { return (int) (uint32_t) e; }
+inline int pm_entry_dist(uint64_t e) { return (int) (e >> 32); }
+
+/* How a sweep reads and writes the field: get() the match and distance of a
+   corner, nn() only the match, store() a new best. */
+struct PMFieldAccess {
+  PMField f;
+
+  void get(int x, int y, int &v, int &d) const { v = f.nn[y*f.w + x]; d = f.d[y*f.w + x]; }
+  int nn(int x, int y) const { return f.nn[y*f.w + x]; }
+  void store(int x, int y, int v, int d) { f.nn[y*f.w + x] = v; f.d[y*f.w + x] = d; }
+};
+
+/* Lock-free access to packed entries. Loads are relaxed, so a neighbor may
+   be read before or after its update in this sweep, as in Hogwild (Niu et
+   al. 2011). store() only replaces an entry with a better one. */
+struct PMAtomicFieldAccess {
+  std::atomic<uint64_t> *e;
+  int w;
+
+  void get(int x, int y, int &v, int &d) const {
+    uint64_t cur = e[y*w + x].load(std::memory_order_relaxed);
+    v = pm_entry_nn(cur);
+    d = pm_entry_dist(cur);
+  }
+  int nn(int x, int y) const { return pm_entry_nn(e[y*w + x].load(std::memory_order_relaxed)); }
+  void store(int x, int y, int v, int d) {
+    uint64_t best = pm_pack_entry(v, d);
+    uint64_t cur = e[y*w + x].load(std::memory_order_relaxed);
+    while (best < cur && !e[y*w + x].compare_exchange_weak(cur, best, std::memory_order_relaxed)) {
+    }
+  }
+};
+
+/* -------------------------------------------------------------------------
+   Work stealing over tiles
+   ------------------------------------------------------------------------- */
+
+/* A thread's share of the tiles, [begin, end) in one word. */
+inline uint64_t pm_pack_range(int begin, int end) { return ((uint64_t) (uint32_t) begin << 32) | (uint32_t) end; }
+inline int pm_range_begin(uint64_t r) { return (int) (r >> 32); }
+inline int pm_range_end(uint64_t r) { return (int) (uint32_t) r; }
+
+/* The first tile of share, -1 once it is empty. */
+inline int pm_take_front(std::atomic<uint64_t> &share) {
+  uint64_t cur = share.load(std::memory_order_relaxed);
+  for (;;) {
+    int begin = pm_range_begin(cur), end = pm_range_end(cur);
+    if (begin >= end) {
+      return -1;
+    }
+    if (share.compare_exchange_weak(cur, pm_pack_range(begin + 1, end), std::memory_order_relaxed)) {
+      return begin;
+    }
+  }
+}
+
+/* Move the back half of victim's share (rounded up) to the empty share own. */
+inline bool pm_steal_back(std::atomic<uint64_t> &victim, std::atomic<uint64_t> &own) {
+  uint64_t cur = victim.load(std::memory_order_relaxed);
+  for (;;) {
+    int begin = pm_range_begin(cur), end = pm_range_end(cur);
+    if (begin >= end) {
+      return false;
+    }
+    int mid = end - (end - begin + 1) / 2;
+    if (victim.compare_exchange_weak(cur, pm_pack_range(begin, mid), std::memory_order_relaxed)) {
+      own.store(pm_pack_range(mid, end), std::memory_order_relaxed);
+      return true;
+    }
+  }
+}
+
+/* Threads kept waiting between runs, so that a run wakes them instead of
+   starting and joining new ones: the tiled loops run once per checkerboard
+   phase, sweep and vote, at every level, where at the coarse levels starting
+   threads costs as much as the work. Grows to the most threads asked for.
+   Each thread that runs work has a pool of its own, pm_worker_pool(), so
+   concurrent runs never wait for each other's workers; a run started from
+   the caller's share of another goes to an inner pool. */
+class PMWorkerPool {
+public:
+  PMWorkerPool() : busy(false), task(NULL), generation(0), active(0), running(0), stopping(false) {}
+
+  ~PMWorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); ++i) {
+      workers[i].join();
+    }
+  }
+
+  /* Runs work(t) for t = 0 .. nthreads-1, t = 0 on the caller, and returns
+     when all of them have. */
+  void run(int nthreads, const std::function<void(int)> &work) {
+    if (nthreads <= 1) {
+      work(0);
+      return;
+    }
+    if (busy) {
+      if (!inner) {
+        inner.reset(new PMWorkerPool);
+      }
+      inner->run(nthreads, work);
+      return;
+    }
+    busy = true;
+    std::unique_lock<std::mutex> lock(mutex);
+    while ((int) workers.size() < nthreads - 1) {
+      workers.push_back(std::thread(&PMWorkerPool::loop, this, (int) workers.size() + 1, generation));
+    }
+    task = &work;
+    active = nthreads;
+    running = nthreads - 1;
+    generation++;
+    lock.unlock();
+    wake.notify_all();
+    work(0);
+    lock.lock();
+    done.wait(lock, [this]() { return running == 0; });
+    task = NULL;
+    busy = false;
+  }
+
+private:
+  void loop(int t, unsigned long long seen) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [&]() { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+      if (t >= active) {
+        continue;
+      }
+      const std::function<void(int)> *work = task;
+      lock.unlock();
+      (*work)(t);
+      lock.lock();
+      if (--running == 0) {
+        done.notify_one();
+      }
+    }
+  }
+
+  PMWorkerPool(const PMWorkerPool &);
+  PMWorkerPool &operator=(const PMWorkerPool &);
+
+  bool busy;                          // in run(), only touched by the owning thread
+  std::unique_ptr<PMWorkerPool> inner;
+  std::vector<std::thread> workers;   // worker i runs t = i + 1
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  const std::function<void(int)> *task;
+  unsigned long long generation;      // runs started
+  int active, running;                // threads in the current run, workers still in it
+  bool stopping;
+};
+
+/* This thread's pool, joined when the thread exits. */
+inline PMWorkerPool &pm_worker_pool() {
+  static thread_local PMWorkerPool pool;
+  return pool;
+}
+
+/* Runs tile(t, i) for the tiles i = 0 .. ntiles-1 on nthreads threads, t
+   being the thread (the caller is 0, the others come from pm_worker_pool()).
+   Thread t starts with the t-th contiguous share and runs it front to back,
+   so with tiles numbered in sweep order every share is swept in order. A
+   thread that runs out steals the back half of another's remaining share,
+   the part its owner would get to last. Shares are single atomic words, so owners and thieves settle
+   every tile with one compare and swap and never lock. With PM_STATS each
+   thread records its time in tiles against the time of the whole run. */
+template <class Tile>
+void pm_run_tiles(int ntiles, int nthreads, Tile tile) {
+  struct Share {
+    std::atomic<uint64_t> range;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];   // one cache line each
+  };
+  std::unique_ptr<Share[]> shares(new Share[nthreads]);
+  for (int t = 0; t < nthreads; ++t) {
+    shares[t].range.store(pm_pack_range((int) ((long long) ntiles * t / nthreads),
+                                        (int) ((long long) ntiles * (t + 1) / nthreads)), std::memory_order_relaxed);
+  }
+#ifdef PM_STATS
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+  auto worker = [&](int t) {
+#ifdef PM_STATS
+    double busy = 0;
+    long long tiles = 0, steals = 0;
+#endif
+    for (;;) {
+      int i = pm_take_front(shares[t].range);
+      if (i < 0) {
+        bool stolen = false;
+        for (int k = 1; k < nthreads && !stolen; ++k) {
+          stolen = pm_steal_back(shares[(t + k) % nthreads].range, shares[t].range);
+        }
+        if (!stolen) {
+          break;
+        }
+#ifdef PM_STATS
+        steals++;
+#endif
+        continue;
+      }
+#ifdef PM_STATS
+      std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      tile(t, i);
+      busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      tiles++;
+#else
+      tile(t, i);
+#endif
+    }
+#ifdef PM_STATS
+    PM_STAT_WORKER(t, busy, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                   tiles, steals);
+#endif
+    PM_STAT_FLUSH();
+  };
+  pm_worker_pool().run(nthreads, worker);
+}
+
+/* Patch corners [xmin, xmax) x [ymin, ymax). With a partition map, only the
+   corners where it equals part_label; engines over different partitions of
+   one field write disjoint entries and never read each other's, so they can
+   run concurrently. */
+struct PMRegion {
+  int xmin, xmax, ymin, ymax;
+  const unsigned char *part;
+  size_t part_step;
+  int part_label;
+
+  bool contains(int x, int y) const {
+    return (unsigned) (x - xmin) < (unsigned) (xmax - xmin) && (unsigned) (y - ymin) < (unsigned) (ymax - ymin) &&
+           (!part || part[y * part_step + x] == part_label);
+  }
+};
+
+/* -------------------------------------------------------------------------
+   Random number policies
+   ------------------------------------------------------------------------- */
+
+struct CRand {
+  int operator()() const { return rand(); }
+};
+
+/* -------------------------------------------------------------------------
+   Distance policies
+   ------------------------------------------------------------------------- */
+
+/* Squared L2 over 8-bit 3-channel interleaved images (OpenCV CV_8UC3). */
+struct Bgr8L2Distance {
+  const unsigned char *a, *b;
+  size_t astep, bstep;
+  int patch_w;
+
+  Bgr8L2Distance(const unsigned char *a_, size_t astep_, const unsigned char *b_, size_t bstep_, int patch_w_)
+      : a(a_), b(b_), astep(astep_), bstep(bstep_), patch_w(patch_w_) {}
+
+  int operator()(int ax, int ay, int bx, int by, int cutoff) const {
+    PM_STAT_INC(dist_calls);
+    int ans = 0;
+    const int n = 3 * patch_w;
+    for (int dy = 0; dy < patch_w; dy++) {
+      const unsigned char *arow = a + (ay + dy) * astep + 3 * ax;
+      const unsigned char *brow = b + (by + dy) * bstep + 3 * bx;
+      for (int k = 0; k < n; k++) {
+        int diff = arow[k] - brow[k];
+        ans += diff * diff;
+      }
+      if (ans >= cutoff) {
+        PM_STAT_EARLY_EXIT(dy);
+        return cutoff;
+      }
+    }
+    if (ans < 0) return INT_MAX;
+    return ans;
+  }
+};
+
+#ifdef __SSE2__
+inline __m128i pm_ssd_epi32(__m128i va, __m128i vb) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+  __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+  return _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+}
+#endif
+
+/* Sum of squared differences of n bytes, 16 at a time with SSE2: widened to
+   16 bits, subtracted and multiply-added into 32-bit sums. The last partial
+   vector is loaded whole and masked, so up to 15 bytes past a + n and b + n
+   are read: callers pad their planes by 16 bytes. */
+inline int pm_bytes_ssd(const unsigned char *a, const unsigned char *b, int n) {
+#ifdef __SSE2__
+  static const unsigned char tail_mask[32] = {
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  __m128i acc = _mm_setzero_si128();
+  int k = 0;
+  for (; k + 16 <= n; k += 16) {
+    acc = _mm_add_epi32(acc, pm_ssd_epi32(_mm_loadu_si128((const __m128i *) (a + k)),
+                                          _mm_loadu_si128((const __m128i *) (b + k))));
+  }
+  if (k < n) {
+    __m128i m = _mm_loadu_si128((const __m128i *) (tail_mask + 16 - (n - k)));
+    acc = _mm_add_epi32(acc, pm_ssd_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *) (a + k)), m),
+                                          _mm_and_si128(_mm_loadu_si128((const __m128i *) (b + k)), m)));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(acc);
+#else
+  int ans = 0;
+  for (int k = 0; k < n; ++k) {
+    int diff = a[k] - b[k];
+    ans += diff * diff;
+  }
+  return ans;
+#endif
+}
+
+/* Squared L2 over the ImageMagick RGBA BITMAPs, one int per pixel. */
+struct PackedL2Distance {
+  const int *a, *b;
+  int aw, bw, patch_w;
+
+  PackedL2Distance(const int *a_, int aw_, const int *b_, int bw_, int patch_w_)
+      : a(a_), b(b_), aw(aw_), bw(bw_), patch_w(patch_w_) {}
+
+  int operator()(int ax, int ay, int bx, int by, int cutoff) const {
+    int ans = 0;
+    for (int dy = 0; dy < patch_w; dy++) {
+      const int *arow = &a[(ay+dy)*aw + ax];
+      const int *brow = &b[(by+dy)*bw + bx];
+      for (int dx = 0; dx < patch_w; dx++) {
+        int ac = arow[dx];
+        int bc = brow[dx];
+        int dr = (ac&255)-(bc&255);
+        int dg = ((ac>>8)&255)-((bc>>8)&255);
+        int db = (ac>>16)-(bc>>16);
+        ans += dr*dr + dg*dg + db*db;
+      }
+      if (ans >= cutoff) { return cutoff; }
+    }
+    return ans;
+  }
+};
+
+inline bool pm_packed_hole(const int *mask, int w, int x, int y) {
+  return (mask[y*w + x] & 0xffffff) != 0;
+}
+
+/* PackedL2Distance over the known pixels of a's patch only, scaled up to the
+   full patch. A patch whose corners are both in the hole has no distance
+   (INT_MAX). With reject_exact, a perfect match for a patch whose corner is
+   in the hole is refused as well; it would only ever match known pixels. */
+struct MaskedPackedL2Distance {
+  const int *a, *b, *mask;
+  int aw, bw, patch_w;
+  bool reject_exact;
+
+  MaskedPackedL2Distance(const int *a_, int aw_, const int *b_, int bw_, const int *mask_, int patch_w_,
+                         bool reject_exact_ = false)
+      : a(a_), b(b_), mask(mask_), aw(aw_), bw(bw_), patch_w(patch_w_), reject_exact(reject_exact_) {}
+
+  int operator()(int ax, int ay, int bx, int by, int cutoff) const {
+    int ans = 0;
+    int holeCount = 0;
+    if (pm_packed_hole(mask, aw, ax, ay) && pm_packed_hole(mask, aw, ax+patch_w-1, ay+patch_w-1)) { return INT_MAX; }
+    for (int dy = 0; dy < patch_w; dy++) {
+      const int *arow = &a[(ay+dy)*aw + ax];
+      const int *brow = &b[(by+dy)*bw + bx];
+      for (int dx = 0; dx < patch_w; dx++) {
+        if (pm_packed_hole(mask, aw, ax+dx, ay+dy)) {
+          holeCount += 1;
+          continue;
+        }
+        int ac = arow[dx];
+        int bc = brow[dx];
+        int dr = (ac&255)-(bc&255);
+        int dg = ((ac>>8)&255)-((bc>>8)&255);
+        int db = (ac>>16)-(bc>>16);
+        ans += dr*dr + dg*dg + db*db;
+      }
+      if (ans >= cutoff) { return cutoff; }
+    }
+    double percent = 1 - (double) holeCount / (patch_w*patch_w);
+    ans = (int) (ans / percent);
+    if (ans < 0) return INT_MAX;
+    if (reject_exact && ans == 0 && pm_packed_hole(mask, aw, ax, ay)) return INT_MAX;
+    return ans;
+  }
+};
+
+/* -------------------------------------------------------------------------
+   Validity policies
+   ------------------------------------------------------------------------- */
+
+/* Any patch of b, for matching two different images. */
+struct AnySource {
+  bool target(int ax, int ay) const { return true; }
+  bool operator()(int ax, int ay, int bx, int by) const { return true; }
+};
+
+/* Completion with the ImageMagick BITMAPs: sources outside the hole's bounding
+   box (grown by a patch), never the patch itself. With a mask, patches whose
+   corners are both in the hole are not solved. */
+struct OutsideBoxSource {
+  int xmin, xmax, ymin, ymax;
+  const int *mask;
+  int mw, patch_w;
+
+  OutsideBoxSource(int xmin_, int xmax_, int ymin_, int ymax_, int patch_w_, const int *mask_ = NULL, int mw_ = 0)
+      : xmin(xmin_), xmax(xmax_), ymin(ymin_), ymax(ymax_), mask(mask_), mw(mw_), patch_w(patch_w_) {}
+
+  bool target(int ax, int ay) const {
+    return !mask || !(pm_packed_hole(mask, mw, ax, ay) && pm_packed_hole(mask, mw, ax+patch_w-1, ay+patch_w-1));
+  }
+  bool operator()(int ax, int ay, int bx, int by) const {
+    bool in_box = bx >= xmin && bx <= xmax + patch_w && by >= ymin && by <= ymax + patch_w;
+    return !in_box && (ax != bx || ay != by);
+  }
+};
+
+/* Completion with OpenCV: sources whose patch does not touch the hole, i.e.
+   outside the dilated mask (255 = hole), never the patch itself. */
+struct OutsideMaskSource {
+  const unsigned char *dilated_mask;
+  size_t step;
+
+  OutsideMaskSource(const unsigned char *dilated_mask_, size_t step_) : dilated_mask(dilated_mask_), step(step_) {}
+
+  bool target(int ax, int ay) const { return true; }
+  bool operator()(int ax, int ay, int bx, int by) const {
+    return dilated_mask[by * step + bx] != 255 && (ax != bx || ay != by);
+  }
+};
+
+/* OutsideMaskSource, and a pixel with a constraint label (nonzero) only takes
+   sources with the same label. Labels are looked up at both a and b
+   coordinates in the same label image, as a and b are the same image.
+   offset is the source index of LabelSampling: a label with fewer than two
+   sources, e.g. a thin stroke lost at a coarse scale, is unconstrained like
+   label 0 (a single source could not serve the patch at its own corner). */
+struct SameLabelSource {
+  OutsideMaskSource outside;
+  const unsigned char *labels;
+  size_t label_step;
+  const int *offset;
+
+  SameLabelSource(const unsigned char *dilated_mask_, size_t step_, const unsigned char *labels_, size_t label_step_,
+                  const int *offset_)
+      : outside(dilated_mask_, step_), labels(labels_), label_step(label_step_), offset(offset_) {}
+
+  bool target(int ax, int ay) const { return true; }
+  bool operator()(int ax, int ay, int bx, int by) const {
+    if (!outside(ax, ay, bx, by)) {
+      return false;
+    }
+    int label = labels[ay * label_step + ax];
+    return label == 0 || offset[label+1] - offset[label] < 2 || labels[by * label_step + bx] == label;
+  }
+};
+
+/* -------------------------------------------------------------------------
+   Sampling policies
+   ------------------------------------------------------------------------- */
+
+/* Uniform initialization over b, random search in windows of halving size
+   around the current best match (PatchMatch, Barnes et al. 2009). With Retry
+   an invalid sample is redrawn until a valid one is found, otherwise the
+   window is skipped. */
+template <class Rng, bool Retry>
+struct WindowSampling {
+  int bew, beh, rs_start;
+  Rng rng;
+
+  WindowSampling(int bew_, int beh_, int rs_max, int bw, int bh) : bew(bew_), beh(beh_) {
+    rs_start = rs_max;
+    if (rs_start > (bw > bh ? bw : bh)) { rs_start = (bw > bh ? bw : bh); }
+  }
+
+  bool init(int ax, int ay, int &bx, int &by) {
+    bx = rng() % bew;
+    by = rng() % beh;
+    return true;
+  }
+
+  template <class Offer>
+  void search(int ax, int ay, const int &xbest, const int &ybest, Offer offer) {
+    for (int mag = rs_start; mag >= 1; mag /= 2) {
+      /* Sampling window */
+      int xmin = xbest-mag > 0 ? xbest-mag : 0, xmax = xbest+mag+1 < bew ? xbest+mag+1 : bew;
+      int ymin = ybest-mag > 0 ? ybest-mag : 0, ymax = ybest+mag+1 < beh ? ybest+mag+1 : beh;
+      bool valid;
+      do {
+        int xp = xmin + rng() % (xmax-xmin);
+        int yp = ymin + rng() % (ymax-ymin);
+        valid = offer(xp, yp);
+        if (!valid) {
+          PM_STAT_INC(rs_retries);
+        }
+      } while (Retry && !valid);
+    }
+  }
+};
+
+/* WindowSampling for unconstrained pixels. A pixel with a constraint label
+   draws from the sources with that label instead, sqrt(count) times per
+   sweep. The sources are a compressed index: those of label l are
+   xy[offset[l]] .. xy[offset[l+1]-1], packed like the NNF, and all of them
+   have to be valid patches of b, so nothing is drawn twice. A label with
+   fewer than two sources samples like label 0, as SameLabelSource lets it. */
+template <class Rng>
+struct LabelSampling {
+  WindowSampling<Rng, true> window;
+  const unsigned char *labels;
+  size_t label_step;
+  const int *offset, *xy;
+
+  LabelSampling(int bew_, int beh_, int rs_max, int bw, int bh, const unsigned char *labels_, size_t label_step_,
+                const int *offset_, const int *xy_)
+      : window(bew_, beh_, rs_max, bw, bh), labels(labels_), label_step(label_step_), offset(offset_), xy(xy_) {}
+
+  int count(int label) const { return offset[label+1] - offset[label]; }
+
+  bool init(int ax, int ay, int &bx, int &by) {
+    int label = labels[ay * label_step + ax];
+    if (label == 0 || count(label) < 2) {
+      return window.init(ax, ay, bx, by);
+    }
+    int v = xy[offset[label] + window.rng() % count(label)];
+    bx = pm_unpack_x(v);
+    by = pm_unpack_y(v);
+    return true;
+  }
+
+  template <class Offer>
+  void search(int ax, int ay, const int &xbest, const int &ybest, Offer offer) {
+    int label = labels[ay * label_step + ax];
+    int n = label == 0 ? 0 : count(label);
+    if (n < 2) {
+      window.search(ax, ay, xbest, ybest, offer);
+      return;
+    }
+    const int *sources = xy + offset[label];
+    // we choose the improve times to be sqrt of the size
+    int improve_times = (int) ceil(sqrt((double) n));
+    for (int i_t = 0; i_t < improve_times; ++i_t) {
+      int v = sources[window.rng() % n];
+      offer(pm_unpack_x(v), pm_unpack_y(v));
+    }
+  }
+};
+
+/* -------------------------------------------------------------------------
+   Weighting policies
+   ------------------------------------------------------------------------- */
+
+struct UniformWeight {
+  float operator()(int d) const { return 1; }
+};
+
+/* exp(-d / (2 sigma^2)), as in Wexler et al. */
+struct GaussianWeight {
+  double sigma;
+  GaussianWeight(double sigma_) : sigma(sigma_) {}
+  float operator()(int d) const { return (float) exp(-d / (2 * sigma * sigma)); }
+};
+
+/* GaussianWeight from a table, linearly interpolated: STEPS entries per
+   2 sigma^2 of distance, up to where the weight drops below 2^-24, and
+   exp() beyond, so a pixel whose votes are all poor still gets weight
+   wherever GaussianWeight gives it some. max_rel_error is the largest
+   relative difference to GaussianWeight over the integer distances of the
+   table, measured when it is built. */
+struct GaussianWeightTable {
+  enum { STEPS = 256 };
+  double sigma, max_rel_error;
+  float per_unit;   // table entries per unit of distance
+  int limit;        // distances from here on use exp()
+  double scale;     // 2 sigma^2
+  std::vector<float> w;
+
+  GaussianWeightTable(double sigma_) : sigma(sigma_), max_rel_error(0) {
+    scale = 2 * sigma * sigma;
+    int n = (int) ceil(24 * log(2.0) * STEPS) + 2;
+    w.resize(n);
+    for (int i = 0; i < n; ++i) {
+      w[i] = (float) exp(-(double) i / STEPS);
+    }
+    per_unit = (float) (STEPS / scale);
+    limit = (int) ((n - 1) / per_unit);
+    GaussianWeight exact(sigma);
+    for (int d = 0; d < limit; ++d) {
+      double e = exact(d);
+      max_rel_error = fmax(max_rel_error, fabs((double) (*this)(d) - e) / e);
+    }
+  }
+
+  float operator()(int d) const {
+    if (d >= limit) {
+      return (float) exp(-d / scale);
+    }
+    float x = d * per_unit;
+    int i = (int) x;
+    return w[i] + (x - i) * (w[i+1] - w[i]);
+  }
+};
+
+/* This thread's table for sigma, rebuilt only when sigma changes. */
+inline const GaussianWeightTable &gaussian_weight_table(double sigma) {
+  static thread_local GaussianWeightTable table(sigma);
+  if (table.sigma != sigma) {
+    table = GaussianWeightTable(sigma);
+  }
+  return table;
+}
+
+/* -------------------------------------------------------------------------
+   The engine
+   ------------------------------------------------------------------------- */
+
+template <class Distance, class Validity, class Sampling>
+class PatchMatchEngine {
+public:
+  /* Solves the patches of a with corners in region, matching against b whose
+     patch corners are [0, bew) x [0, beh). */
+  PatchMatchEngine(const Distance &dist_, const Validity &valid_, const Sampling &sample_, PMField field_,
+                   PMRegion region_, int bew_, int beh_)
+      : dist(dist_), valid(valid_), sample(sample_), field(field_), region(region_), bew(bew_), beh(beh_) {}
+
+  /* Random valid match for every patch of the region. Loops until it finds
+     one, so there has to be a valid source for every patch: callers check
+     that first (see has_sources() in patchmatch.cpp). */
+  void init() {
+    PROFILE_SCOPE("pm_init");
+    for (int ay = region.ymin; ay < region.ymax; ay++) {
+      for (int ax = region.xmin; ax < region.xmax; ax++) {
+        if (region.part && !region.contains(ax, ay)) {
+          continue;
+        }
+        int bx, by;
+        while (!(sample.init(ax, ay, bx, by) && valid(ax, ay, bx, by))) {
+          PM_STAT_INC(init_retries);
+        }
+        field.nn[ay*field.w + ax] = pm_pack_xy(bx, by);
+        field.d[ay*field.w + ax] = dist(ax, ay, bx, by, INT_MAX);
+      }
+    }
+  }
+
+  /* Start from the matches already in the field instead, e.g. one loaded
+     from an .nnf file: each is scored again, as the images may have changed,
+     and ones that are out of range or no longer valid are drawn as in init(). */
+  void init_from_field() {
+    PROFILE_SCOPE("pm_init");
+    for (int ay = region.ymin; ay < region.ymax; ay++) {
+      for (int ax = region.xmin; ax < region.xmax; ax++) {
+        if (region.part && !region.contains(ax, ay)) {
+          continue;
+        }
+        int v = field.nn[ay*field.w + ax];
+        int bx = pm_unpack_x(v), by = pm_unpack_y(v);
+        if (v < 0 || bx >= bew || by >= beh || !valid(ax, ay, bx, by)) {
+          while (!(sample.init(ax, ay, bx, by) && valid(ax, ay, bx, by))) {
+            PM_STAT_INC(init_retries);
+          }
+          field.nn[ay*field.w + ax] = pm_pack_xy(bx, by);
+        }
+        field.d[ay*field.w + ax] = dist(ax, ay, bx, by, INT_MAX);
+      }
+    }
+  }
+
+  /* One propagation + random search pass; odd iterations run in reverse scanline order. */
+  void sweep(int iter) {
+    PMFieldAccess access = {field};
+    sweep_band(access, iter, 0, region.ymax - region.ymin);
+  }
+
+  /* iters sweeps by nthreads threads at once without locks: the rows are cut
+     into bands of band_rows, numbered in sweep order, that pm_run_tiles()
+     hands out. A thread reads the rows of other bands as they are. Threads
+     work on their own copies of the engine; seed(iter, band) is called
+     before every band, to seed the random numbers the sampling policy uses.
+     After every sweep, swept(iter, dsum) gets the summed distance of the
+     region, and before every sweep after the first, stop() can end the run.
+     The result is not reproducible, it depends on timing. */
+  template <class Seed, class Swept, class Stop>
+  void sweep_concurrent(int iters, int nthreads, int band_rows, Seed seed, Swept swept, Stop stop) {
+    PROFILE_SCOPE_ARG("pm_sweep_concurrent", nthreads);
+    std::unique_ptr<std::atomic<uint64_t>[]> entries(new std::atomic<uint64_t>[(size_t) field.w * region.ymax]);
+    for (int ay = region.ymin; ay < region.ymax; ay++) {
+      for (int ax = region.xmin; ax < region.xmax; ax++) {
+        entries[ay*field.w + ax].store(pm_pack_entry(field.nn[ay*field.w + ax], field.d[ay*field.w + ax]),
+                                       std::memory_order_relaxed);
+      }
+    }
+    PMAtomicFieldAccess access = {entries.get(), field.w};
+    std::vector<PatchMatchEngine> engines(nthreads, *this);
+    int nbands = (region.ymax - region.ymin + band_rows - 1) / band_rows;
+    for (int iter = 0; iter < iters; iter++) {
+      if (iter > 0 && stop()) {
+        break;
+      }
+      pm_run_tiles(nbands, nthreads, [&](int t, int band) {
+        seed(iter, band);
+        engines[t].sweep_band(access, iter, band, band_rows);
+      });
+      double dsum = 0;
+      for (int ay = region.ymin; ay < region.ymax; ay++) {
+        for (int ax = region.xmin; ax < region.xmax; ax++) {
+          if (!region.part || region.contains(ax, ay)) {
+            dsum += pm_entry_dist(entries[ay*field.w + ax].load(std::memory_order_relaxed));
+          }
+        }
+      }
+      swept(iter, dsum);
+    }
+    for (int ay = region.ymin; ay < region.ymax; ay++) {
+      for (int ax = region.xmin; ax < region.xmax; ax++) {
+        if (region.part && !region.contains(ax, ay)) {
+          continue;
+        }
+        uint64_t e = entries[ay*field.w + ax].load(std::memory_order_relaxed);
+        field.nn[ay*field.w + ax] = pm_entry_nn(e);
+        field.d[ay*field.w + ax] = pm_entry_dist(e);
+      }
+    }
+  }
+
+  /* One sweep on a schedule without a serial dependency chain: jump flooding
+     (Rong and Tan 2006) with steps 2^jumps .. 1, each step in two
+     checkerboard phases over blocks of the step size. A pixel reads the
+     matches of its four neighbors one step away, which are all of the other
+     phase, so the pixels of a phase do not depend on each other. Each phase
+     is one pm_run_tiles() over bands of band_rows rows. Random search runs
+     in the phases of step 1. seed(phase, row) is called before every row,
+     so the result does not depend on nthreads. */
+  template <class Seed>
+  void sweep_checkerboard(int iter, int jumps, int nthreads, int band_rows, Seed seed) {
+    PROFILE_SCOPE_ARG("pm_sweep_checkerboard", iter);
+    PMFieldAccess access = {field};
+    std::vector<PatchMatchEngine> engines(nthreads, *this);
+    int nbands = (region.ymax - region.ymin + band_rows - 1) / band_rows;
+    int phase = 0;
+    for (int step = 1 << jumps; step >= 1; step /= 2) {
+      for (int color = 0; color < 2; ++color, ++phase) {
+        pm_run_tiles(nbands, nthreads, [&](int t, int band) {
+          int y0 = region.ymin + band*band_rows, y1 = std::min(region.ymax, y0 + band_rows);
+          for (int ay = y0; ay < y1; ay++) {
+            seed(phase, ay);
+            engines[t].phase_row(access, ay, step, color, step == 1);
+          }
+        });
+      }
+    }
+  }
+
+private:
+  /* The pixels of row ay in checkerboard phase (step, color). */
+  template <class Access>
+  void phase_row(Access &access, int ay, int step, int color, bool search) {
+    static const int dirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    for (int ax = region.xmin; ax < region.xmax; ax++) {
+      if ((((ax / step) + (ay / step)) & 1) != color) {
+        continue;
+      }
+      if ((region.part && !region.contains(ax, ay)) || !valid.target(ax, ay)) {
+        continue;
+      }
+      int v, dbest;
+      access.get(ax, ay, v, dbest);
+      int xbest = pm_unpack_x(v), ybest = pm_unpack_y(v);
+
+      for (int i = 0; i < 4; i++) {
+        int dx = dirs[i][0] * step, dy = dirs[i][1] * step;
+        if (!region.contains(ax + dx, ay + dy)) {
+          continue;
+        }
+        int vp = access.nn(ax + dx, ay + dy);
+        int xp = pm_unpack_x(vp) - dx, yp = pm_unpack_y(vp) - dy;
+        if ((unsigned) xp < (unsigned) bew && (unsigned) yp < (unsigned) beh && valid(ax, ay, xp, yp)) {
+          improve(ax, ay, xbest, ybest, dbest, xp, yp, dx ? PM_PROP_X : PM_PROP_Y);
+        }
+      }
+
+      if (search) {
+        sample.search(ax, ay, xbest, ybest, [&](int xp, int yp) {
+          if (!valid(ax, ay, xp, yp)) {
+            return false;
+          }
+          improve(ax, ay, xbest, ybest, dbest, xp, yp, PM_RANDOM);
+          return true;
+        });
+      }
+
+      access.store(ax, ay, pm_pack_xy(xbest, ybest), dbest);
+    }
+  }
+
+  /* Rows band*band_rows .. (band+1)*band_rows-1 of one sweep, counted in sweep order. */
+  template <class Access>
+  void sweep_band(Access &access, int iter, int band, int band_rows) {
+    PROFILE_SCOPE_ARG("pm_sweep", iter);
+    PROFILE_PHASE(prop_phase, "propagation");
+    PROFILE_PHASE(rs_phase, "random_search");
+    int ystart = region.ymin, yend = region.ymax, ychange = 1;
+    int xstart = region.xmin, xend = region.xmax, xchange = 1;
+    if (iter % 2 == 1) {
+      xstart = xend-1; xend = region.xmin-1; xchange = -1;
+      ystart = yend-1; yend = region.ymin-1; ychange = -1;
+    }
+    ystart += band*band_rows*ychange;
+    int yband = ystart + band_rows*ychange;
+    if (ychange > 0 ? yband < yend : yband > yend) {
+      yend = yband;
+    }
+    for (int ay = ystart; ay != yend; ay += ychange) {
+      for (int ax = xstart; ax != xend; ax += xchange) {
+        if ((region.part && !region.contains(ax, ay)) || !valid.target(ax, ay)) {
+          continue;
+        }
+
+        /* Current (best) guess. */
+        int v, dbest;
+        access.get(ax, ay, v, dbest);
+        int xbest = pm_unpack_x(v), ybest = pm_unpack_y(v);
+
+        /* Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). */
+        PROFILE_PHASE_BEGIN(prop_phase);
+        if (region.contains(ax - xchange, ay)) {
+          int vp = access.nn(ax - xchange, ay);
+          int xp = pm_unpack_x(vp) + xchange, yp = pm_unpack_y(vp);
+          if ((unsigned) xp < (unsigned) bew && valid(ax, ay, xp, yp)) {
+            improve(ax, ay, xbest, ybest, dbest, xp, yp, PM_PROP_X);
+          }
+        }
+        if (region.contains(ax, ay - ychange)) {
+          int vp = access.nn(ax, ay - ychange);
+          int xp = pm_unpack_x(vp), yp = pm_unpack_y(vp) + ychange;
+          if ((unsigned) yp < (unsigned) beh && valid(ax, ay, xp, yp)) {
+            improve(ax, ay, xbest, ybest, dbest, xp, yp, PM_PROP_Y);
+          }
+        }
+        PROFILE_PHASE_END(prop_phase);
+
+        /* Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. */
+        PROFILE_PHASE_BEGIN(rs_phase);
+        sample.search(ax, ay, xbest, ybest, [&](int xp, int yp) {
+          if (!valid(ax, ay, xp, yp)) {
+            return false;
+          }
+          improve(ax, ay, xbest, ybest, dbest, xp, yp, PM_RANDOM);
+          return true;
+        });
+        PROFILE_PHASE_END(rs_phase);
+
+        access.store(ax, ay, pm_pack_xy(xbest, ybest), dbest);
+      }
+    }
+  }
+
+  inline void improve(int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by, int type) const {
+    int d = dist(ax, ay, bx, by, dbest);
+    bool improved = d < dbest;
+    PM_STAT_CANDIDATE(type, improved);
+    if (improved) {
+      dbest = d;
+      xbest = bx;
+      ybest = by;
+    }
+  }
+
+  Distance dist;
+  Validity valid;
+  Sampling sample;
+  PMField field;
+  PMRegion region;
+  int bew, beh;
+};
+
+/* pm_vote() for the rows [y0, y1) of region. */
+template <class Weight, class Splat>
+inline void pm_vote_rows(const Weight &weight, PMField field, PMRegion region, int y0, int y1, Splat splat) {
+  for (int ay = y0; ay < y1; ++ay) {
+    for (int ax = region.xmin; ax < region.xmax; ++ax) {
+      if (region.part && !region.contains(ax, ay)) {
+        continue;
+      }
+      int v = field.nn[ay*field.w + ax];
+      float w = weight(field.d[ay*field.w + ax]);
+      if (w > 0) {
+        splat(ax, ay, pm_unpack_x(v), pm_unpack_y(v), w);
+      }
+    }
+  }
+}
+
+/* Let every solved patch in region vote: splat(ax, ay, bx, by, weight) adds
+   the pixels of b's patch at (bx, by) to the accumulators at (ax, ay).
+   Zero weights are skipped. */
+template <class Weight, class Splat>
+inline void pm_vote(const Weight &weight, PMField field, PMRegion region, Splat splat) {
+  pm_vote_rows(weight, field, region, region.ymin, region.ymax, splat);
+}
+
+/* pm_vote() on nthreads threads. The rows are cut into bands of at least
+   patch_w rows, so a band's patches only reach into the next band; the even
+   bands vote first and the odd ones after, each a pm_run_tiles(), and no two
+   threads ever add to the same pixel. The order the votes of a pixel are
+   summed in only depends on the bands, not on the threads. */
+template <class Weight, class Splat>
+inline void pm_vote_tiled(const Weight &weight, PMField field, PMRegion region, int patch_w, int band_rows,
+                          int nthreads, Splat splat) {
+  PROFILE_SCOPE_ARG("pm_vote_tiled", nthreads);
+  band_rows = std::max(band_rows, patch_w);
+  int nbands = (region.ymax - region.ymin + band_rows - 1) / band_rows;
+  for (int parity = 0; parity < 2; ++parity) {
+    pm_run_tiles((nbands - parity + 1) / 2, nthreads, [&](int t, int i) {
+      int y0 = region.ymin + (2*i + parity)*band_rows;
+      pm_vote_rows(weight, field, region, y0, std::min(region.ymax, y0 + band_rows), splat);
+    });
+  }
+}
+
+#endif
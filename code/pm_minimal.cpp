@@ -18,9 +18,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <limits.h>
 #include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "pm_engine.h"
+#include "pm_source.h"
+#include "nnf_file.h"
+#include "source_cache.h"
 
 #ifndef MAX
 #define MAX(a, b) ((a)>(b)?(a):(b))
@@ -41,22 +52,29 @@ class BITMAP { public:
 
 void check_im() {
   int i;
-  i = system("identify ../test-images/test1.jpg");
+  i = system("identify -version > /dev/null");
   printf ("The value returned was: %d.\n",i);
   if (i != 0) {
     fprintf(stderr, "ImageMagick must be installed, and 'convert' and 'identify' must be in the path\n"); exit(1);
   }
 }
 
+/* A new empty file for ImageMagick to read or write, one per call, so the
+   threads of batch() never share one. */
+void temp_file(char name[64], const char *filename) {
+  const char *dir = getenv("TMPDIR");
+  snprintf(name, 64, "%s/pm_minimal_XXXXXX", dir && strlen(dir) < 40 ? dir : "/tmp");
+  int fd = mkstemp(name);
+  if (fd < 0) { fprintf(stderr, "Error converting image '%s': could not create a temporary file\n", filename); exit(1); }
+  close(fd);
+}
+
 BITMAP *load_bitmap(const char *filename) {
   check_im();
-  char rawname[256], txtname[256];
-  strcpy(rawname, filename);
-  strcpy(txtname, filename);
-  if (!strstr(rawname, ".")) { fprintf(stderr, "Error reading image '%s': no extension found\n", filename); exit(1); }
-  sprintf(strstr(rawname, "."), ".raw");
-  sprintf(strstr(txtname, "."), ".txt");
-  char buf[256];
+  char rawname[64], txtname[64];
+  temp_file(rawname, filename);
+  temp_file(txtname, filename);
+  char buf[1024];
   sprintf(buf, "convert %s rgba:%s", filename, rawname);
   if (system(buf) != 0) { fprintf(stderr, "Error reading image '%s': ImageMagick convert gave an error\n", filename); exit(1); }
   sprintf(buf, "identify -format \"%%w %%h\" %s > %s", filename, txtname);
@@ -66,6 +84,7 @@ BITMAP *load_bitmap(const char *filename) {
   int w = 0, h = 0;
   if (fscanf(f, "%d %d", &w, &h) != 2) { fprintf(stderr, "Error reading image '%s': could not get size from ImageMagick identify\n", filename); exit(1); }
   fclose(f);
+  remove(txtname);
   printf("(w, h) = (%d, %d)\n", w, h);
   f = fopen(rawname, "rb");
   BITMAP *ans = new BITMAP(w, h);
@@ -76,16 +95,15 @@ BITMAP *load_bitmap(const char *filename) {
     *p++ = ch;
   }
   fclose(f);
+  remove(rawname);
   return ans;
 }
 
 void save_bitmap(BITMAP *bmp, const char *filename) {
   check_im();
-  char rawname[256];
-  strcpy(rawname, filename);
-  if (!strstr(rawname, ".")) { fprintf(stderr, "Error writing image '%s': no extension found\n", filename); exit(1); }
-  sprintf(strstr(rawname, "."), ".raw");
-  char buf[256];
+  char rawname[64];
+  temp_file(rawname, filename);
+  char buf[1024];
   //printf("rawname = %s\n", rawname);
   FILE *f = fopen(rawname, "wb");
   if (!f) { fprintf(stderr, "Error writing image '%s': could not open raw temporary file\n", filename); exit(1); }
@@ -96,7 +114,9 @@ void save_bitmap(BITMAP *bmp, const char *filename) {
   fclose(f);
   sprintf(buf, "convert -size %dx%d -depth 8 rgba:%s %s", bmp->w, bmp->h, rawname, filename);
   //printf("system returned value = %d\n", system(buf));
-  if (system(buf) != 0) { fprintf(stderr, "Error writing image '%s': ImageMagick convert gave an error\n", filename); exit(1); }
+  int status = system(buf);
+  remove(rawname);
+  if (status != 0) { fprintf(stderr, "Error writing image '%s': ImageMagick convert gave an error\n", filename); exit(1); }
 }
 
 /* -------------------------------------------------------------------------
@@ -112,106 +132,33 @@ int rs_max   = INT_MAX; // random search
 #define INT_TO_Y(v) ((v)>>12)
 
 
-void reconstruct(BITMAP *a, BITMAP *b, BITMAP *ann, BITMAP *&ans);
+void reconstruct(BITMAP *a, BITMAP *b, PMField ann, BITMAP *&ans);
 
 /* Measure distance between 2 patches with upper left corners (ax, ay) and (bx, by), terminating early if we exceed a cutoff distance.
    You could implement your own descriptor here. */
 int dist(BITMAP *a, BITMAP *b, int ax, int ay, int bx, int by, int cutoff=INT_MAX) {
-  int ans = 0;
-  for (int dy = 0; dy < patch_w; dy++) {
-    int *arow = &(*a)[ay+dy][ax];
-    int *brow = &(*b)[by+dy][bx];
-    for (int dx = 0; dx < patch_w; dx++) {
-      int ac = arow[dx];
-      int bc = brow[dx];
-      int dr = (ac&255)-(bc&255);
-      int dg = ((ac>>8)&255)-((bc>>8)&255);
-      int db = (ac>>16)-(bc>>16);
-      ans += dr*dr + dg*dg + db*db;
-    }
-    if (ans >= cutoff) { return cutoff; }
-  }
-  return ans;
-}
-
-void improve_guess(BITMAP *a, BITMAP *b, int ax, int ay, int &xbest, int &ybest, int &dbest, int bx, int by) {
-  int d = dist(a, b, ax, ay, bx, by, dbest);
-  if (d < dbest) {
-    dbest = d;
-    xbest = bx;
-    ybest = by;
-  }
+  return PackedL2Distance(a->data, a->w, b->data, b->w, patch_w)(ax, ay, bx, by, cutoff);
 }
 
-/* Match image a to image b, returning the nearest neighbor field mapping a => b coords, stored in an RGB 24-bit image as (by<<12)|bx. */
-void patchmatch(BITMAP *a, BITMAP *b, BITMAP *&ann, BITMAP *&annd) {
-  /* Initialize with random nearest neighbor field (NNF). */
-  ann = new BITMAP(a->w, a->h);
-  annd = new BITMAP(a->w, a->h);
+/* Match image a to image b, filling field (a->w x a->h) with the nearest neighbor field mapping a => b coords as (by<<12)|bx
+   and the distances. With prior, start from the matches already in field instead of a random nearest neighbor field (NNF). */
+void patchmatch(BITMAP *a, BITMAP *b, PMField field, bool prior) {
   int aew = a->w - patch_w+1, aeh = a->h - patch_w + 1;       /* Effective width and height (possible upper left corners of patches). */
   int bew = b->w - patch_w+1, beh = b->h - patch_w + 1;
-  memset(ann->data, 0, sizeof(int)*a->w*a->h);
-  memset(annd->data, 0, sizeof(int)*a->w*a->h);
-
-  // Initialization
-  for (int ay = 0; ay < aeh; ay++) {
-    for (int ax = 0; ax < aew; ax++) {
-      int bx = rand()%bew;
-      int by = rand()%beh;
-      (*ann)[ay][ax] = XY_TO_INT(bx, by);
-      (*annd)[ay][ax] = dist(a, b, ax, ay, bx, by);
-    }
+
+  PMRegion region = {0, aew, 0, aeh};
+  PatchMatchEngine<PackedL2Distance, AnySource, WindowSampling<CRand, false> > engine(
+      PackedL2Distance(a->data, a->w, b->data, b->w, patch_w), AnySource(),
+      WindowSampling<CRand, false>(bew, beh, rs_max, b->w, b->h), field, region, bew, beh);
+  if (prior) {
+    engine.init_from_field();
+  } else {
+    engine.init();
   }
 
   for (int iter = 0; iter < pm_iters; iter++) {
   	printf("iter = %d\n", iter);
-    /* In each iteration, improve the NNF, by looping in scanline or reverse-scanline order. */
-    int ystart = 0, yend = aeh, ychange = 1;
-    int xstart = 0, xend = aew, xchange = 1;
-    if (iter % 2 == 1) {
-      xstart = xend-1; xend = -1; xchange = -1;
-      ystart = yend-1; yend = -1; ychange = -1;
-    }
-    for (int ay = ystart; ay != yend; ay += ychange) {
-      for (int ax = xstart; ax != xend; ax += xchange) { 
-        /* Current (best) guess. */
-        int v = (*ann)[ay][ax];
-        int xbest = INT_TO_X(v), ybest = INT_TO_Y(v);
-        int dbest = (*annd)[ay][ax];
-
-        /* Propagation: Improve current guess by trying instead correspondences from left and above (below and right on odd iterations). */
-        if ((unsigned) (ax - xchange) < (unsigned) aew) {
-          int vp = (*ann)[ay][ax-xchange];
-          int xp = INT_TO_X(vp) + xchange, yp = INT_TO_Y(vp);
-          if ((unsigned) xp < (unsigned) bew) {
-            improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp);
-          }
-        }
-
-        if ((unsigned) (ay - ychange) < (unsigned) aeh) {
-          int vp = (*ann)[ay-ychange][ax];
-          int xp = INT_TO_X(vp), yp = INT_TO_Y(vp) + ychange;
-          if ((unsigned) yp < (unsigned) beh) {
-            improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp);
-          }
-        }
-
-        /* Random search: Improve current guess by searching in boxes of exponentially decreasing size around the current best guess. */
-        int rs_start = rs_max;
-        if (rs_start > MAX(b->w, b->h)) { rs_start = MAX(b->w, b->h); }
-        for (int mag = rs_start; mag >= 1; mag /= 2) {
-          /* Sampling window */
-          int xmin = MAX(xbest-mag, 0), xmax = MIN(xbest+mag+1,bew);
-          int ymin = MAX(ybest-mag, 0), ymax = MIN(ybest+mag+1,beh);
-          int xp = xmin+rand()%(xmax-xmin);
-          int yp = ymin+rand()%(ymax-ymin);
-          improve_guess(a, b, ax, ay, xbest, ybest, dbest, xp, yp);
-        }
-
-        (*ann)[ay][ax] = XY_TO_INT(xbest, ybest);
-        (*annd)[ay][ax] = dbest;
-      }
-    }
+    engine.sweep(iter);
 
     // try to reconstruct at every iter
     /*
@@ -247,7 +194,7 @@ BITMAP *norm_image(double *accum, int w, int h, BITMAP *ainit=NULL) {
   return ans;
 }
 
-void reconstruct(BITMAP *a, BITMAP *b, BITMAP *ann, BITMAP *&ans) {
+void reconstruct(BITMAP *a, BITMAP *b, PMField ann, BITMAP *&ans) {
 
   int sz = a->w*a->h; sz = sz << 2; // 4*w*h
   double* accum = new double[sz];
@@ -255,7 +202,7 @@ void reconstruct(BITMAP *a, BITMAP *b, BITMAP *ann, BITMAP *&ans) {
 
   for (int ay = 0; ay < a->h - patch_w + 1; ay++) {
     for (int ax = 0; ax < a->w - patch_w + 1; ax++) {
-      int vp = (*ann)[ay][ax];
+      int vp = ann.nn[ay*ann.w + ax];
       int xp = INT_TO_X(vp), yp = INT_TO_Y(vp);
       for (int dy = 0; dy < patch_w; dy++) {
         int* brow = (*b)[yp+dy] + xp;
@@ -275,26 +222,215 @@ void reconstruct(BITMAP *a, BITMAP *b, BITMAP *ann, BITMAP *&ans) {
 }
 
 
+/* rand() is shared by all threads, so in --batch every target gets its own
+   xorshift64* stream, seeded from --seed and its line, and the results do
+   not depend on --threads. */
+thread_local unsigned long long batch_rng_state = 1;
+
+struct BatchRand {
+  int operator()() const {
+    batch_rng_state ^= batch_rng_state >> 12;
+    batch_rng_state ^= batch_rng_state << 25;
+    batch_rng_state ^= batch_rng_state >> 27;
+    return (int) ((batch_rng_state * 2685821657736338717ULL) >> 33);
+  }
+};
+
+/* patchmatch() against the source of a prebuilt index: rows compared with
+   SSE2, the initial matches and one candidate per random search drawn from
+   the sources of about the same color, see pm_source.h. */
+void patchmatch_indexed(BITMAP *a, const SourceIndex &index, PMField field) {
+  PatchPlanes planes(a->data, a->w, a->h, patch_w);
+  int aew = a->w - patch_w + 1, aeh = a->h - patch_w + 1;
+  int bew = index.planes.ew, beh = index.planes.eh;
+
+  PMRegion region = {0, aew, 0, aeh};
+  PatchMatchEngine<IndexedL2Distance, AnySource, HashSampling<BatchRand> > engine(
+      IndexedL2Distance(planes, index.planes), AnySource(), HashSampling<BatchRand>(planes, index, rs_max), field,
+      region, bew, beh);
+  engine.init();
+  for (int iter = 0; iter < pm_iters; iter++) {
+    engine.sweep(iter);
+  }
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+/* Batch reconstruction: every line of list_file is "a ann.nnf result", all
+   matched against the one source b_file. b is loaded and indexed once, or its
+   index mapped from cache_dir (see source_cache.h) when given; then nthreads
+   targets at a time are matched against the shared index, each writing its
+   field and its reconstruct() output. */
+void batch(const char *b_file, const char *list_file, int nthreads, unsigned int seed,
+           const char *cache_dir, unsigned long long cache_max) {
+  struct Target { std::string a, ann, result; };
+  std::vector<Target> targets;
+  FILE *list = fopen(list_file, "rt");
+  if (!list) { fprintf(stderr, "Error reading batch list '%s'\n", list_file); exit(1); }
+  char line[1024], a[256], ann[256], result[256];
+  while (fgets(line, sizeof(line), list)) {
+    if (sscanf(line, "%255s %255s %255s", a, ann, result) == 3) {
+      Target t = {a, ann, result};
+      targets.push_back(t);
+    } else if (strspn(line, " \t\r\n") != strlen(line)) {
+      fprintf(stderr, "expected: a ann.nnf result, skipping '%s'\n", line);
+    }
+  }
+  fclose(list);
+
+  BITMAP *b = load_bitmap(b_file);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  CachedSourceIndex cached;
+  const char *error = cached.open(cache_dir, cache_max, b->data, b->w, b->h, patch_w);
+  if (error) { fprintf(stderr, "Not caching the index of '%s': %s\n", b_file, error); }
+  const SourceIndex &index = cached.get();
+  if (cached.hit) {
+    printf("Mapped cached index of '%s' in %.1f ms (warm, %s)\n", b_file, seconds_since(start) * 1000,
+           cached.path.c_str());
+  } else {
+    printf("Indexed source '%s' in %.1f ms (cold", b_file, seconds_since(start) * 1000);
+    if (!error && cache_dir) {
+      printf(", cached as %s, %d evicted", cached.path.c_str(), cached.evicted);
+    }
+    printf(")\n");
+  }
+
+  std::chrono::steady_clock::time_point match_start = std::chrono::steady_clock::now();
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int i = next++; i < (int) targets.size(); i = next++) {
+      const Target &t = targets[i];
+      std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      batch_rng_state = (seed + 1ULL) * 0x9E3779B97F4A7C15ULL ^ ((unsigned long long) i << 32) ^ 1;
+      BITMAP *ta = load_bitmap(t.a.c_str());
+      BITMAP ann(ta->w, ta->h), annd(ta->w, ta->h);
+      memset(ann.data, 0, sizeof(int)*ta->w*ta->h);
+      memset(annd.data, 0, sizeof(int)*ta->w*ta->h);
+      PMField field = {ann.data, annd.data, ann.w};
+      patchmatch_indexed(ta, index, field);
+      const char *error = nnf_save(t.ann.c_str(), &field, 1, ta->w, ta->h, b->w, b->h, patch_w);
+      if (error) { fprintf(stderr, "Error writing NNF '%s': %s\n", t.ann.c_str(), error); exit(1); }
+      BITMAP *r = NULL;
+      reconstruct(ta, b, field, r);
+      save_bitmap(r, t.result.c_str());
+      printf("%s: %.1f ms\n", t.a.c_str(), seconds_since(t0) * 1000);
+      delete r;
+      delete ta;
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int k = 1; k < nthreads; k++) {
+    pool.push_back(std::thread(worker));
+  }
+  worker();
+  for (size_t k = 0; k < pool.size(); k++) {
+    pool[k].join();
+  }
+  double elapsed = seconds_since(match_start);
+  printf("%d targets in %.2f s on %d threads, %.1f targets/s\n", (int) targets.size(), elapsed, nthreads,
+         elapsed > 0 ? targets.size() / elapsed : 0.0);
+  delete b;
+}
+
+/* Copy of one plane of field as a w x h image, for save_bitmap(). */
+BITMAP *field_bitmap(const int *plane, int stride, int w, int h) {
+  BITMAP *ans = new BITMAP(w, h);
+  for (int y = 0; y < h; y++) {
+    memcpy((*ans)[y], &plane[y*stride], sizeof(int)*w);
+  }
+  return ans;
+}
+
 int main(int argc, char *argv[]) {
   argc--;
   argv++;
-  if (argc != 4) { fprintf(stderr, "pm_minimal a b ann annd\n"
+  unsigned int seed = 1; // rand() is seeded explicitly so runs can be repeated
+  const char *init_file = NULL, *batch_list = NULL, *cache_dir = NULL;
+  unsigned long long cache_max = 1024;   // MB
+  int nthreads = (int) std::thread::hardware_concurrency();
+  while (argc >= 2 && argv[0][0] == '-' && argv[0][1] == '-') {
+    if (strcmp(argv[0], "--seed") == 0) {
+      seed = (unsigned int) strtoul(argv[1], NULL, 10);
+    } else if (strcmp(argv[0], "--init") == 0) {
+      init_file = argv[1];
+    } else if (strcmp(argv[0], "--batch") == 0) {
+      batch_list = argv[1];
+    } else if (strcmp(argv[0], "--threads") == 0) {
+      nthreads = atoi(argv[1]);
+    } else if (strcmp(argv[0], "--cache") == 0) {
+      cache_dir = argv[1];
+    } else if (strcmp(argv[0], "--cache-max") == 0) {
+      cache_max = strtoull(argv[1], NULL, 10);
+    } else {
+      break;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  srand(seed);
+  if (batch_list && argc == 1) {
+    batch(argv[0], batch_list, MAX(1, nthreads), seed, cache_dir, cache_max << 20);
+    return 0;
+  }
+  if (batch_list || (argc != 3 && argc != 4)) { fprintf(stderr, "pm_minimal [--seed n] [--init prior.nnf] a b ann.nnf\n"
+                                   "pm_minimal [--seed n] [--init prior.nnf] a b ann annd\n"
+                                   "pm_minimal [--seed n] [--threads n] [--cache dir] [--cache-max MB] --batch list b\n"
                                    "Given input images a, b outputs nearest neighbor field 'ann' mapping a => b coords, and the squared L2 distance 'annd'\n"
-                                   "These are stored as RGB 24-bit images, with a 24-bit int at every pixel. For the NNF we store (by<<12)|bx."); exit(1); }
+                                   "With one output both go to a binary .nnf file (see nnf_file.h), which --init maps to start from on a later run.\n"
+                                   "With two they are stored as RGB 24-bit images, with a 24-bit int at every pixel. For the NNF we store (by<<12)|bx.\n"
+                                   "Images only keep the low 24 bits and lossy formats such as JPEG change them, so use .nnf to reuse a field.\n"
+                                   "--batch matches every 'a ann.nnf result' line of list against b, indexed once and shared by --threads\n"
+                                   "(default one per core) targets at a time, writing each field and its reconstruction.\n"
+                                   "--cache keeps the index of b in dir for later runs with the same b to map (see source_cache.h),\n"
+                                   "deleting the least recently used ones past --cache-max MB (default 1024)."); exit(1); }
   printf("(1) Loading input images\n");
   BITMAP *a = load_bitmap(argv[0]);
   BITMAP *b = load_bitmap(argv[1]);
+
+  /* The field lives in the mapped file when starting from one, otherwise in ann & annd. */
+  NNFMap prior;
   BITMAP *ann = NULL, *annd = NULL;
+  PMField field;
+  if (init_file) {
+    const char *error = prior.open(init_file);
+    if (error) { fprintf(stderr, "Error reading NNF '%s': %s\n", init_file, error); exit(1); }
+    const NNFFileHeader &h = prior.header;
+    if ((int) h.width != a->w || (int) h.height != a->h || (int) h.patch_w != patch_w) {
+      fprintf(stderr, "Error reading NNF '%s': field is %dx%d with %dx%d patches, need %dx%d with %dx%d\n", init_file,
+              h.width, h.height, h.patch_w, h.patch_w, a->w, a->h, patch_w, patch_w); exit(1);
+    }
+    printf("Starting from '%s' (%s)\n", init_file, prior.is_mapped() ? "mapped" : "read");
+    field = prior.field(0);
+  } else {
+    ann = new BITMAP(a->w, a->h);
+    annd = new BITMAP(a->w, a->h);
+    memset(ann->data, 0, sizeof(int)*a->w*a->h);
+    memset(annd->data, 0, sizeof(int)*a->w*a->h);
+    PMField f = {ann->data, annd->data, ann->w};
+    field = f;
+  }
   printf("\n(2) Running PatchMatch\n");
-  patchmatch(a, b, ann, annd);
-  printf("\n(3) Saving output images: ann & annd\n");
-  save_bitmap(ann, argv[2]);
-  save_bitmap(annd, argv[3]);
+  patchmatch(a, b, field, init_file != NULL);
+  if (argc == 3) {
+    printf("\n(3) Saving output field: ann\n");
+    const char *error = nnf_save(argv[2], &field, 1, a->w, a->h, b->w, b->h, patch_w);
+    if (error) { fprintf(stderr, "Error writing NNF '%s': %s\n", argv[2], error); exit(1); }
+  } else {
+    printf("\n(3) Saving output images: ann & annd\n");
+    if (!ann) {
+      ann = field_bitmap(field.nn, field.w, a->w, a->h);
+      annd = field_bitmap(field.d, field.w, a->w, a->h);
+    }
+    save_bitmap(ann, argv[2]);
+    save_bitmap(annd, argv[3]);
+  }
 
   // Reconstruct image based on ann
   printf("\n(4) Reconstructibg an image for the source image\n");
   BITMAP *r = NULL;
-  reconstruct(a, b, ann, r);
+  reconstruct(a, b, field, r);
   save_bitmap(r, "a_restructed.jpg");
 
   return 0;
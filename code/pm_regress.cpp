@@ -0,0 +1,388 @@
+/* -------------------------------------------------------------------------
+  End-to-end regression harness over test-images.
+
+  Completion: every testN/testNm pair of Image_Completion in png, jpg and
+  bmp, with the hole image testNh as input where it exists (that is what a
+  user has), optionally again under a --budget. Reconstruction: every a/b
+  pair of Image_Reconstruction, a rebuilt from patches of b and the other
+  way round.
+
+  Each case runs in a forked child so its peak RSS is its own. Recorded:
+  wall time of the computation (not the image loading), peak RSS, distance
+  evaluations (the target is built with PM_STATS), and PSNR/SSIM against
+  the original, inside the hole for completion and over the whole image for
+  reconstruction.
+
+  With --update the results are written to the baseline file, otherwise
+  they are compared against it: a case is flagged when its quality dropped
+  (reported as a speedup that costs quality if it also got faster) or when
+  it got slower than the time tolerance allows. The exit status is 1 if any
+  case was flagged or failed.
+  -------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "image_complete.h"
+#include "pm_stats.h"
+
+using namespace cv;
+using namespace std;
+
+struct RegressCase {
+  string name;
+  bool reconstruction;
+  string image, mask, input;   // completion: original, mask, hole image; reconstruction: a, -, b
+  double budget;
+};
+
+struct RegressResult {
+  int ok;
+  double time_ms;
+  long rss_kb;
+  long long dist_calls;
+  double psnr, ssim;
+};
+
+double time_tol = 0.10;    // relative slowdown allowed
+double psnr_tol = 0.10;    // dB
+double ssim_tol = 0.002;
+bool verbose = false;
+unsigned int seed = 1;
+
+bool file_exists(const string &path) {
+  return access(path.c_str(), R_OK) == 0;
+}
+
+vector<RegressCase> find_cases(const string &root, const vector<double> &budgets) {
+  vector<RegressCase> cases;
+  const char *formats[] = {"png", "jpg", "bmp"};
+  for (int f = 0; f < 3; ++f) {
+    string dir = root + "/Image_Completion/" + formats[f] + "/";
+    for (int n = 1; n <= 99; ++n) {
+      string stem = dir + "test" + to_string(n);
+      string ext = string(".") + formats[f];
+      if (!file_exists(stem + ext) || !file_exists(stem + "m" + ext)) {
+        continue;
+      }
+      RegressCase c;
+      c.reconstruction = false;
+      c.image = stem + ext;
+      c.mask = stem + "m" + ext;
+      c.input = file_exists(stem + "h" + ext) ? stem + "h" + ext : c.image;
+      c.budget = 0;
+      c.name = string("complete/") + formats[f] + "/test" + to_string(n);
+      cases.push_back(c);
+      for (size_t b = 0; b < budgets.size(); ++b) {
+        c.budget = budgets[b];
+        c.name = string("complete/") + formats[f] + "/test" + to_string(n) + "@" + to_string((int) (budgets[b] * 1000)) + "ms";
+        cases.push_back(c);
+      }
+    }
+  }
+  string a = root + "/Image_Reconstruction/a.png", b = root + "/Image_Reconstruction/b.png";
+  if (file_exists(a) && file_exists(b)) {
+    RegressCase c;
+    c.reconstruction = true;
+    c.budget = 0;
+    c.image = a; c.input = b; c.name = "reconstruct/a_from_b";
+    cases.push_back(c);
+    c.image = b; c.input = a; c.name = "reconstruct/b_from_a";
+    cases.push_back(c);
+  }
+  return cases;
+}
+
+/* PSNR and mean SSIM (Wang et al. 2004: 11x11 Gaussian window, sigma 1.5) over
+   the pixels where mask is set, averaged over the color channels. The SSIM
+   windows near the hole border also see known pixels, as they should. */
+void quality(Mat ref, Mat img, Mat mask, double &psnr, double &ssim) {
+  Mat x, y;
+  ref.convertTo(x, CV_32F);
+  img.convertTo(y, CV_32F);
+  vector<Mat> xc, yc;
+  split(x, xc);
+  split(y, yc);
+  const double C1 = (0.01 * 255) * (0.01 * 255), C2 = (0.03 * 255) * (0.03 * 255);
+  double sse = 0, ssim_sum = 0;
+  long long n = 0;
+  for (size_t c = 0; c < xc.size(); ++c) {
+    Mat mx, my, xx, yy, xy;
+    GaussianBlur(xc[c], mx, Size(11, 11), 1.5);
+    GaussianBlur(yc[c], my, Size(11, 11), 1.5);
+    multiply(xc[c], xc[c], xx);
+    multiply(yc[c], yc[c], yy);
+    multiply(xc[c], yc[c], xy);
+    GaussianBlur(xx, xx, Size(11, 11), 1.5);
+    GaussianBlur(yy, yy, Size(11, 11), 1.5);
+    GaussianBlur(xy, xy, Size(11, 11), 1.5);
+    for (int r = 0; r < ref.rows; ++r) {
+      for (int col = 0; col < ref.cols; ++col) {
+        if (mask.at<uchar>(r, col) == 0) {
+          continue;
+        }
+        double d = xc[c].at<float>(r, col) - yc[c].at<float>(r, col);
+        sse += d * d;
+        double ux = mx.at<float>(r, col), uy = my.at<float>(r, col);
+        double vx = xx.at<float>(r, col) - ux * ux;
+        double vy = yy.at<float>(r, col) - uy * uy;
+        double cxy = xy.at<float>(r, col) - ux * uy;
+        ssim_sum += ((2 * ux * uy + C1) * (2 * cxy + C2)) / ((ux * ux + uy * uy + C1) * (vx + vy + C2));
+        n++;
+      }
+    }
+  }
+  double mse = n ? sse / n : 0;
+  psnr = (mse > 0) ? 10 * log10(255.0 * 255.0 / mse) : 99;
+  ssim = n ? ssim_sum / n : 1;
+}
+
+/* Rebuild a from the patches of b: PatchMatch a => b over all of b, then vote. */
+Mat reconstruct(Mat a, Mat b) {
+  Mat dilated_mask = Mat::zeros(b.rows, b.cols, CV_8UC1);
+  // no labels; the engine reads them at a and at b coordinates, see patchmatch_init()
+  Mat constraint = Mat::zeros(std::max(a.rows, b.rows), std::max(a.cols, b.cols), CV_8UC1);
+  ConstraintIndex cindex;
+  BITMAP *ann = NULL, *annd = NULL;
+  patchmatch(a, b, ann, annd, dilated_mask, constraint, &cindex);
+  Box box = {0, a.cols - patch_w + 1, 0, a.rows - patch_w + 1};
+  Mat R = Mat::zeros(a.rows, a.cols, CV_32FC3);
+  Mat Rcount = Mat::zeros(a.rows, a.cols, CV_32FC3);
+  vote(b, ann, annd, box, R, Rcount);
+  normalize_votes(R, Rcount);
+  R.convertTo(R, CV_8UC3);
+  delete ann;
+  delete annd;
+  return R;
+}
+
+RegressResult run_case(const RegressCase &c) {
+  RegressResult res;
+  memset(&res, 0, sizeof(res));
+  pm_seed = seed;
+  pm_srand(seed);
+  Mat ref = imread(c.image);
+  Mat input = imread(c.input);
+  if (ref.empty() || input.empty()) {
+    fprintf(stderr, "%s: cannot read inputs\n", c.name.c_str());
+    return res;
+  }
+  Mat out, region;
+  double t = (double) getTickCount();
+  if (c.reconstruction) {
+    out = reconstruct(ref, input);
+    region = Mat(ref.rows, ref.cols, CV_8UC1, Scalar(255));
+  } else {
+    Mat mask = imread(c.mask, CV_LOAD_IMAGE_GRAYSCALE);
+    if (mask.empty()) {
+      fprintf(stderr, "%s: cannot read mask\n", c.name.c_str());
+      return res;
+    }
+    // the jpg masks are not exactly binary
+    threshold(mask, mask, 127, 255, 0);
+    Mat constraint = Mat::zeros(input.rows, input.cols, CV_8UC1);
+    out = image_complete(input, mask, constraint, PreviewCallback(), NULL, c.budget);
+    region = mask;
+  }
+  res.time_ms = ((double) getTickCount() - t) * 1000 / getTickFrequency();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  res.rss_kb = usage.ru_maxrss / 1024;
+#else
+  res.rss_kb = usage.ru_maxrss;
+#endif
+  res.dist_calls = pm_stats_total().dist_calls;
+  if (out.size() != ref.size()) {
+    resize(out, out, ref.size(), 0, 0, INTER_LINEAR);
+  }
+  quality(ref, out, region, res.psnr, res.ssim);
+  res.ok = 1;
+  return res;
+}
+
+/* Fork, run the case in the child and read its result back through a pipe. */
+RegressResult run_isolated(const RegressCase &c) {
+  RegressResult res;
+  memset(&res, 0, sizeof(res));
+  int fd[2];
+  if (pipe(fd) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fd[0]);
+    if (!verbose && !freopen("/dev/null", "w", stdout)) {
+      _exit(1);
+    }
+    RegressResult r = run_case(c);
+    ssize_t written = write(fd[1], &r, sizeof(r));
+    _exit(written == (ssize_t) sizeof(r) ? 0 : 1);
+  }
+  close(fd[1]);
+  ssize_t got = read(fd[0], &res, sizeof(res));
+  close(fd[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (got != (ssize_t) sizeof(res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    res.ok = 0;
+  }
+  return res;
+}
+
+map<string, RegressResult> read_baseline(const string &path) {
+  map<string, RegressResult> baseline;
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    return baseline;
+  }
+  char line[1024], name[512];
+  while (fgets(line, sizeof(line), f)) {
+    RegressResult r;
+    r.ok = 1;
+    if (line[0] == '#' || sscanf(line, "%511s %lf %ld %lld %lf %lf", name, &r.time_ms, &r.rss_kb,
+                                 &r.dist_calls, &r.psnr, &r.ssim) != 6) {
+      continue;
+    }
+    baseline[name] = r;
+  }
+  fclose(f);
+  return baseline;
+}
+
+void write_baseline(const string &path, const map<string, RegressResult> &baseline) {
+  FILE *f = fopen(path.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "Error writing baseline '%s'\n", path.c_str());
+    exit(1);
+  }
+  fprintf(f, "# case time_ms peak_rss_kb dist_calls psnr_db ssim\n");
+  for (map<string, RegressResult>::const_iterator it = baseline.begin(); it != baseline.end(); ++it) {
+    const RegressResult &r = it->second;
+    fprintf(f, "%s %.1f %ld %lld %.3f %.5f\n", it->first.c_str(), r.time_ms, r.rss_kb, r.dist_calls, r.psnr, r.ssim);
+  }
+  fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  argc--;
+  argv++;
+  string root = "../test-images";
+  string baseline_file = "regress_baseline.txt";
+  string filter;
+  bool update = false;
+  vector<double> budgets;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--images") == 0 && i + 1 < argc) {
+      root = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline_file = argv[++i];
+    } else if (strcmp(argv[i], "--update") == 0) {
+      update = true;
+    } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+      budgets.push_back(atof(argv[++i]) / 1000);
+    } else if (strcmp(argv[i], "--time-tol") == 0 && i + 1 < argc) {
+      time_tol = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--psnr-tol") == 0 && i + 1 < argc) {
+      psnr_tol = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--ssim-tol") == 0 && i + 1 < argc) {
+      ssim_tol = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--verbose") == 0) {
+      verbose = true;
+    } else {
+      fprintf(stderr, "pm_regress [--images dir] [--baseline file] [--update] [--budget ms]... [--filter name]\n"
+                      "           [--time-tol frac] [--psnr-tol db] [--ssim-tol x] [--seed n] [--verbose]\n"
+                      "Runs completion and reconstruction over the test images (default %s) and compares time,\n"
+                      "peak RSS, distance evaluations and PSNR/SSIM with the baseline (default %s).\n"
+                      "--update rewrites the baseline instead. Exit status is 1 if any case is flagged.\n",
+                      root.c_str(), baseline_file.c_str());
+      exit(1);
+    }
+  }
+
+  vector<RegressCase> all = find_cases(root, budgets), cases;
+  for (size_t i = 0; i < all.size(); ++i) {
+    if (filter.empty() || all[i].name.find(filter) != string::npos) {
+      cases.push_back(all[i]);
+    }
+  }
+  if (cases.empty()) {
+    fprintf(stderr, "pm_regress: no test cases under '%s'\n", root.c_str());
+    exit(1);
+  }
+#ifndef PM_STATS
+  fprintf(stderr, "pm_regress: built without PM_STATS, distance evaluations are not counted\n");
+#endif
+
+  // with --update (and --filter) only the cases that were run are replaced
+  map<string, RegressResult> baseline = read_baseline(baseline_file);
+  if (!update && baseline.empty()) {
+    fprintf(stderr, "pm_regress: no baseline in '%s', run with --update to create it\n", baseline_file.c_str());
+  }
+
+  printf("%-32s %10s %9s %14s %8s %8s  %s\n", "case", "ms", "rss MB", "dist calls", "psnr", "ssim", "vs baseline");
+  int flagged = 0;
+  for (size_t i = 0; i < cases.size(); ++i) {
+    const RegressCase &c = cases[i];
+    RegressResult r = run_isolated(c);
+    if (!r.ok) {
+      printf("%-32s FAILED\n", c.name.c_str());
+      flagged++;
+      continue;
+    }
+    string verdict;
+    map<string, RegressResult>::iterator it = baseline.find(c.name);
+    if (update) {
+      baseline[c.name] = r;
+    } else if (it != baseline.end()) {
+      const RegressResult &b = it->second;
+      double speedup = b.time_ms / max(r.time_ms, 1e-3);
+      bool worse = (r.psnr < b.psnr - psnr_tol) || (r.ssim < b.ssim - ssim_tol);
+      bool slower = r.time_ms > b.time_ms * (1 + time_tol);
+      char buf[256];
+      snprintf(buf, sizeof(buf), "%.2fx time, %+.2f dB, %+.4f ssim, %+.1f%% dist", speedup, r.psnr - b.psnr,
+               r.ssim - b.ssim, b.dist_calls ? 100.0 * (r.dist_calls - b.dist_calls) / b.dist_calls : 0.0);
+      verdict = buf;
+      if (worse && speedup > 1) {
+        verdict += "  SPEEDUP COSTS QUALITY";
+      } else if (worse) {
+        verdict += "  QUALITY REGRESSION";
+      }
+      if (slower) {
+        verdict += "  SLOWDOWN";
+      }
+      flagged += (worse || slower) ? 1 : 0;
+    } else {
+      verdict = "no baseline";
+    }
+    printf("%-32s %10.1f %9.1f %14lld %8.2f %8.4f  %s\n", c.name.c_str(), r.time_ms, r.rss_kb / 1024.0,
+           r.dist_calls, r.psnr, r.ssim, verdict.c_str());
+  }
+
+  if (update) {
+    write_baseline(baseline_file, baseline);
+    printf("baseline written to %s\n", baseline_file.c_str());
+  } else if (flagged) {
+    printf("%d case(s) flagged\n", flagged);
+  }
+  return flagged ? 1 : 0;
+}
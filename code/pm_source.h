@@ -0,0 +1,225 @@
+/* -------------------------------------------------------------------------
+  Source index for matching many target images against one source, as
+  pm_minimal --batch does for reconstruction.
+
+  PatchPlanes holds what matching needs of an image: its colors as one
+  8-bit RGB plane with rows padded to 16 bytes, so IndexedL2Distance can
+  compare rows with pm_bytes_ssd(), and the color sums of every patch,
+  taken from integral images.
+
+  SourceIndex adds a hash of the source patches by their mean color, in
+  compressed rows like ConstraintIndex. A target patch starts from a source
+  of about its own color instead of a uniform one, and keeps drawing one
+  per random search (HashSampling).
+
+  The sums would also bound the distance from below (per channel,
+  sum (a-b)^2 >= (sum a - sum b)^2 / n, Cauchy-Schwarz), but checking that
+  costs a cache miss on the source's sums for every candidate, more than
+  the first row of pixels it would save, so the distance does not use it.
+
+  The index is built once and only read while matching, so any number of
+  targets can be matched against it at the same time. Both classes can also
+  run over arrays kept elsewhere, laid out as those of a built one, which is
+  how source_cache.h maps them from disk. Only depends on the standard
+  library, like pm_engine.h.
+  -------------------------------------------------------------------------- */
+
+#ifndef PM_SOURCE_H
+#define PM_SOURCE_H
+
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "pm_engine.h"
+
+class PatchPlanes {
+public:
+  /* From packed pixels as the ImageMagick BITMAPs hold them, r | g<<8 | b<<16. */
+  PatchPlanes(const int *pixels, int w_, int h_, int patch_w_)
+      : w(w_), h(h_), patch_w(patch_w_), ew(w_ - patch_w_ + 1), eh(h_ - patch_w_ + 1),
+        step((3 * (size_t) w_ + 15) & ~(size_t) 15) {
+    own_plane.assign(plane_bytes(), 0);   // pm_bytes_ssd() reads up to 15 bytes past a row
+    std::vector<uint32_t> integral(3 * (size_t) (w + 1) * (h + 1), 0);
+    for (int y = 0; y < h; ++y) {
+      unsigned char *p = &own_plane[y * step];
+      uint32_t *above = &integral[3 * (size_t) y * (w + 1)], *row = above + 3 * (w + 1);
+      for (int x = 0; x < w; ++x) {
+        int c = pixels[y * w + x];
+        p[3*x] = c & 255;
+        p[3*x + 1] = (c >> 8) & 255;
+        p[3*x + 2] = (c >> 16) & 255;
+        for (int ch = 0; ch < 3; ++ch) {
+          row[3*(x + 1) + ch] = p[3*x + ch] + row[3*x + ch] + above[3*(x + 1) + ch] - above[3*x + ch];
+        }
+      }
+    }
+    own_sums.assign(sums_count(), 0);
+    for (int y = 0; y < eh; ++y) {
+      const uint32_t *top = &integral[3 * (size_t) y * (w + 1)], *bottom = top + 3 * (size_t) patch_w * (w + 1);
+      for (int x = 0; x < ew; ++x) {
+        for (int ch = 0; ch < 3; ++ch) {
+          own_sums[3 * ((size_t) y * ew + x) + ch] = (int) (bottom[3*(x + patch_w) + ch] - bottom[3*x + ch] -
+                                                            top[3*(x + patch_w) + ch] + top[3*x + ch]);
+        }
+      }
+    }
+    plane = &own_plane[0];
+    sums = own_sums.empty() ? NULL : &own_sums[0];
+  }
+
+  /* Over plane_bytes() of plane and sums_count() sums kept by the caller. */
+  PatchPlanes(int w_, int h_, int patch_w_, const unsigned char *plane_, const int *sums_)
+      : w(w_), h(h_), patch_w(patch_w_), ew(w_ - patch_w_ + 1), eh(h_ - patch_w_ + 1),
+        step((3 * (size_t) w_ + 15) & ~(size_t) 15), plane(plane_), sums(sums_) {}
+
+  const unsigned char *row(int y) const { return &plane[y * step]; }
+  /* r, g, b sums of the patch with corner (x, y). */
+  const int *patch_sums(int x, int y) const { return &sums[3 * ((size_t) y * ew + x)]; }
+
+  size_t plane_bytes() const { return step * h + 16; }
+  size_t sums_count() const { return 3 * (size_t) std::max(0, ew) * std::max(0, eh); }
+  const unsigned char *plane_data() const { return plane; }
+  const int *sums_data() const { return sums; }
+
+  const int w, h, patch_w;
+  const int ew, eh;     // patch corners
+  const size_t step;
+
+private:
+  PatchPlanes(const PatchPlanes &);
+  PatchPlanes &operator=(const PatchPlanes &);
+
+  const unsigned char *plane;
+  const int *sums;
+  std::vector<unsigned char> own_plane;   // empty over the caller's arrays
+  std::vector<int> own_sums;
+};
+
+/* PatchPlanes of the source, and its patch corners by mean color quantized
+   to `bits` bits per channel: the corners of key k are
+   xy[offset[k]] .. xy[offset[k+1]-1], packed like the NNF. */
+class SourceIndex {
+public:
+  SourceIndex(const int *pixels, int w, int h, int patch_w, int bits_ = 4)
+      : planes(pixels, w, h, patch_w), bits(bits_) {
+    std::vector<int> keys(xy_count());
+    own_offset.assign(offset_count(), 0);
+    for (int y = 0; y < planes.eh; ++y) {
+      for (int x = 0; x < planes.ew; ++x) {
+        int k = key(planes.patch_sums(x, y));
+        keys[(size_t) y * planes.ew + x] = k;
+        own_offset[k + 1]++;
+      }
+    }
+    for (size_t k = 1; k < own_offset.size(); ++k) {
+      own_offset[k] += own_offset[k - 1];
+    }
+    own_xy.resize(keys.size());
+    std::vector<int> fill(own_offset.begin(), own_offset.end() - 1);
+    for (int y = 0; y < planes.eh; ++y) {
+      for (int x = 0; x < planes.ew; ++x) {
+        own_xy[fill[keys[(size_t) y * planes.ew + x]]++] = pm_pack_xy(x, y);
+      }
+    }
+    offset = &own_offset[0];
+    xy = own_xy.empty() ? NULL : &own_xy[0];
+  }
+
+  /* Over arrays laid out as those of a built index, kept by the caller. */
+  SourceIndex(int w, int h, int patch_w, int bits_, const unsigned char *plane, const int *sums,
+              const int *offset_, const int *xy_)
+      : planes(w, h, patch_w, plane, sums), bits(bits_), offset(offset_), xy(xy_) {}
+
+  /* Key of a patch with the color sums of PatchPlanes::patch_sums(). */
+  int key(const int *sum) const {
+    int n = planes.patch_w * planes.patch_w, k = 0;
+    for (int ch = 0; ch < 3; ++ch) {
+      k = (k << bits) | ((sum[ch] / n) >> (8 - bits));
+    }
+    return k;
+  }
+  int count(int k) const { return offset[k + 1] - offset[k]; }
+  const int *bucket(int k) const { return &xy[offset[k]]; }
+
+  size_t offset_count() const { return ((size_t) 1 << (3 * bits)) + 1; }
+  size_t xy_count() const { return (size_t) std::max(0, planes.ew) * std::max(0, planes.eh); }
+  const int *offset_data() const { return offset; }
+  const int *xy_data() const { return xy; }
+
+  const PatchPlanes planes;
+  const int bits;
+
+private:
+  SourceIndex(const SourceIndex &);
+  SourceIndex &operator=(const SourceIndex &);
+
+  const int *offset, *xy;
+  std::vector<int> own_offset, own_xy;   // empty over the caller's arrays
+};
+
+/* Squared L2 between patches of two PatchPlanes, a row at a time with
+   pm_bytes_ssd(). Stops at the first row that reaches cutoff. */
+struct IndexedL2Distance {
+  const PatchPlanes *a, *b;
+
+  IndexedL2Distance(const PatchPlanes &a_, const PatchPlanes &b_) : a(&a_), b(&b_) {}
+
+  int operator()(int ax, int ay, int bx, int by, int cutoff) const {
+    PM_STAT_INC(dist_calls);
+    int ans = 0;
+    const int patch_w = a->patch_w;
+    for (int dy = 0; dy < patch_w; dy++) {
+      ans += pm_bytes_ssd(a->row(ay + dy) + 3*ax, b->row(by + dy) + 3*bx, 3 * patch_w);
+      if (ans >= cutoff) {
+        PM_STAT_EARLY_EXIT(dy);
+        return cutoff;
+      }
+    }
+    return ans;
+  }
+};
+
+/* WindowSampling over the source of a SourceIndex, plus sources of about the
+   target patch's color: one is the initial match and one more is offered
+   after every random search. Colors without sources fall back to uniform
+   ones. */
+template <class Rng>
+struct HashSampling {
+  WindowSampling<Rng, false> window;
+  const PatchPlanes *a;
+  const SourceIndex *index;
+
+  HashSampling(const PatchPlanes &a_, const SourceIndex &index_, int rs_max)
+      : window(index_.planes.ew, index_.planes.eh, rs_max, index_.planes.w, index_.planes.h), a(&a_),
+        index(&index_) {}
+
+  bool draw(int ax, int ay, int &bx, int &by) {
+    int k = index->key(a->patch_sums(ax, ay)), n = index->count(k);
+    if (n == 0) {
+      return false;
+    }
+    int v = index->bucket(k)[window.rng() % n];
+    bx = pm_unpack_x(v);
+    by = pm_unpack_y(v);
+    return true;
+  }
+
+  bool init(int ax, int ay, int &bx, int &by) {
+    return draw(ax, ay, bx, by) || window.init(ax, ay, bx, by);
+  }
+
+  template <class Offer>
+  void search(int ax, int ay, const int &xbest, const int &ybest, Offer offer) {
+    window.search(ax, ay, xbest, ybest, offer);
+    int bx, by;
+    if (draw(ax, ay, bx, by)) {
+      offer(bx, by);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,426 @@
+/* -------------------------------------------------------------------------
+  Space-time PatchMatch: 3D patches of patch_w x patch_w pixels over patch_t
+  consecutive frames, matched within a sliding window of video frames, as
+  in Wexler et al., "Space-Time Completion of Video".
+
+  FrameRing keeps the window: a fixed number of frame planes (colors, hole,
+  usable source corners, nearest neighbor field) reused in turn, so memory
+  does not grow with the length of the sequence. SpaceTimeEngine runs
+  initialization, propagation along x, y and t, and random search in space
+  and time over the target patches of the window, i.e. those touching a
+  hole, and lets them vote for the hole pixels.
+
+  A match packs (bt<<24)|(by<<12)|bx, bt being the ring slot of the first
+  frame of the source patch. Slots stay put while the window slides, so a
+  frame's field stays valid until its slot is reused. Frames can be up to
+  4095 pixels on a side and the window up to 127 frames.
+
+  Only depends on the standard library, like pm_engine.h.
+  -------------------------------------------------------------------------- */
+
+#ifndef PM_SPACETIME_H
+#define PM_SPACETIME_H
+
+#include <string.h>
+#include <limits.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "pm_engine.h"
+
+inline int pm_pack_xyt(int x, int y, int t) { return (t << 24) | (y << 12) | x; }
+inline int pm_unpack_yt(int v) { return (v >> 12) & ((1 << 12) - 1); }
+inline int pm_unpack_t(int v) { return v >> 24; }
+
+/* The last `capacity` frames of a sequence. Positions count the frames of
+   the window from the oldest (0) to the newest (size()-1); slots are where
+   they are stored. */
+class FrameRing {
+public:
+  FrameRing(int width_, int height_, int capacity_)
+      : width(width_), height(height_), capacity(capacity_), count(0), newest(capacity_ - 1), pushed(0),
+        planes(capacity_) {
+    size_t n = (size_t) width * height;
+    for (int s = 0; s < capacity; ++s) {
+      planes[s].image.assign(3*n + 16, 0);   // pm_bytes_ssd() reads up to 15 bytes past a row
+      planes[s].hole.assign(n, 0);
+      planes[s].source.assign(n, 0);
+      planes[s].nn.assign(n, -1);
+      planes[s].d.assign(n, INT_MAX);
+    }
+  }
+
+  /* Slot for the next frame, dropping the oldest one once the window is
+     full. The caller fills its image and hole, then calls update_sources(). */
+  int push() {
+    newest = (newest + 1) % capacity;
+    count = std::min(count + 1, capacity);
+    Plane &p = planes[newest];
+    std::fill(p.nn.begin(), p.nn.end(), -1);
+    std::fill(p.d.begin(), p.d.end(), INT_MAX);
+    p.number = pushed++;
+    return newest;
+  }
+
+  int size() const { return count; }
+  bool full() const { return count == capacity; }
+  int slot(int pos) const { return (newest - count + 1 + pos + 2*capacity) % capacity; }
+  int position(int s) const { return (s - slot(0) + capacity) % capacity; }
+  /* Frame number of a slot in the whole sequence, from 0. */
+  long long number(int s) const { return planes[s].number; }
+
+  size_t step() const { return 3 * (size_t) width; }
+  unsigned char *image(int s) { return &planes[s].image[0]; }
+  const unsigned char *image(int s) const { return &planes[s].image[0]; }
+  unsigned char *hole(int s) { return &planes[s].hole[0]; }              // nonzero in the hole
+  const unsigned char *hole(int s) const { return &planes[s].hole[0]; }
+  const unsigned char *source(int s) const { return &planes[s].source[0]; }
+  int *nn(int s) { return &planes[s].nn[0]; }
+  int *d(int s) { return &planes[s].d[0]; }
+
+  /* Marks the corners of slot s whose patch_w x patch_w patch lies inside
+     the frame and has no hole pixel, with running counts along the rows and
+     then the columns. */
+  void update_sources(int s, int patch_w) {
+    const unsigned char *hole_s = hole(s);
+    unsigned char *src = &planes[s].source[0];
+    std::vector<int> rows((size_t) width * height, 1);   // hole pixels in [x, x+patch_w) of the row
+    for (int y = 0; y < height; ++y) {
+      const unsigned char *h = hole_s + (size_t) y * width;
+      int run = 0;
+      for (int x = 0; x < width; ++x) {
+        run += h[x] != 0;
+        if (x >= patch_w) {
+          run -= h[x - patch_w] != 0;
+        }
+        if (x >= patch_w - 1) {
+          rows[(size_t) y * width + x - patch_w + 1] = run;
+        }
+      }
+    }
+    memset(src, 0, (size_t) width * height);
+    for (int x = 0; x + patch_w <= width; ++x) {
+      int run = 0;
+      for (int y = 0; y < height; ++y) {
+        run += rows[(size_t) y * width + x];
+        if (y >= patch_w) {
+          run -= rows[(size_t) (y - patch_w) * width + x];
+        }
+        if (y >= patch_w - 1) {
+          src[(size_t) (y - patch_w + 1) * width + x] = run == 0;
+        }
+      }
+    }
+  }
+
+  const int width, height, capacity;
+
+private:
+  struct Plane {
+    std::vector<unsigned char> image, hole, source;
+    std::vector<int> nn, d;
+    long long number;
+  };
+
+  int count, newest;
+  long long pushed;
+  std::vector<Plane> planes;
+};
+
+/* Squared L2 between 3D patches of the ring's frames, (ax, ay) and (bx, by)
+   in the frames from slots as and bs on. PW and PT fix the patch shape at
+   compile time, so the row length is a constant and the row loop of
+   pm_bytes_ssd() is unrolled into straight SIMD code; 0 takes patch_w and
+   patch_t at run time. Stops at the first row that reaches cutoff. */
+template <int PW = 0, int PT = 0>
+struct SpaceTimeL2Distance {
+  const FrameRing *ring;
+  int patch_w, patch_t;
+
+  SpaceTimeL2Distance(const FrameRing &ring_, int patch_w_, int patch_t_)
+      : ring(&ring_), patch_w(PW ? PW : patch_w_), patch_t(PT ? PT : patch_t_) {}
+
+  int operator()(int ax, int ay, int as, int bx, int by, int bs, int cutoff) const {
+    PM_STAT_INC(dist_calls);
+    const int w = PW ? PW : patch_w, t = PT ? PT : patch_t;
+    const size_t step = ring->step();
+    int ans = 0;
+    for (int k = 0; k < t; ++k) {
+      const unsigned char *a = ring->image((as + k) % ring->capacity) + ay*step + 3*ax;
+      const unsigned char *b = ring->image((bs + k) % ring->capacity) + by*step + 3*bx;
+      for (int dy = 0; dy < w; ++dy) {
+        ans += pm_bytes_ssd(a + dy*step, b + dy*step, 3 * w);
+        if (ans >= cutoff) {
+          PM_STAT_EARLY_EXIT(k * w + dy);
+          return cutoff;
+        }
+      }
+    }
+    return ans;
+  }
+};
+
+/* PatchMatch over the 3D patches of a FrameRing whose first frame is at
+   positions 0 .. size()-patch_t. Targets are the patches with a hole pixel in
+   any of their frames; sources the patches with none in all of them. */
+template <class Distance, class Rng>
+class SpaceTimeEngine {
+public:
+  SpaceTimeEngine(FrameRing &ring_, const Distance &dist_, int patch_w_, int patch_t_, int rs_max_, Rng rng_ = Rng())
+      : ring(ring_), dist(dist_), rng(rng_), patch_w(patch_w_), patch_t(patch_t_), rs_max(rs_max_),
+        bew(ring_.width - patch_w_ + 1), beh(ring_.height - patch_w_ + 1) {
+    find_box();
+  }
+
+  int positions() const { return std::max(0, ring.size() - patch_t + 1); }
+
+  bool target(int x, int y, int pos) const {
+    for (int k = 0; k < patch_t; ++k) {
+      if (!ring.source(ring.slot(pos + k))[y*ring.width + x]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool valid(int bx, int by, int bs) const {
+    if ((unsigned) bx >= (unsigned) bew || (unsigned) by >= (unsigned) beh ||
+        ring.position(bs) >= positions()) {
+      return false;
+    }
+    for (int k = 0; k < patch_t; ++k) {
+      if (!ring.source((bs + k) % ring.capacity)[by*ring.width + bx]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /* Rescores the match of every target, e.g. after the hole colors changed,
+     and draws a random one where there is none (new frames) or it is no
+     longer valid (its source left the window or its frames changed). */
+  void init() {
+    PROFILE_SCOPE("st_init");
+    for (int pos = 0; pos < positions(); ++pos) {
+      int s = ring.slot(pos);
+      int *nn = ring.nn(s), *d = ring.d(s);
+      for (int y = ymin; y < ymax; ++y) {
+        for (int x = xmin; x < xmax; ++x) {
+          if (!target(x, y, pos)) {
+            continue;
+          }
+          int i = y*ring.width + x, v = nn[i];
+          int bx = pm_unpack_x(v), by = pm_unpack_yt(v), bs = pm_unpack_t(v);
+          if (v < 0 || !valid(bx, by, bs)) {
+            if (!random_source(bx, by, bs)) {
+              nn[i] = -1;
+              d[i] = INT_MAX;
+              continue;
+            }
+            nn[i] = pm_pack_xyt(bx, by, bs);
+          }
+          d[i] = dist(x, y, s, bx, by, bs, INT_MAX);
+        }
+      }
+    }
+  }
+
+  /* One propagation + random search pass over the window; odd iterations run
+     backwards in x, y and t. */
+  void sweep(int iter) {
+    PROFILE_SCOPE_ARG("st_sweep", iter);
+    int dir = iter % 2 ? -1 : 1;
+    int np = positions();
+    for (int pi = 0; pi < np; ++pi) {
+      int pos = dir > 0 ? pi : np - 1 - pi;
+      for (int yi = ymin; yi < ymax; ++yi) {
+        int y = dir > 0 ? yi : ymax - 1 - (yi - ymin);
+        for (int xi = xmin; xi < xmax; ++xi) {
+          int x = dir > 0 ? xi : xmax - 1 - (xi - xmin);
+          if (target(x, y, pos)) {
+            visit(x, y, pos, dir);
+          }
+        }
+      }
+    }
+  }
+
+  /* Every matched target adds its source's colors, with weight(distance), to
+     the accumulators of the frames it covers: accum[pos] has 4 floats per
+     pixel, the weighted B, G, R sums and the weight. */
+  template <class Weight>
+  void vote(const Weight &weight, std::vector<std::vector<float> > &accum) {
+    PROFILE_SCOPE("st_vote");
+    size_t step = ring.step();
+    for (int pos = 0; pos < positions(); ++pos) {
+      int s = ring.slot(pos);
+      const int *nn = ring.nn(s), *d = ring.d(s);
+      for (int y = ymin; y < ymax; ++y) {
+        for (int x = xmin; x < xmax; ++x) {
+          int i = y*ring.width + x, v = nn[i];
+          if (v < 0 || !target(x, y, pos)) {
+            continue;
+          }
+          float w = weight(d[i]);
+          if (w <= 0) {
+            continue;
+          }
+          int bx = pm_unpack_x(v), by = pm_unpack_yt(v), bs = pm_unpack_t(v);
+          for (int k = 0; k < patch_t; ++k) {
+            const unsigned char *src = ring.image((bs + k) % ring.capacity);
+            float *acc = &accum[pos + k][0];
+            for (int dy = 0; dy < patch_w; ++dy) {
+              const unsigned char *srow = src + (by + dy)*step + 3*bx;
+              float *arow = acc + 4*((size_t) (y + dy)*ring.width + x);
+              for (int dx = 0; dx < patch_w; ++dx) {
+                arow[4*dx] += w * srow[3*dx];
+                arow[4*dx + 1] += w * srow[3*dx + 1];
+                arow[4*dx + 2] += w * srow[3*dx + 2];
+                arow[4*dx + 3] += w;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /* Sets the hole pixels that got votes to their weighted mean and clears
+     the accumulators. Returns the mean squared change per hole pixel. */
+  double resolve(std::vector<std::vector<float> > &accum) {
+    double change = 0;
+    long long pixels = 0;
+    for (int pos = 0; pos < ring.size(); ++pos) {
+      int s = ring.slot(pos);
+      unsigned char *img = ring.image(s);
+      const unsigned char *hole = ring.hole(s);
+      float *acc = &accum[pos][0];
+      for (size_t i = 0; i < (size_t) ring.width * ring.height; ++i) {
+        if (hole[i] && acc[4*i + 3] > 0) {
+          for (int c = 0; c < 3; ++c) {
+            int v = (int) (acc[4*i + c] / acc[4*i + 3] + 0.5f);
+            change += (double) (v - img[3*i + c]) * (v - img[3*i + c]);
+            img[3*i + c] = (unsigned char) std::min(v, 255);
+          }
+          pixels++;
+        }
+      }
+      std::fill(accum[pos].begin(), accum[pos].end(), 0.0f);
+    }
+    return pixels ? change / pixels : 0;
+  }
+
+private:
+  /* Corners of the patches that can touch a hole of the window. */
+  void find_box() {
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = -1, y1 = -1;
+    for (int pos = 0; pos < ring.size(); ++pos) {
+      const unsigned char *hole = ring.hole(ring.slot(pos));
+      for (int y = 0; y < ring.height; ++y) {
+        for (int x = 0; x < ring.width; ++x) {
+          if (hole[y*ring.width + x]) {
+            x0 = std::min(x0, x); x1 = std::max(x1, x);
+            y0 = std::min(y0, y); y1 = std::max(y1, y);
+          }
+        }
+      }
+    }
+    xmin = std::max(0, x0 - patch_w + 1);
+    ymin = std::max(0, y0 - patch_w + 1);
+    xmax = x1 < 0 ? 0 : std::min(bew, x1 + 1);
+    ymax = y1 < 0 ? 0 : std::min(beh, y1 + 1);
+  }
+
+  bool random_source(int &bx, int &by, int &bs) {
+    for (int tries = 0; tries < 64; ++tries) {
+      bx = rng() % bew;
+      by = rng() % beh;
+      bs = ring.slot(rng() % positions());
+      if (valid(bx, by, bs)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void improve(int x, int y, int s, int &xbest, int &ybest, int &sbest, int &dbest, int bx, int by, int bs) {
+    int d = dist(x, y, s, bx, by, bs, dbest);
+    if (d < dbest) {
+      dbest = d;
+      xbest = bx;
+      ybest = by;
+      sbest = bs;
+    }
+  }
+
+  void visit(int x, int y, int pos, int dir) {
+    int s = ring.slot(pos);
+    int i = y*ring.width + x;
+    int *nn = ring.nn(s), *d = ring.d(s);
+    int v = nn[i], dbest = d[i];
+    int xbest = pm_unpack_x(v), ybest = pm_unpack_yt(v), sbest = pm_unpack_t(v);
+    if (v < 0) {
+      dbest = INT_MAX;
+      xbest = ybest = sbest = -1;
+    }
+
+    // propagation from the neighbor before in x, in y and in t, shifted back by one
+    const int nbr[3][3] = {{x - dir, y, pos}, {x, y - dir, pos}, {x, y, pos - dir}};
+    for (int n = 0; n < 3; ++n) {
+      int nx = nbr[n][0], ny = nbr[n][1], np = nbr[n][2];
+      if (nx < xmin || nx >= xmax || ny < ymin || ny >= ymax || np < 0 || np >= positions() || !target(nx, ny, np)) {
+        continue;
+      }
+      int vn = ring.nn(ring.slot(np))[ny*ring.width + nx];
+      if (vn < 0) {
+        continue;
+      }
+      // shifted in window positions, not slots: past the newest frame the
+      // next slot is the oldest one, which is no neighbor in time
+      int bx = pm_unpack_x(vn) + (x - nx), by = pm_unpack_yt(vn) + (y - ny);
+      int bt = ring.position(pm_unpack_t(vn)) + (pos - np);
+      if (bt < 0 || bt >= positions()) {
+        continue;
+      }
+      int bs = ring.slot(bt);
+      if (valid(bx, by, bs)) {
+        improve(x, y, s, xbest, ybest, sbest, dbest, bx, by, bs);
+      }
+    }
+
+    // random search in windows of halving size around the best match, in space and time
+    if (sbest < 0) {
+      int bx, by, bs;
+      if (!random_source(bx, by, bs)) {
+        return;
+      }
+      improve(x, y, s, xbest, ybest, sbest, dbest, bx, by, bs);
+    }
+    int r = std::min(std::max(bew, beh), rs_max), rt = positions();
+    while (r >= 1 || rt >= 1) {
+      int x0 = std::max(xbest - r, 0), x1 = std::min(xbest + r + 1, bew);
+      int y0 = std::max(ybest - r, 0), y1 = std::min(ybest + r + 1, beh);
+      int tb = ring.position(sbest);
+      int t0 = std::max(tb - rt, 0), t1 = std::min(tb + rt + 1, positions());
+      int bx = x0 + rng() % (x1 - x0), by = y0 + rng() % (y1 - y0), bs = ring.slot(t0 + rng() % (t1 - t0));
+      if (valid(bx, by, bs)) {
+        improve(x, y, s, xbest, ybest, sbest, dbest, bx, by, bs);
+      }
+      r /= 2;
+      rt /= 2;
+    }
+
+    nn[i] = pm_pack_xyt(xbest, ybest, sbest);
+    d[i] = dbest;
+  }
+
+  FrameRing &ring;
+  Distance dist;
+  Rng rng;
+  int patch_w, patch_t, rs_max;
+  int bew, beh;
+  int xmin, xmax, ymin, ymax;
+};
+
+#endif
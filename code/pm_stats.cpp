@@ -0,0 +1,92 @@
+#include "pm_stats.h"
+
+#include <string.h>
+#include <mutex>
+
+using namespace std;
+
+namespace {
+mutex total_mutex;
+PMStats total;    // zero initialized, like the thread local copies
+}
+
+void PMStats::clear() {
+  memset(this, 0, sizeof(*this));
+}
+
+void PMStats::add(const PMStats &o) {
+  dist_calls += o.dist_calls;
+  dist_early_exit += o.dist_early_exit;
+  for (int i = 0; i < PM_STATS_MAX_ROWS; ++i) {
+    early_exit_row[i] += o.early_exit_row[i];
+  }
+  for (int t = 0; t < PM_CANDIDATE_TYPES; ++t) {
+    tries[t] += o.tries[t];
+    improvements[t] += o.improvements[t];
+  }
+  init_retries += o.init_retries;
+  rs_retries += o.rs_retries;
+  pm_calls += o.pm_calls;
+  for (int i = 0; i < PM_STATS_MAX_SWEEPS; ++i) {
+    sweep_dist_sum[i] += o.sweep_dist_sum[i];
+    sweep_count[i] += o.sweep_count[i];
+  }
+  for (int i = 0; i < PM_STATS_MAX_WORKERS; ++i) {
+    worker_busy[i] += o.worker_busy[i];
+    worker_wall[i] += o.worker_wall[i];
+    worker_tiles[i] += o.worker_tiles[i];
+    worker_steals[i] += o.worker_steals[i];
+  }
+}
+
+void PMStats::print(FILE *f) const {
+  const char *names[PM_CANDIDATE_TYPES] = {"propagation x", "propagation y", "random search"};
+  fprintf(f, "patchmatch calls      %lld\n", pm_calls);
+  fprintf(f, "distance evaluations  %lld\n", dist_calls);
+  fprintf(f, "early terminated      %lld (%.1f%%)\n", dist_early_exit,
+          dist_calls ? 100.0 * dist_early_exit / dist_calls : 0.0);
+  for (int i = 0; i < PM_STATS_MAX_ROWS; ++i) {
+    if (early_exit_row[i]) {
+      fprintf(f, "  after row %-2d%s       %lld\n", i, i == PM_STATS_MAX_ROWS - 1 ? "+" : " ", early_exit_row[i]);
+    }
+  }
+  fprintf(f, "%-20s %14s %14s %10s\n", "candidates", "tried", "improved", "rate");
+  for (int t = 0; t < PM_CANDIDATE_TYPES; ++t) {
+    fprintf(f, "%-20s %14lld %14lld %9.2f%%\n", names[t], tries[t], improvements[t],
+            tries[t] ? 100.0 * improvements[t] / tries[t] : 0.0);
+  }
+  fprintf(f, "init retries          %lld\n", init_retries);
+  fprintf(f, "random search retries %lld\n", rs_retries);
+  fprintf(f, "mean NNF distance after sweep:\n");
+  for (int i = 0; i < PM_STATS_MAX_SWEEPS; ++i) {
+    if (sweep_count[i]) {
+      fprintf(f, "  sweep %-2d %14.1f\n", i, sweep_dist_sum[i] / sweep_count[i]);
+    }
+  }
+  if (worker_wall[0] > 0) {
+    fprintf(f, "%-20s %10s %10s %10s %10s %10s\n", "tiled loop workers", "busy s", "wall s", "busy", "tiles", "stolen");
+    for (int i = 0; i < PM_STATS_MAX_WORKERS; ++i) {
+      if (worker_wall[i] > 0) {
+        fprintf(f, "  thread %-11d %10.3f %10.3f %9.1f%% %10lld %10lld\n", i, worker_busy[i], worker_wall[i],
+                100.0 * worker_busy[i] / worker_wall[i], worker_tiles[i], worker_steals[i]);
+      }
+    }
+  }
+}
+
+PMStats &pm_stats_local() {
+  static thread_local PMStats local;
+  return local;
+}
+
+void pm_stats_flush() {
+  PMStats &local = pm_stats_local();
+  lock_guard<mutex> lock(total_mutex);
+  total.add(local);
+  local.clear();
+}
+
+PMStats pm_stats_total() {
+  lock_guard<mutex> lock(total_mutex);
+  return total;
+}
@@ -0,0 +1,76 @@
+/* -------------------------------------------------------------------------
+  Counters for how effective the PatchMatch search is: distance evaluations,
+  early terminations (and at which patch row), accepted improvements per
+  candidate type, rejection sampling retries and the mean NNF distance after
+  every sweep. Used to pick pm_iters, rs_max and patch_w. Also how busy each
+  worker of the tiled parallel loops was, to check their balance.
+
+  Compiled in only with -DPM_STATS. Each thread counts into its own
+  PMStats; pm_stats_flush() adds it to the global totals.
+  -------------------------------------------------------------------------- */
+
+#ifndef PM_STATS_H
+#define PM_STATS_H
+
+#include <stdio.h>
+#include <vector>
+
+#define PM_STATS_MAX_ROWS 32
+#define PM_STATS_MAX_SWEEPS 64
+#define PM_STATS_MAX_WORKERS 64
+
+/* Candidate types, as passed to PatchMatchEngine::improve(). */
+enum { PM_PROP_X = 0, PM_PROP_Y = 1, PM_RANDOM = 2, PM_CANDIDATE_TYPES = 3 };
+
+struct PMStats {
+  long long dist_calls;
+  long long dist_early_exit;
+  long long early_exit_row[PM_STATS_MAX_ROWS];   // last row summed before the cutoff hit
+  long long tries[PM_CANDIDATE_TYPES];
+  long long improvements[PM_CANDIDATE_TYPES];
+  long long init_retries;                        // rejected samples while initializing the NNF
+  long long rs_retries;                          // rejected samples in random search
+  long long pm_calls;
+  double sweep_dist_sum[PM_STATS_MAX_SWEEPS];    // mean NNF distance after sweep i, summed over calls
+  long long sweep_count[PM_STATS_MAX_SWEEPS];
+  // per thread t of pm_run_tiles(), summed over runs (threads past the last share the last slot)
+  double worker_busy[PM_STATS_MAX_WORKERS];      // seconds running tiles
+  double worker_wall[PM_STATS_MAX_WORKERS];      // seconds from the start of the run until the thread was done
+  long long worker_tiles[PM_STATS_MAX_WORKERS];
+  long long worker_steals[PM_STATS_MAX_WORKERS];
+
+  void clear();
+  void add(const PMStats &other);
+  void print(FILE *f) const;
+};
+
+PMStats &pm_stats_local();
+
+/* Add this thread's counters to the global totals and clear them. */
+void pm_stats_flush();
+
+/* Global totals of everything flushed so far. */
+PMStats pm_stats_total();
+
+#ifdef PM_STATS
+#define PM_STAT_INC(field) (pm_stats_local().field++)
+#define PM_STAT_EARLY_EXIT(row) do { PMStats &s_ = pm_stats_local(); s_.dist_early_exit++; \
+    s_.early_exit_row[(row) < PM_STATS_MAX_ROWS ? (row) : PM_STATS_MAX_ROWS - 1]++; } while (0)
+#define PM_STAT_CANDIDATE(type, accepted) do { PMStats &s_ = pm_stats_local(); s_.tries[type]++; \
+    if (accepted) s_.improvements[type]++; } while (0)
+#define PM_STAT_SWEEP(iter, mean_dist) do { if ((iter) < PM_STATS_MAX_SWEEPS) { PMStats &s_ = pm_stats_local(); \
+    s_.sweep_dist_sum[iter] += (mean_dist); s_.sweep_count[iter]++; } } while (0)
+#define PM_STAT_WORKER(t, busy, wall, tiles, steals) do { PMStats &s_ = pm_stats_local(); \
+    int w_ = (t) < PM_STATS_MAX_WORKERS ? (t) : PM_STATS_MAX_WORKERS - 1; s_.worker_busy[w_] += (busy); \
+    s_.worker_wall[w_] += (wall); s_.worker_tiles[w_] += (tiles); s_.worker_steals[w_] += (steals); } while (0)
+#define PM_STAT_FLUSH() pm_stats_flush()
+#else
+#define PM_STAT_INC(field) do { } while (0)
+#define PM_STAT_EARLY_EXIT(row) do { } while (0)
+#define PM_STAT_CANDIDATE(type, accepted) do { } while (0)
+#define PM_STAT_SWEEP(iter, mean_dist) do { } while (0)
+#define PM_STAT_WORKER(t, busy, wall, tiles, steals) do { } while (0)
+#define PM_STAT_FLUSH() do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,164 @@
+#include "profile.h"
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+using namespace std;
+
+bool profile_enabled = false;
+
+namespace {
+
+enum EventKind { EVENT_SCOPE, EVENT_PHASE, EVENT_COUNTER };
+
+struct ProfileEvent {
+  const char *name;
+  EventKind kind;
+  double ts, dur;     // microseconds; dur is the extrapolated total for phases
+  double value;       // counter value, or number of calls for phases
+  long long arg;
+  bool has_arg;
+};
+
+/* Each thread appends to its own log without locking; the logs are only
+   read by profile_write_trace/profile_print_summary after the threads are done. */
+struct ThreadLog {
+  int tid;
+  vector<ProfileEvent> events;
+};
+
+mutex registry_mutex;
+vector<ThreadLog *> registry;
+
+ThreadLog *thread_log() {
+  static thread_local ThreadLog *log = NULL;
+  if (!log) {
+    lock_guard<mutex> lock(registry_mutex);
+    log = new ThreadLog;
+    log->tid = (int) registry.size();
+    registry.push_back(log);
+  }
+  return log;
+}
+
+void push_event(const ProfileEvent &e) {
+  thread_log()->events.push_back(e);
+}
+
+}
+
+void profile_enable(bool on) {
+  profile_now_us();
+  profile_enabled = on;
+}
+
+double profile_now_us() {
+  static const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+  return chrono::duration<double, micro>(chrono::steady_clock::now() - epoch).count();
+}
+
+void profile_record(const char *name, double start_us, double dur_us, long long arg, bool has_arg) {
+  ProfileEvent e = {name, EVENT_SCOPE, start_us, dur_us, 0, arg, has_arg};
+  push_event(e);
+}
+
+void profile_record_phase(const char *name, double start_us, double total_us, long long calls) {
+  ProfileEvent e = {name, EVENT_PHASE, start_us, total_us, (double) calls, 0, false};
+  push_event(e);
+}
+
+void profile_count(const char *name, double value) {
+  ProfileEvent e = {name, EVENT_COUNTER, profile_now_us(), 0, value, 0, false};
+  push_event(e);
+}
+
+bool profile_write_trace(const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    fprintf(stderr, "Error writing trace '%s'\n", filename);
+    return false;
+  }
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  lock_guard<mutex> lock(registry_mutex);
+  for (size_t t = 0; t < registry.size(); ++t) {
+    const ThreadLog *log = registry[t];
+    for (size_t i = 0; i < log->events.size(); ++i) {
+      const ProfileEvent &e = log->events[i];
+      fprintf(f, "%s", first ? "" : ",\n");
+      first = false;
+      if (e.kind == EVENT_SCOPE) {
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                e.name, log->tid, e.ts, e.dur);
+        if (e.has_arg) {
+          fprintf(f, ",\"args\":{\"n\":%lld}", e.arg);
+        }
+        fprintf(f, "}");
+      } else if (e.kind == EVENT_PHASE) {
+        // per-pixel phases have no single interval, show them as a counter track in ms
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"ms\":%.3f}}",
+                e.name, log->tid, e.ts, e.dur / 1000);
+      } else {
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%g}}",
+                e.name, log->tid, e.ts, e.value);
+      }
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  return true;
+}
+
+void profile_print_summary(FILE *f) {
+  struct Stat {
+    long long count;
+    double total, min, max;
+    bool counter;
+  };
+  map<string, Stat> stats;
+  vector<string> order;
+  lock_guard<mutex> lock(registry_mutex);
+  for (size_t t = 0; t < registry.size(); ++t) {
+    const vector<ProfileEvent> &events = registry[t]->events;
+    for (size_t i = 0; i < events.size(); ++i) {
+      const ProfileEvent &e = events[i];
+      // scopes and phases in ms, counters in their own unit
+      double v = (e.kind == EVENT_COUNTER) ? e.value : e.dur / 1000;
+      map<string, Stat>::iterator it = stats.find(e.name);
+      if (it == stats.end()) {
+        Stat s = {0, 0, v, v, e.kind == EVENT_COUNTER};
+        it = stats.insert(make_pair(string(e.name), s)).first;
+        order.push_back(e.name);
+      }
+      Stat &s = it->second;
+      s.count++;
+      s.total += v;
+      s.min = min(s.min, v);
+      s.max = max(s.max, v);
+    }
+  }
+  fprintf(f, "%-24s %10s %12s %12s %12s %12s\n", "phase", "count", "total ms", "mean ms", "min ms", "max ms");
+  for (size_t i = 0; i < order.size(); ++i) {
+    const Stat &s = stats[order[i]];
+    if (!s.counter) {
+      fprintf(f, "%-24s %10lld %12.3f %12.3f %12.3f %12.3f\n", order[i].c_str(), s.count, s.total,
+              s.total / s.count, s.min, s.max);
+    }
+  }
+  bool header = false;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const Stat &s = stats[order[i]];
+    if (s.counter) {
+      if (!header) {
+        fprintf(f, "\n%-24s %10s %12s %12s %12s %12s\n", "counter", "samples", "total", "mean", "min", "max");
+        header = true;
+      }
+      fprintf(f, "%-24s %10lld %12g %12g %12g %12g\n", order[i].c_str(), s.count, s.total,
+              s.total / s.count, s.min, s.max);
+    }
+  }
+}
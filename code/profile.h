@@ -0,0 +1,108 @@
+/* -------------------------------------------------------------------------
+  Lightweight instrumentation: scoped timers, sampled per-pixel phases and
+  counters, written out as a Chrome trace (chrome://tracing, Perfetto) and
+  a summary table.
+
+  Compiled in only with -DPM_PROFILE, otherwise every macro is empty. When
+  compiled in, nothing is recorded until profile_enable(true); a disabled
+  scope costs one branch on a global flag.
+  -------------------------------------------------------------------------- */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+extern bool profile_enabled;
+
+void profile_enable(bool on);
+
+/* Microseconds since the first call. */
+double profile_now_us();
+
+void profile_record(const char *name, double start_us, double dur_us, long long arg, bool has_arg);
+void profile_record_phase(const char *name, double start_us, double total_us, long long calls);
+void profile_count(const char *name, double value);
+
+/* Call once all instrumented threads are done. */
+bool profile_write_trace(const char *filename);
+void profile_print_summary(FILE *f);
+
+class ProfileScope {
+public:
+  ProfileScope(const char *name_, long long arg_ = 0, bool has_arg_ = false)
+      : name(name_), arg(arg_), has_arg(has_arg_), start(profile_enabled ? profile_now_us() : -1) {}
+  ~ProfileScope() { stop(); }
+
+  /* End the scope early, for phases that do not map onto a block. */
+  void stop() {
+    if (start >= 0) {
+      profile_record(name, start, profile_now_us() - start, arg, has_arg);
+      start = -1;
+    }
+  }
+
+private:
+  const char *name;
+  long long arg;
+  bool has_arg;
+  double start;
+};
+
+/* Time of a phase that runs once per pixel, e.g. propagation. Timing every
+   call would cost as much as the phase itself, so only one call in
+   PROFILE_SAMPLE_RATE is timed and the total is extrapolated. Reported when
+   the object goes out of scope, typically once per sweep. */
+#define PROFILE_SAMPLE_RATE 16
+
+class ProfilePhase {
+public:
+  ProfilePhase(const char *name_) : name(name_), calls(0), sampled_us(0), t0(-1),
+                                    start(profile_enabled ? profile_now_us() : -1) {}
+  ~ProfilePhase() {
+    if (start >= 0 && calls > 0) {
+      profile_record_phase(name, start, sampled_us * PROFILE_SAMPLE_RATE, calls);
+    }
+  }
+  void begin() {
+    if (start >= 0 && (calls++ % PROFILE_SAMPLE_RATE) == 0) {
+      t0 = profile_now_us();
+    }
+  }
+  void end() {
+    if (t0 >= 0) {
+      sampled_us += profile_now_us() - t0;
+      t0 = -1;
+    }
+  }
+
+private:
+  const char *name;
+  long long calls;
+  double sampled_us, t0, start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+
+#ifdef PM_PROFILE
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_SCOPE_ARG(name, arg) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name, arg, true)
+#define PROFILE_SCOPE_VAR(var, name) ProfileScope var(name)
+#define PROFILE_STOP(var) var.stop()
+#define PROFILE_PHASE(var, name) ProfilePhase var(name)
+#define PROFILE_PHASE_BEGIN(var) var.begin()
+#define PROFILE_PHASE_END(var) var.end()
+#define PROFILE_COUNT(name, value) do { if (profile_enabled) profile_count(name, value); } while (0)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_SCOPE_ARG(name, arg)
+#define PROFILE_SCOPE_VAR(var, name)
+#define PROFILE_STOP(var)
+#define PROFILE_PHASE(var, name)
+#define PROFILE_PHASE_BEGIN(var)
+#define PROFILE_PHASE_END(var)
+#define PROFILE_COUNT(name, value) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,210 @@
+#include <string.h>
+#include <math.h>
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <algorithm>
+
+#include "image_complete.h"
+#include "profile.h"
+
+using namespace cv;
+using namespace std;
+
+/* 2x2 box average of 8-bit rows, rounding as resize() with INTER_AREA does for
+   an exact 2x downscale. Horizontal pair sums go to a 16-bit row first, so
+   both passes are plain loops over contiguous arrays the compiler turns into
+   SIMD code. */
+void downsample_area(const Mat &src, Mat &dst, Size size) {
+  int cn = src.channels();
+  if (src.depth() != CV_8U || size.width*2 != src.cols || size.height*2 != src.rows) {
+    resize(src, dst, size, 0, 0, INTER_AREA);
+    return;
+  }
+  dst.create(size, src.type());
+  int n = size.width*cn;
+  vector<unsigned short> sums(2*n);
+  unsigned short *h0 = &sums[0], *h1 = &sums[n];
+  for (int y = 0; y < size.height; ++y) {
+    const unsigned char *s0 = src.ptr(2*y), *s1 = src.ptr(2*y + 1);
+    for (int x = 0; x < size.width; ++x) {
+      for (int c = 0; c < cn; ++c) {
+        h0[x*cn + c] = (unsigned short) (s0[2*x*cn + c] + s0[(2*x + 1)*cn + c]);
+        h1[x*cn + c] = (unsigned short) (s1[2*x*cn + c] + s1[(2*x + 1)*cn + c]);
+      }
+    }
+    unsigned char *d = dst.ptr(y);
+    for (int i = 0; i < n; ++i) {
+      d[i] = (unsigned char) ((h0[i] + h1[i] + 2) >> 2);
+    }
+  }
+}
+
+/* Size of level k, as resize() with fx = fy = 2^-k gives it. */
+static Size level_size(Size base, int level) {
+  double scale = pow(2, -level);
+  return Size(cvRound(base.width*scale), cvRound(base.height*scale));
+}
+
+CompletionPyramid::CompletionPyramid(Mat image, int nlevels) : derived_patch_w(patch_w), radius(-1) {
+  PROFILE_SCOPE("pyramid_image");
+  images.push_back(image.clone());
+  for (int k = 1; k < nlevels; ++k) {
+    Size size = level_size(image.size(), k);
+    if (size.width < 1 || size.height < 1) {
+      break;
+    }
+    Mat level;
+    downsample_area(images[k - 1], level, size);
+    images.push_back(level);
+  }
+}
+
+bool CompletionPyramid::same_image(Mat image) const {
+  const Mat &base = images[0];
+  if (image.size() != base.size() || image.type() != base.type()) {
+    return false;
+  }
+  size_t row_bytes = base.cols*base.elemSize();
+  for (int y = 0; y < base.rows; ++y) {
+    if (memcmp(image.ptr(y), base.ptr(y), row_bytes) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* The mask is averaged level to level without thresholding and thresholded
+   per level, so a level sees (close to) the coverage of the full mask as if
+   it had been resized from full resolution. */
+void CompletionPyramid::set_mask(Mat mask, Mat constraint) {
+  PROFILE_SCOPE("pyramid_mask");
+  masks.assign(levels(), Mat());
+  constraints.assign(levels(), Mat());
+  derived.assign(levels(), Derived());
+  radius = -1;
+
+  Mat coverage = mask;
+  for (int k = 0; k < levels(); ++k) {
+    Size size = images[k].size();
+    if (k > 0) {
+      Mat next;
+      downsample_area(coverage, next, size);
+      coverage = next;
+      resize(constraints[k - 1], constraints[k], size, 0, 0, INTER_NEAREST);
+    } else {
+      constraints[0] = constraint.clone();
+    }
+    threshold(coverage, masks[k], 127, 255, 0);
+  }
+  derived_patch_w = patch_w;
+}
+
+/* Cached results are only good for the patch_w they were built with. */
+void CompletionPyramid::check_patch_w() {
+  if (derived_patch_w != patch_w) {
+    derived.assign(levels(), Derived());
+    derived_patch_w = patch_w;
+  }
+}
+
+const Mat &CompletionPyramid::dilated_mask(int level) {
+  check_patch_w();
+  Derived &d = derived[level];
+  if (d.dilated.empty()) {
+    d.dilated = dilate_mask(masks[level]);
+  }
+  return d.dilated;
+}
+
+const Box &CompletionPyramid::box(int level) {
+  check_patch_w();
+  Derived &d = derived[level];
+  if (!d.has_box) {
+    d.box = getBox(masks[level]);
+    d.has_box = true;
+  }
+  return d.box;
+}
+
+const ConstraintIndex &CompletionPyramid::constraint_index(int level) {
+  const Mat &dilated = dilated_mask(level);
+  Derived &d = derived[level];
+  if (!d.has_index) {
+    const Mat &img = images[level];
+    getConstraintIndex(constraints[level], dilated, img.cols - patch_w + 1, img.rows - patch_w + 1, &d.cindex);
+    d.has_index = true;
+  }
+  return d.cindex;
+}
+
+double CompletionPyramid::hole_radius() {
+  if (radius < 0) {
+    Mat dist;
+    distanceTransform(masks[0], dist, CV_DIST_L2, 3);
+    double max_dist = 0;
+    minMaxLoc(dist, NULL, &max_dist);
+    radius = max_dist;
+  }
+  return radius;
+}
+
+/* -------------------------------------------------------------------------
+   Completion schedules
+   ------------------------------------------------------------------------- */
+
+static const CompletionSchedule schedule_profiles[] = {
+  // name       levels max  radius  EM coarse/fine  PM coarse
+  { "fast",     0,     6,   1.0,    30, 5,          1.0 },
+  { "default",  0,     7,   0.5,    50, 10,         2.0 },
+  { "quality",  0,     8,   0.25,   60, 30,         2.0 },
+  { "legacy",   4,     4,   0,      60, 60,         1.0 },
+};
+
+CompletionSchedule completion_schedule = schedule_profiles[1];
+
+const CompletionSchedule *schedule_profile(const char *name) {
+  for (size_t i = 0; i < sizeof(schedule_profiles) / sizeof(schedule_profiles[0]); ++i) {
+    if (strcmp(schedule_profiles[i].name, name) == 0) {
+      return &schedule_profiles[i];
+    }
+  }
+  return NULL;
+}
+
+/* Halve until the hole is about hole_radius patch widths across at the
+   coarsest level, so small holes skip coarse levels that cannot help and
+   large ones get enough of them. The coarsest level keeps room for a few
+   patches around the hole, a fixed depth included. */
+int CompletionSchedule::depth(CompletionPyramid &pyramid) const {
+  int n = min(max_depth(), pyramid.levels());
+  int wanted = n;
+  if (levels <= 0) {
+    double target = max(hole_radius * patch_w, 1.0);
+    wanted = 1 + max(0, (int) ceil(log2(pyramid.hole_radius() / target)));
+  }
+  while (n > 1) {
+    const Mat &coarsest = pyramid.image(n - 1);
+    if (n <= wanted && min(coarsest.cols, coarsest.rows) >= 4*patch_w) {
+      break;
+    }
+    n--;
+  }
+  return n;
+}
+
+/* Geometric from the coarsest value to the finest one; a single level starts
+   from scratch like a coarsest one and gets its count. */
+static double level_fraction(int level, int nlevels) {
+  return nlevels > 1 ? (double) level / (nlevels - 1) : 0;
+}
+
+int CompletionSchedule::em_iterations(int level, int nlevels) const {
+  double t = level_fraction(level, nlevels);
+  return max(1, (int) floor(em_coarse * pow((double) em_fine / em_coarse, t) + 0.5));
+}
+
+int CompletionSchedule::pm_iterations(int level, int nlevels) const {
+  double t = level_fraction(level, nlevels);
+  return max(1, (int) floor(pm_iters * pow(pm_coarse, 1 - t) + 0.5));
+}
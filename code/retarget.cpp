@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <math.h>
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#include "image_complete.h"
+#include "pm_engine.h"
+#include "profile.h"
+
+using namespace cv;
+using namespace std;
+
+int retarget_min_size = 64;
+double retarget_step = 0.05;
+int retarget_step_iters = 2;
+int retarget_em_iters = 2;
+int retarget_pm_iters = 2;
+int retarget_rs_reuse = 16;
+
+struct RetargetRand {
+  int operator()() const { return pm_rand(); }
+};
+
+typedef PatchMatchEngine<Bgr8L2Distance, AnySource, WindowSampling<RetargetRand, false> > RetargetEngine;
+
+/* Nearest neighbor field from the patches of an image of size a to those of
+   one of size b, row length a.width like the BITMAPs. */
+struct RetargetField {
+  vector<int> nn, d;
+  Size a, b;
+};
+
+/* Carries f over to images of sizes a and b: every patch takes the match of
+   the patch at the same relative position of the old a, moved to the same
+   relative position of the old b, so the offsets between neighboring
+   matches survive the resize. An empty field gets no matches (-1), which
+   init_from_field() draws at random. */
+static void rescale_field(RetargetField &f, Size a, Size b) {
+  vector<int> nn((size_t) a.width * a.height, -1), d(nn.size(), INT_MAX);
+  if (!f.nn.empty()) {
+    int aew = a.width - patch_w + 1, aeh = a.height - patch_w + 1;
+    int oaew = f.a.width - patch_w + 1, oaeh = f.a.height - patch_w + 1;
+    int bew = b.width - patch_w + 1, beh = b.height - patch_w + 1;
+    double ax_scale = (double) f.a.width / a.width, ay_scale = (double) f.a.height / a.height;
+    double bx_scale = (double) b.width / f.b.width, by_scale = (double) b.height / f.b.height;
+    for (int ay = 0; ay < aeh; ++ay) {
+      double oy = (ay + 0.5) * ay_scale;
+      int oyi = std::min(oaeh - 1, (int) oy);
+      for (int ax = 0; ax < aew; ++ax) {
+        double ox = (ax + 0.5) * ax_scale;
+        int oxi = std::min(oaew - 1, (int) ox);
+        int v = f.nn[(size_t) oyi * f.a.width + oxi];
+        if (v < 0) {
+          continue;
+        }
+        int bx = (int) ((pm_unpack_x(v) + ox - oxi) * bx_scale);
+        int by = (int) ((pm_unpack_y(v) + oy - oyi) * by_scale);
+        nn[(size_t) ay * a.width + ax] = pm_pack_xy(std::max(0, std::min(bew - 1, bx)), std::max(0, std::min(beh - 1, by)));
+      }
+    }
+  }
+  f.nn.swap(nn);
+  f.d.swap(d);
+  f.a = a;
+  f.b = b;
+}
+
+/* Improves f, a => b, from the matches it has: each one is scored again on
+   the current images (missing ones are drawn at random), then iters sweeps
+   with random search out to rs pixels. The parallel sweep modes run on
+   nthreads threads, the serial one on the caller's. */
+static void retarget_match(Mat a, Mat b, RetargetField &f, int rs, int iters, int nthreads) {
+  PROFILE_SCOPE("retarget_match");
+  int aew = a.cols - patch_w + 1, aeh = a.rows - patch_w + 1;
+  int bew = b.cols - patch_w + 1, beh = b.rows - patch_w + 1;
+  PMField field = {&f.nn[0], &f.d[0], a.cols};
+  PMRegion region = {0, aew, 0, aeh, NULL, 0, 0};
+  RetargetEngine engine(Bgr8L2Distance(a.ptr(), a.step[0], b.ptr(), b.step[0], patch_w), AnySource(),
+                        WindowSampling<RetargetRand, false>(bew, beh, rs, b.cols, b.rows), field, region, bew, beh);
+  engine.init_from_field();
+  unsigned int seed = (unsigned int) pm_rand();
+  if (pm_sweep_mode == PM_SWEEP_HOGWILD && nthreads > 1) {
+    engine.sweep_concurrent(
+        iters, nthreads, std::max(1, pm_tile_rows),
+        [seed, aeh](int iter, int band) { pm_srand(seed, (unsigned int) (iter * aeh + band)); },
+        [](int, double) {}, []() { return false; });
+    return;
+  }
+  for (int iter = 0; iter < iters; ++iter) {
+    if (pm_sweep_mode == PM_SWEEP_CHECKERBOARD) {
+      engine.sweep_checkerboard(
+          iter, std::max(0, pm_jumps), nthreads, std::max(1, pm_tile_rows),
+          [seed, aeh](int phase, int row) { pm_srand(seed, (unsigned int) (phase * aeh + row)); });
+    } else {
+      engine.sweep(iter);
+    }
+  }
+}
+
+/* Runs f and g at once, f on the caller and g on a worker of the caller's
+   pm_worker_pool(), or one after the other if not concurrent. Each gets its
+   own random stream seeded from the caller's, which is put back, so the
+   result is the same either way. */
+template <class F, class G>
+static void run_both(bool concurrent, F f, G g) {
+  unsigned int f_seed = (unsigned int) pm_rand(), g_seed = (unsigned int) pm_rand();
+  unsigned long long caller_rng = pm_rng_state;
+  auto half = [&](int t) {
+    if (t == 0) {
+      pm_srand(f_seed);
+      f();
+    } else {
+      pm_srand(g_seed);
+      g();
+    }
+    PM_STAT_FLUSH();
+  };
+  if (concurrent) {
+    pm_worker_pool().run(2, half);
+  } else {
+    half(0);
+    half(1);
+  }
+  pm_rng_state = caller_rng;
+}
+
+/* One bidirectional similarity update (Simakov et al. 2008): every pixel of
+   t becomes the mean of the source pixels voted for it by the patches of t
+   covering it (coherence, through ts) and by the patches of s whose nearest
+   neighbor covers it (completeness, through st). Each term is divided by its
+   number of patches, so the larger source does not drown out the target.
+   With nthreads > 1 both votes run at once, coherence on the nthreads - 1
+   threads the completeness vote leaves. */
+static void retarget_vote(Mat s, Mat t, RetargetField &st, RetargetField &ts, int nthreads) {
+  PROFILE_SCOPE("retarget_vote");
+  size_t n = (size_t) t.cols * t.rows;
+  vector<float> coherence(4*n, 0.0f), completeness(4*n, 0.0f);
+  auto splat = [&](vector<float> &acc, int tx, int ty, int sx, int sy) {
+    for (int dy = 0; dy < patch_w; ++dy) {
+      const uchar *src = s.ptr<uchar>(sy + dy) + 3*sx;
+      float *r = &acc[4*((size_t) (ty + dy) * t.cols + tx)];
+      for (int dx = 0; dx < patch_w; ++dx, src += 3, r += 4) {
+        r[0] += src[0];
+        r[1] += src[1];
+        r[2] += src[2];
+        r[3] += 1;
+      }
+    }
+  };
+  int tew = t.cols - patch_w + 1, teh = t.rows - patch_w + 1;
+  int sew = s.cols - patch_w + 1, seh = s.rows - patch_w + 1;
+  PMField ts_field = {&ts.nn[0], &ts.d[0], t.cols};
+  PMField st_field = {&st.nn[0], &st.d[0], s.cols};
+  run_both(
+      nthreads > 1,
+      [&]() {
+        PMRegion region = {0, tew, 0, teh, NULL, 0, 0};
+        pm_vote_tiled(UniformWeight(), ts_field, region, patch_w, pm_tile_rows, std::max(1, nthreads - 1),
+                      [&](int tx, int ty, int sx, int sy, float) { splat(coherence, tx, ty, sx, sy); });
+      },
+      [&]() {
+        // matches of different source patches overlap anywhere in t, so one thread
+        PMRegion region = {0, sew, 0, seh, NULL, 0, 0};
+        pm_vote(UniformWeight(), st_field, region,
+                [&](int sx, int sy, int tx, int ty, float) { splat(completeness, tx, ty, sx, sy); });
+      });
+
+  float k = (float) (((double) tew * teh) / ((double) sew * seh));
+  for (int y = 0; y < t.rows; ++y) {
+    uchar *row = t.ptr<uchar>(y);
+    const float *c = &coherence[4*(size_t) y * t.cols], *m = &completeness[4*(size_t) y * t.cols];
+    for (int x = 0; x < t.cols; ++x, c += 4, m += 4) {
+      float w = c[3] + k * m[3];
+      if (w > 0) {
+        for (int ch = 0; ch < 3; ++ch) {
+          row[3*x + ch] = saturate_cast<uchar>((c[ch] + k * m[ch]) / w);
+        }
+      }
+    }
+  }
+}
+
+/* EM iterations on t: both fields, solved at the same time on half of the
+   threads each, then the vote. */
+static void retarget_em(Mat s, Mat t, RetargetField &st, RetargetField &ts, int em_iters, int rs, int pm_sweeps) {
+  int nthreads = pm_threads > 0 ? pm_threads : (int) thread::hardware_concurrency();
+  int half = std::max(1, nthreads / 2);
+  for (int em = 0; em < em_iters; ++em) {
+    PROFILE_SCOPE_ARG("em_iteration", em);
+    run_both(nthreads > 1, [&]() { retarget_match(s, t, st, rs, pm_sweeps, half); },
+             [&]() { retarget_match(t, s, ts, rs, pm_sweeps, half); });
+    retarget_vote(s, t, st, ts, nthreads);
+  }
+}
+
+/* The next size of the gradual resizing from `from` to `to`: at most
+   retarget_step of the current size per side, and at least a pixel. */
+static Size resize_step(Size from, Size to) {
+  int dw = std::max(1, cvRound(from.width * retarget_step));
+  int dh = std::max(1, cvRound(from.height * retarget_step));
+  return Size(from.width + std::max(-dw, std::min(dw, to.width - from.width)),
+              from.height + std::max(-dh, std::min(dh, to.height - from.height)));
+}
+
+static double seconds_since(double ticks) {
+  return ((double) getTickCount() - ticks) / getTickFrequency();
+}
+
+Mat retarget(Mat image, Size size) {
+  PROFILE_SCOPE("retarget");
+  pm_srand(pm_seed);
+  double start = (double) getTickCount();
+
+  // as deep as the smaller side of source and target allows
+  int smallest = std::min(std::min(image.cols, image.rows), std::min(size.width, size.height));
+  int nlevels = 1;
+  while (nlevels < 12 && (smallest >> nlevels) >= std::max(retarget_min_size, 2*patch_w)) {
+    nlevels++;
+  }
+  CompletionPyramid pyramid(image, nlevels);
+  nlevels = pyramid.levels();
+
+  RetargetField st, ts;
+  Mat t;
+  for (int level = nlevels - 1; level >= 0; --level) {
+    PROFILE_SCOPE_ARG("scale", nlevels - level);
+    double level_start = (double) getTickCount();
+    Mat s = pyramid.image(level);
+    Size goal = level == 0 ? size
+                           : Size(std::max(patch_w, cvRound(size.width * (double) s.cols / image.cols)),
+                                  std::max(patch_w, cvRound(size.height * (double) s.rows / image.rows)));
+    int steps = 0;
+    if (t.empty()) {
+      // gradual resizing: small steps from the source, each one starting
+      // from the last one's result and both of its fields
+      t = s.clone();
+      while (t.size() != goal) {
+        Mat next;
+        resize(t, next, resize_step(t.size(), goal), 0, 0, INTER_LINEAR);
+        t = next;
+        rescale_field(st, s.size(), t.size());
+        rescale_field(ts, t.size(), s.size());
+        retarget_em(s, t, st, ts, retarget_step_iters, rs_max, steps == 0 ? pm_iters : retarget_pm_iters);
+        steps++;
+      }
+    } else {
+      // the level above's result and fields, upsampled; the fields are
+      // close already, so the random search stays near them
+      Mat next;
+      resize(t, next, goal, 0, 0, INTER_LINEAR);
+      t = next;
+      rescale_field(st, s.size(), t.size());
+      rescale_field(ts, t.size(), s.size());
+      retarget_em(s, t, st, ts, retarget_em_iters, std::min(rs_max, retarget_rs_reuse), retarget_pm_iters);
+    }
+    printf("retarget: level %d, %dx%d -> %dx%d", nlevels - 1 - level, s.cols, s.rows, t.cols, t.rows);
+    if (steps > 0) {
+      printf(" in %d steps", steps);
+    }
+    printf(", %.2f s\n", seconds_since(level_start));
+  }
+  printf("retarget: %dx%d -> %dx%d in %.2f s\n", image.cols, image.rows, t.cols, t.rows, seconds_since(start));
+  return t;
+}
@@ -0,0 +1,339 @@
+/* -------------------------------------------------------------------------
+  On-disk cache of source indexes (SourceIndex, pm_source.h), so a source
+  seen by an earlier run is mapped from disk instead of indexed again.
+
+  A file is named after its key, a 64-bit hash of the index settings
+  (SOURCE_CACHE_VERSION, patch_w, bits) and of the source's size and pixels,
+  as <dir>/<key in hex>.pmi. Layout, all little-endian:
+
+    0    SourceCacheHeader, 64 bytes
+    64   the RGB plane, the patch sums, the key offsets and the corners of
+         every key, each starting on a 64-byte boundary
+
+  These are exactly the arrays of a built SourceIndex, so a mapped file is
+  used in place, read-only and shared with other processes through the page
+  cache. Files are written under a temporary name and renamed, so readers
+  see all of a file or none of it. The header repeats the key and the sizes,
+  the key offsets have to ascend and every corner has to be a patch corner of
+  the source; a file that does not pass is built and written again.
+
+  The directory is kept under a size cap by deleting the least recently used
+  files, by modification time: a hit touches its file.
+
+  Only depends on the standard library and POSIX. Elsewhere, and on
+  big-endian hosts, every open() builds the index in memory.
+  -------------------------------------------------------------------------- */
+
+#ifndef SOURCE_CACHE_H
+#define SOURCE_CACHE_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "pm_source.h"
+#include "nnf_file.h"
+
+#define SOURCE_CACHE_MAGIC "PMIDX\r\n\x1a"
+#define SOURCE_CACHE_VERSION 1
+#define SOURCE_CACHE_ALIGN 64
+#define SOURCE_CACHE_SUFFIX ".pmi"
+
+struct SourceCacheHeader {
+  char magic[8];            // SOURCE_CACHE_MAGIC
+  uint32_t version;         // SOURCE_CACHE_VERSION
+  uint32_t header_bytes;    // offset of the plane
+  uint32_t width, height;   // source size
+  uint32_t patch_w, bits;   // SourceIndex settings
+  uint64_t key;             // also the file name
+  uint64_t file_bytes;
+  uint32_t reserved[4];     // 0
+};
+
+inline uint64_t source_cache_rotl(uint64_t v, int r) { return (v << r) | (v >> (64 - r)); }
+
+/* Four xxHash64 lanes over 32-byte stripes, FNV-1a over the rest. Byte at a
+   time FNV-1a alone, as the checkpoint keys use, takes about 2 ns a byte,
+   most of a hit on a large source. */
+inline uint64_t source_cache_hash(uint64_t seed, const void *data, size_t n) {
+  const uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL;
+  uint64_t lane[4] = {seed + p1 + p2, seed + p2, seed, seed - p1};
+  const unsigned char *p = (const unsigned char *) data;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (int l = 0; l < 4; ++l) {
+      uint64_t v;
+      memcpy(&v, p + i + 8*l, sizeof(v));
+      lane[l] = source_cache_rotl(lane[l] + v * p2, 31) * p1;
+    }
+  }
+  uint64_t h = source_cache_rotl(lane[0], 1) + source_cache_rotl(lane[1], 7) + source_cache_rotl(lane[2], 12) +
+               source_cache_rotl(lane[3], 18) + n;
+  for (; i < n; ++i) {
+    h = (h ^ p[i]) * 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p1;
+  return h ^ (h >> 32);
+}
+
+inline uint64_t source_cache_key(const int *pixels, int w, int h, int patch_w, int bits) {
+  const uint32_t settings[] = {SOURCE_CACHE_VERSION, (uint32_t) w, (uint32_t) h, (uint32_t) patch_w, (uint32_t) bits};
+  return source_cache_hash(source_cache_hash(0, settings, sizeof(settings)), pixels, sizeof(int) * (size_t) w * h);
+}
+
+/* Offsets and sizes in the file of the plane, sums, key offsets and corners
+   of index. Returns the size of the file. */
+inline uint64_t source_cache_layout(const SourceIndex &index, uint64_t offsets[4], uint64_t bytes[4]) {
+  bytes[0] = index.planes.plane_bytes();
+  bytes[1] = sizeof(int) * index.planes.sums_count();
+  bytes[2] = sizeof(int) * index.offset_count();
+  bytes[3] = sizeof(int) * index.xy_count();
+  uint64_t at = sizeof(SourceCacheHeader);
+  for (int i = 0; i < 4; ++i) {
+    at = (at + SOURCE_CACHE_ALIGN - 1) / SOURCE_CACHE_ALIGN * SOURCE_CACHE_ALIGN;
+    offsets[i] = at;
+    at += bytes[i];
+  }
+  return at;
+}
+
+#ifndef _WIN32
+/* Deletes the least recently used files of dir until the rest take at most
+   max_bytes, never keep, and temporary files of writers that died over an
+   hour ago. Returns the number of cache files deleted. */
+inline int source_cache_trim(const std::string &dir, uint64_t max_bytes, const std::string &keep) {
+  struct Entry {
+    time_t used;
+    uint64_t bytes;
+    std::string path;
+    bool operator<(const Entry &o) const { return used < o.used; }
+  };
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    return 0;
+  }
+  time_t now = time(NULL);
+  while (struct dirent *e = readdir(d)) {
+    std::string name = e->d_name, path = dir + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    size_t suffix = strlen(SOURCE_CACHE_SUFFIX);
+    if (name.find(SOURCE_CACHE_SUFFIX ".tmp") != std::string::npos) {
+      if (now - st.st_mtime > 3600) {
+        unlink(path.c_str());
+      }
+    } else if (name.size() > suffix && name.compare(name.size() - suffix, suffix, SOURCE_CACHE_SUFFIX) == 0) {
+      Entry entry = {st.st_mtime, (uint64_t) st.st_size, path};
+      entries.push_back(entry);
+      total += entry.bytes;
+    }
+  }
+  closedir(d);
+
+  std::sort(entries.begin(), entries.end());
+  int removed = 0;
+  for (size_t i = 0; i < entries.size() && total > max_bytes; ++i) {
+    if (entries[i].path != keep && unlink(entries[i].path.c_str()) == 0) {
+      total -= entries[i].bytes;
+      removed++;
+    }
+  }
+  return removed;
+}
+#endif
+
+/* The SourceIndex of one source, mapped from a cache directory when it holds
+   it, else built and added to it. */
+class CachedSourceIndex {
+public:
+  CachedSourceIndex() : key(0), hit(false), evicted(0), base(NULL), bytes(0) {}
+  ~CachedSourceIndex() { close(); }
+
+  /* Index of the w x h packed pixels (as for SourceIndex), through the cache
+     in dir holding at most max_bytes, or just built when dir is NULL. There
+     is an index afterwards either way; returns NULL, or why the cache could
+     not be used. */
+  const char *open(const char *dir, uint64_t max_bytes, const int *pixels, int w, int h, int patch_w, int bits = 4) {
+    close();
+#ifndef _WIN32
+    if (dir && nnf_little_endian()) {
+      key = source_cache_key(pixels, w, h, patch_w, bits);
+      char name[32];
+      snprintf(name, sizeof(name), "%016llx" SOURCE_CACHE_SUFFIX, (unsigned long long) key);
+      path = std::string(dir) + "/" + name;
+      if (map(w, h, patch_w, bits)) {
+        hit = true;
+        return NULL;
+      }
+      index.reset(new SourceIndex(pixels, w, h, patch_w, bits));
+      if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return "could not create the cache directory";
+      }
+      const char *error = write();
+      if (!error) {
+        evicted = source_cache_trim(dir, max_bytes, path);
+      }
+      return error;
+    }
+#endif
+    index.reset(new SourceIndex(pixels, w, h, patch_w, bits));
+    return dir ? "no index cache on this host" : NULL;
+  }
+
+  void close() {
+    index.reset();
+#ifndef _WIN32
+    if (base) {
+      munmap(base, bytes);
+    }
+#endif
+    base = NULL;
+    bytes = 0;
+    key = 0;
+    hit = false;
+    evicted = 0;
+    path.clear();
+  }
+
+  const SourceIndex &get() const { return *index; }
+  bool is_mapped() const { return base != NULL; }
+
+  uint64_t key;
+  std::string path;   // cache file, empty without one
+  bool hit;           // mapped from an earlier run's file
+  int evicted;        // files deleted to make room for this one
+
+private:
+#ifndef _WIN32
+  /* Maps path if it holds this index. */
+  bool map(int w, int h, int patch_w, int bits) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t) st.st_size >= sizeof(SourceCacheHeader)) {
+      p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (p != MAP_FAILED) {
+      futimens(fd, NULL);   // most recently used
+    }
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    base = (unsigned char *) p;
+    bytes = (size_t) st.st_size;
+
+    const SourceCacheHeader &hd = *(const SourceCacheHeader *) base;
+    SourceIndex sizes(w, h, patch_w, bits, NULL, NULL, NULL, NULL);
+    uint64_t offsets[4], sizes_bytes[4];
+    if (memcmp(hd.magic, SOURCE_CACHE_MAGIC, sizeof(hd.magic)) != 0 || hd.version != SOURCE_CACHE_VERSION ||
+        hd.header_bytes != sizeof(SourceCacheHeader) || hd.key != key || (int) hd.width != w ||
+        (int) hd.height != h || (int) hd.patch_w != patch_w || (int) hd.bits != bits ||
+        hd.file_bytes != bytes || source_cache_layout(sizes, offsets, sizes_bytes) != bytes) {
+      close_map();
+      return false;
+    }
+    const int *offset = (const int *) (base + offsets[2]);
+    bool ok = offset[0] == 0 && offset[sizes.offset_count() - 1] == (int) sizes.xy_count();
+    for (size_t k = 1; k < sizes.offset_count() && ok; ++k) {
+      ok = offset[k] >= offset[k - 1];
+    }
+    // corners are used as coordinates unchecked, so a damaged file would
+    // read outside the plane
+    const int *xy = (const int *) (base + offsets[3]);
+    for (size_t i = 0; i < sizes.xy_count() && ok; ++i) {
+      ok = xy[i] >= 0 && pm_unpack_x(xy[i]) < sizes.planes.ew && pm_unpack_y(xy[i]) < sizes.planes.eh;
+    }
+    if (!ok) {
+      close_map();
+      return false;
+    }
+    index.reset(new SourceIndex(w, h, patch_w, bits, base + offsets[0], (const int *) (base + offsets[1]), offset,
+                                xy));
+    return true;
+  }
+
+  void close_map() {
+    munmap(base, bytes);
+    base = NULL;
+    bytes = 0;
+  }
+
+  /* Writes the built index to path. Returns NULL, or what went wrong. */
+  const char *write() {
+    char tmp_suffix[32];
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".tmp%ld", (long) getpid());
+    std::string tmp = path + tmp_suffix;
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+      return "could not open cache file for writing";
+    }
+    uint64_t offsets[4], sizes[4];
+    SourceCacheHeader hd;
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, SOURCE_CACHE_MAGIC, sizeof(hd.magic));
+    hd.version = SOURCE_CACHE_VERSION;
+    hd.header_bytes = sizeof(SourceCacheHeader);
+    hd.width = index->planes.w;
+    hd.height = index->planes.h;
+    hd.patch_w = index->planes.patch_w;
+    hd.bits = index->bits;
+    hd.key = key;
+    hd.file_bytes = source_cache_layout(*index, offsets, sizes);
+    const void *data[4] = {index->planes.plane_data(), index->planes.sums_data(), index->offset_data(),
+                           index->xy_data()};
+
+    bool ok = fwrite(&hd, sizeof(hd), 1, f) == 1;
+    uint64_t at = sizeof(hd);
+    static const char zeros[SOURCE_CACHE_ALIGN] = {0};
+    for (int i = 0; i < 4 && ok; ++i) {
+      size_t pad = (size_t) (offsets[i] - at), n = (size_t) sizes[i];
+      ok = fwrite(zeros, 1, pad, f) == pad && (n == 0 || fwrite(data[i], 1, n, f) == n);
+      at = offsets[i] + n;
+    }
+    if (fclose(f) != 0 || !ok) {
+      unlink(tmp.c_str());
+      return "cache file write failed";
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return "could not rename cache file";
+    }
+    return NULL;
+  }
+#endif
+
+  CachedSourceIndex(const CachedSourceIndex &);
+  CachedSourceIndex &operator=(const CachedSourceIndex &);
+
+  std::unique_ptr<SourceIndex> index;
+  unsigned char *base;   // the mapped file of a hit
+  size_t bytes;
+};
+
+#endif
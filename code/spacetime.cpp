@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+#include "image_complete.h"
+#include "pm_spacetime.h"
+#include "profile.h"
+
+using namespace cv;
+using namespace std;
+
+int spacetime_window = 8;
+int spacetime_patch_t = 3;
+int spacetime_em_iters = 3;
+
+struct SpaceTimeRand {
+  int operator()() const { return pm_rand(); }
+};
+
+/* EM iterations over the window with the patch shape fixed at compile time. */
+template <int PW, int PT>
+static void spacetime_em(FrameRing &ring, vector<vector<float> > &accum) {
+  // distances add up over patch_t frames, so the weights widen with them
+  const GaussianWeightTable &weight = gaussian_weight_table(sigma * sqrt((double) spacetime_patch_t));
+  for (int em = 0; em < spacetime_em_iters; ++em) {
+    PROFILE_SCOPE_ARG("em_iteration", em);
+    SpaceTimeEngine<SpaceTimeL2Distance<PW, PT>, SpaceTimeRand> engine(
+        ring, SpaceTimeL2Distance<PW, PT>(ring, patch_w, spacetime_patch_t), patch_w, spacetime_patch_t, rs_max);
+    engine.init();
+    for (int iter = 0; iter < pm_iters; ++iter) {
+      engine.sweep(iter);
+    }
+    engine.vote(weight, accum);
+    if (engine.resolve(accum) < 0.02) {
+      break;
+    }
+  }
+}
+
+/* The specialized distance kernels, and the generic one for other shapes. */
+static const char *spacetime_run(FrameRing &ring, vector<vector<float> > &accum) {
+  int shape = patch_w * 100 + spacetime_patch_t;
+  switch (shape) {
+    case 503: spacetime_em<5, 3>(ring, accum); return "5x5x3";
+    case 703: spacetime_em<7, 3>(ring, accum); return "7x7x3";
+    case 705: spacetime_em<7, 5>(ring, accum); return "7x7x5";
+    case 903: spacetime_em<9, 3>(ring, accum); return "9x9x3";
+    default:  spacetime_em<0, 0>(ring, accum); return "generic";
+  }
+}
+
+SpaceTimeCompletion::SpaceTimeCompletion() : frames(0), seconds(0), kernel("none") {}
+
+SpaceTimeCompletion::~SpaceTimeCompletion() {}
+
+vector<Mat> SpaceTimeCompletion::push(Mat frame, Mat mask) {
+  PROFILE_SCOPE_ARG("spacetime_frame", frames);
+  double t = (double) getTickCount();
+  int window = std::max(spacetime_window, spacetime_patch_t);
+
+  // a frame of another size ends the window, which is handed back first
+  vector<Mat> done;
+  if (ring && (ring->width != frame.cols || ring->height != frame.rows)) {
+    done = flush();
+  }
+  if (!ring) {
+    ring.reset(new FrameRing(frame.cols, frame.rows, window));
+    accum.assign(window, vector<float>((size_t) frame.cols * frame.rows * 4, 0.0f));
+  }
+
+  // the oldest frame has had all its EM iterations once it drops out
+  if (ring->full()) {
+    done.push_back(Mat(ring->height, ring->width, CV_8UC3, ring->image(ring->slot(0))).clone());
+  }
+
+  int s = ring->push();
+  Mat image(ring->height, ring->width, CV_8UC3, ring->image(s));
+  Mat hole(ring->height, ring->width, CV_8UC1, ring->hole(s));
+  frame.copyTo(image);
+  threshold(mask, hole, 127, 255, 0);
+  ring->update_sources(s, patch_w);
+
+  // start the hole from the frame before, or from a single-frame completion
+  if (ring->size() > 1) {
+    Mat before(ring->height, ring->width, CV_8UC3, ring->image(ring->slot(ring->size() - 2)));
+    before.copyTo(image, hole);
+  } else {
+    image_complete(frame, hole, Mat::zeros(frame.size(), CV_8UC1)).copyTo(image);
+  }
+
+  if (ring->size() >= spacetime_patch_t) {
+    kernel = spacetime_run(*ring, accum);
+  }
+
+  double elapsed = ((double) getTickCount() - t) / getTickFrequency();
+  seconds += elapsed;
+  frames++;
+  printf("frame %d: %.1f ms\n", frames - 1, elapsed * 1000);
+  return done;
+}
+
+vector<Mat> SpaceTimeCompletion::flush() {
+  vector<Mat> rest;
+  for (int pos = 0; ring && pos < ring->size(); ++pos) {
+    rest.push_back(Mat(ring->height, ring->width, CV_8UC3, ring->image(ring->slot(pos))).clone());
+  }
+  ring.reset();
+  return rest;
+}
+
+void SpaceTimeCompletion::print(FILE *f) const {
+  fprintf(f, "space-time: %d frames in %.2f s, %.2f fps, window %d, %dx%dx%d patches (%s kernel%s)\n", frames,
+          seconds, seconds > 0 ? frames / seconds : 0.0, std::max(spacetime_window, spacetime_patch_t), patch_w,
+          patch_w, spacetime_patch_t, kernel,
+#ifdef __SSE2__
+          ", SSE2"
+#else
+          ""
+#endif
+          );
+}
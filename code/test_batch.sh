@@ -0,0 +1,38 @@
+#!/bin/sh
+# Batch test for pm_minimal: targets given by relative paths, matched on one
+# thread and on four, must give the same fields and reconstructions. Before
+# the temporary files of load_bitmap()/save_bitmap() were made unique, every
+# "../name.ext" path shared "../.raw" and concurrent targets overwrote each
+# other's images. Needs ImageMagick and g++, like pm_minimal itself.
+set -e
+cd "$(dirname "$0")"
+g++ -O2 -std=c++11 -msse2 -o pm_minimal_test pm_minimal.cpp -lpthread
+work=$(mktemp -d ../pm_batch_test.XXXXXX)
+trap 'rm -rf "$work" pm_minimal_test' EXIT
+
+convert -seed 1 -size 240x180 plasma:fractal "$work/b.ppm"
+for i in 0 1 2 3 4 5 6 7; do
+  convert -seed $((i + 2)) -size 160x120 plasma:fractal "$work/a$i.ppm"
+done
+
+for threads in 1 4; do
+  : > "$work/list$threads"
+  for i in 0 1 2 3 4 5 6 7; do
+    echo "$work/a$i.ppm $work/ann${i}_$threads.nnf $work/r${i}_$threads.ppm" >> "$work/list$threads"
+  done
+  ./pm_minimal_test --seed 5 --threads $threads --batch "$work/list$threads" "$work/b.ppm" > /dev/null
+done
+
+status=0
+for i in 0 1 2 3 4 5 6 7; do
+  for out in "ann${i}_%s.nnf" "r${i}_%s.ppm"; do
+    one=$(printf "$out" 1)
+    four=$(printf "$out" 4)
+    if ! cmp -s "$work/$one" "$work/$four"; then
+      echo "FAIL: $one and $four differ"
+      status=1
+    fi
+  done
+done
+[ $status -eq 0 ] && echo "batch: 8 targets, 1 and 4 threads agree"
+exit $status
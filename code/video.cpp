@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+#include "image_complete.h"
+#include "profile.h"
+
+using namespace cv;
+using namespace std;
+
+int video_em_iters = 5;
+int video_pm_iters = 2;
+int video_change_threshold = 12;
+
+/* Same size, type and pixels. */
+static bool same_mat(const Mat &a, const Mat &b) {
+  if (a.size() != b.size() || a.type() != b.type()) {
+    return false;
+  }
+  for (int y = 0; y < a.rows; ++y) {
+    if (memcmp(a.ptr(y), b.ptr(y), a.cols*a.elemSize()) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+VideoCompletion::VideoCompletion()
+    : frames(0), cold_frames(0), warm_frames(0), still_frames(0), seconds(0), hole_pixels(0),
+      recomputed_pixels(0) {}
+
+Mat VideoCompletion::next(Mat frame, Mat mask, Mat constraint) {
+  PROFILE_SCOPE_ARG("video_frame", frames);
+  double t = (double) getTickCount();
+  Mat hole;
+  threshold(mask, hole, 127, 255, 0);
+  Mat result = (prev_result.empty() || frame.size() != prev_frame.size()) ? cold(frame, hole, constraint)
+                                                                          : warm(frame, hole, constraint);
+  prev_frame = frame.clone();
+  prev_result = result;
+  double elapsed = ((double) getTickCount() - t) / getTickFrequency();
+  seconds += elapsed;
+  frames++;
+  printf("frame %d: %.1f ms\n", frames - 1, elapsed * 1000);
+  return result;
+}
+
+/* Keeps the dilated mask and constraint index while mask and constraint stay the same. */
+void VideoCompletion::prepare(Mat mask, Mat constraint) {
+  if (!dilated.empty() && same_mat(mask, prev_mask) && same_mat(constraint, prev_constraint)) {
+    return;
+  }
+  dilated = dilate_mask(mask);
+  getConstraintIndex(constraint, dilated, mask.cols - patch_w + 1, mask.rows - patch_w + 1, &cindex);
+  prev_mask = mask.clone();
+  prev_constraint = constraint.clone();
+}
+
+Mat VideoCompletion::cold(Mat frame, Mat mask, Mat constraint) {
+  cold_frames++;
+  int holes = countNonZero(mask);
+  hole_pixels += holes;
+  recomputed_pixels += holes;
+  Mat result = image_complete(frame, mask, constraint);
+
+  // the field of the result, for the next frame to start from
+  prepare(mask, constraint);
+  Mat B = result.clone();
+  bitwise_and(result, 0, B, mask);
+  BITMAP *nn = NULL, *nd = NULL;
+  patchmatch(result, B, nn, nd, dilated, constraint, &cindex);
+  ann.reset(nn);
+  annd.reset(nd);
+  return result;
+}
+
+Mat VideoCompletion::warm(Mat frame, Mat mask, Mat constraint) {
+  // pixels whose color or hole membership changed, grown by a patch
+  // either way: every hole pixel sharing a patch with one has to be redone
+  Mat diff, largest, changed, moved;
+  absdiff(frame, prev_frame, diff);
+  vector<Mat> channels;
+  split(diff, channels);
+  cv::max(channels[0], channels[1], largest);
+  cv::max(largest, channels[2], largest);
+  threshold(largest, changed, video_change_threshold, 255, 0);
+  bitwise_xor(mask, prev_mask, moved);
+  bitwise_or(changed, moved, changed);
+  Mat element = Mat::ones(2*patch_w - 1, 2*patch_w - 1, CV_8UC1);
+  dilate(changed, changed, element);
+  Mat target;
+  bitwise_and(mask, changed, target);
+
+  int holes = countNonZero(mask), redo = countNonZero(target);
+  hole_pixels += holes;
+  recomputed_pixels += redo;
+  prepare(mask, constraint);
+
+  // the known pixels of this frame, the hole of the last result
+  Mat img = frame.clone();
+  prev_result.copyTo(img, mask);
+  if (redo == 0) {
+    still_frames++;
+    return img;
+  }
+  warm_frames++;
+
+  Box box = getBox(target);
+  for (int im_iter = 0; im_iter < video_em_iters; ++im_iter) {
+    PROFILE_SCOPE_ARG("em_iteration", im_iter);
+    Mat B = img.clone();
+    bitwise_and(img, 0, B, mask);
+    patchmatch_refine(img, B, ann.get(), annd.get(), dilated, constraint, &cindex, box, video_pm_iters);
+
+    Mat R(img.rows, img.cols, CV_32FC3, Scalar(0, 0, 0));
+    Mat Rcount(img.rows, img.cols, CV_32FC3, Scalar(0, 0, 0));
+    vote(img, ann.get(), annd.get(), box, R, Rcount);
+    normalize_votes(R, Rcount);
+    R.convertTo(R, CV_8UC3);
+
+    Mat old_img = img.clone();
+    R.copyTo(img, target);
+
+    // same stopping rule as image_complete(), over the pixels being redone
+    if (im_iter > 0 && norm(img, old_img, NORM_L2SQR) / redo < 0.02) {
+      break;
+    }
+  }
+  return img;
+}
+
+void VideoCompletion::print(FILE *f) const {
+  fprintf(f, "video: %d frames in %.2f s, %.2f fps (%d from scratch, %d warm, %d unchanged near the hole)\n",
+          frames, seconds, seconds > 0 ? frames / seconds : 0.0, cold_frames, warm_frames, still_frames);
+  fprintf(f, "video: %.1f%% of hole pixels recomputed\n",
+          hole_pixels > 0 ? 100.0 * recomputed_pixels / hole_pixels : 0.0);
+}